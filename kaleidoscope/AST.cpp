@@ -1,133 +1,701 @@
 #include "AST.h"
+#include "CompilerSession.h"
 #include "ErrorHandler.h"
+#include "Profile.h"
+#include "Runtime.h"
+#include "Simplify.h"
 
-static AllocaInst* CreateEntryBlockAlloca(Function * func, StringRef varName){
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/IR/MDBuilder.h"
+
+static AllocaInst* CreateEntryBlockAlloca(CompilerSession &S, Function * func, StringRef varName,
+                                          Type *type = nullptr){
   IRBuilder<> tmpB(&func->getEntryBlock(), func->getEntryBlock().begin());
 
-  return tmpB.CreateAlloca(Type::getDoubleTy(*context), nullptr, varName);
+  if(!type)
+    type = Type::getDoubleTy(*S.context);
+  return tmpB.CreateAlloca(type, nullptr, varName);
 }
 
-Function *getFunction(std::string name){
-  if(auto *F = module->getFunction(name))
-    return F;
-  
-  auto FI = FunctionProtos.find(name);
-  if(FI != FunctionProtos.end())
-    return FI->second->codegen();
+Type *getLLVMType(CompilerSession &S, ToyType type) {
+  switch (type) {
+  case ToyType::Double:
+    return Type::getDoubleTy(*S.context);
+  case ToyType::Int:
+    return Type::getInt64Ty(*S.context);
+  case ToyType::Bool:
+    return Type::getInt1Ty(*S.context);
+  case ToyType::Array:
+    return PointerType::getUnqual(*S.context);
+  }
+  llvm_unreachable("unknown toy type");
+}
 
-  return nullptr;
+static std::optional<ToyType> getToyType(Type *type) {
+  if (type->isDoubleTy())
+    return ToyType::Double;
+  if (type->isIntegerTy(64))
+    return ToyType::Int;
+  if (type->isIntegerTy(1))
+    return ToyType::Bool;
+  if (type->isPointerTy())
+    return ToyType::Array;
+  return std::nullopt;
+}
+
+static bool isArray(Value *v) { return v->getType()->isPointerTy(); }
+
+// Type of `a op b` for arithmetic: bools count as ints, any double wins.
+static std::optional<ToyType> combineNumeric(std::optional<ToyType> a,
+                                             std::optional<ToyType> b) {
+  if (!a || !b || *a == ToyType::Array || *b == ToyType::Array)
+    return std::nullopt;
+  if (*a == ToyType::Double || *b == ToyType::Double)
+    return ToyType::Double;
+  return ToyType::Int;
+}
+
+// Converts a number between double, int and bool; nullptr for anything else.
+static Value *convertTo(CompilerSession &S, Value *v, Type *to) {
+  Type *from = v->getType();
+  if (from == to)
+    return v;
+  if (from->isPointerTy() || to->isPointerTy())
+    return nullptr;
+
+  if (to->isDoubleTy())
+    return from->isIntegerTy(1) ? S.builder->CreateUIToFP(v, to, "booltmp")
+                                : S.builder->CreateSIToFP(v, to, "inttmp");
+  if (to->isIntegerTy(1))
+    return from->isDoubleTy()
+               ? S.builder->CreateFCmpONE(v, ConstantFP::get(from, 0.0), "tobool")
+               : S.builder->CreateICmpNE(v, ConstantInt::get(from, 0), "tobool");
+  return from->isDoubleTy() ? S.builder->CreateFPToSI(v, to, "toint")
+                            : S.builder->CreateZExt(v, to, "toint");
+}
+
+// Branch condition: comparisons are used directly, numbers compare against 0.
+static Value *toCondition(CompilerSession &S, Value *v, const Twine &name) {
+  if (v->getType()->isIntegerTy(1))
+    return v;
+  if (v->getType()->isIntegerTy())
+    return S.builder->CreateICmpNE(v, ConstantInt::get(v->getType(), 0), name);
+  return S.builder->CreateFCmpONE(v, ConstantFP::get(*S.context, APFloat(0.0)), name);
+}
+
+bool assignmentsFit(CompilerSession &S, ExprAST &e, const std::string &name,
+                    ToyType type, const TypeEnv &env) {
+  if (auto *bin = dyn_cast<BinaryExprAST>(&e)) {
+    auto *dest = dyn_cast<VariableExprAST>(&bin->getLHS());
+    if (bin->getOp() == '=' && dest && dest->getName() == name) {
+      auto valType = bin->getRHS().inferType(S, env);
+      if (!valType || (*valType != type &&
+                       !(type == ToyType::Int && *valType == ToyType::Bool)))
+        return false;
+    }
+  }
+
+  bool fits = true;
+  e.forEachChild([&](std::unique_ptr<ExprAST> &child) {
+    fits = fits && assignmentsFit(S, *child, name, type, env);
+  });
+  return fits;
+}
+
+bool isAssigned(ExprAST &e, const std::string &name) {
+  if (auto *bin = dyn_cast<BinaryExprAST>(&e)) {
+    auto *dest = dyn_cast<VariableExprAST>(&bin->getLHS());
+    if (bin->getOp() == '=' && dest && dest->getName() == name)
+      return true;
+  }
+
+  bool found = false;
+  e.forEachChild([&](std::unique_ptr<ExprAST> &child) {
+    found = found || isAssigned(*child, name);
+  });
+  return found;
+}
+
+bool isIntCounter(ToyType startType, ExprAST *step, ExprAST &body, const std::string &name) {
+  auto *literal = dyn_cast_or_null<NumberExprAST>(step);
+  return (startType == ToyType::Int || startType == ToyType::Bool) &&
+         (!step || (literal && literal->isIntegerLiteral())) && !isAssigned(body, name);
+}
+
+Value *ExprAST::codegenAssign(CompilerSession &S, Value *val) {
+  return LogErrorV("destination of '=' must be a variable");
 }
 
 // NumberExprAST implementation
-NumberExprAST::NumberExprAST(double val) : val(val) {}
+NumberExprAST::NumberExprAST(double val, ToyType type)
+    : ExprAST(Number), val(val), type(type) {}
+
+Value *NumberExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
+  if (type == ToyType::Bool)
+    return ConstantInt::getBool(*S.context, val != 0.0);
+  if (type == ToyType::Int)
+    return ConstantInt::get(Type::getInt64Ty(*S.context), (int64_t)val, /*IsSigned=*/true);
+  return ConstantFP::get(*S.context, APFloat(val));
+}
 
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(*context, APFloat(val));
+std::optional<ToyType> NumberExprAST::inferType(CompilerSession &S, const TypeEnv &env) const {
+  return type;
 }
 
-Value *VariableExprAST::codegen() {
-  AllocaInst *a = namedValues[name];
+std::optional<ToyType> VariableExprAST::inferType(CompilerSession &S, const TypeEnv &env) const {
+  auto EI = env.find(name);
+  if (EI != env.end())
+    return EI->second;
+
+  auto VI = S.namedValues.find(name);
+  if (VI == S.namedValues.end() || !VI->second)
+    return std::nullopt;
+  return getToyType(VI->second->getAllocatedType());
+}
+
+Value *VariableExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
+  AllocaInst *a = S.namedValues[name];
 
   if(!a)
     return LogErrorV("Unknown variable name");
   
-  return builder->CreateLoad(a->getAllocatedType(), a, name.c_str());
+  return S.builder->CreateLoad(a->getAllocatedType(), a, name.c_str());
+}
+
+Value *VariableExprAST::codegenAssign(CompilerSession &S, Value *val) {
+  AllocaInst *variable = S.namedValues[name];
+  if(!variable)
+    return LogErrorV("unknown variable name");
+
+  Value *stored = convertTo(S, val, variable->getAllocatedType());
+  if(!stored)
+    return LogErrorV("cannot change the type of a variable");
+
+  S.builder->CreateStore(stored, variable);
+  return val;
+}
+
+//===----------------------------------------------------------------------===//
+// Arrays
+//===----------------------------------------------------------------------===//
+
+static StructType *getArrayDescriptorType(CompilerSession &S) {
+  Type *ptrTy = PointerType::getUnqual(*S.context);
+  return StructType::get(*S.context, {ptrTy, Type::getInt64Ty(*S.context)});
+}
+
+// Loads the data pointer of arr; the runtime aligns it to ToyArrayAlign.
+static Value *loadArrayData(CompilerSession &S, Value *arr) {
+  Value *data = S.builder->CreateLoad(PointerType::getUnqual(*S.context), arr, "data");
+  S.builder->CreateAlignmentAssumption(S.module->getDataLayout(), data, ToyArrayAlign);
+  return data;
+}
+
+static Value *loadArrayLength(CompilerSession &S, Value *arr) {
+  Value *lengthPtr = S.builder->CreateStructGEP(getArrayDescriptorType(S), arr, 1);
+  return S.builder->CreateLoad(Type::getInt64Ty(*S.context), lengthPtr, "len");
+}
+
+static Value *arrayElementPtr(CompilerSession &S, Value *data, Value *index) {
+  index = convertTo(S, index, Type::getInt64Ty(*S.context));
+  return S.builder->CreateInBoundsGEP(Type::getDoubleTy(*S.context), data, index, "elt");
+}
+
+// idx as an i64 index into arr. An index outside the array is reported at
+// run time (see toy_index_out_of_bounds) instead of being accessed.
+static Value *emitCheckedIndex(CompilerSession &S, Value *arr, Value *idx) {
+  Type *doubleTy = S.builder->getDoubleTy();
+  Type *i64Ty = S.builder->getInt64Ty();
+  Value *length = loadArrayLength(S, arr);
+  Value *inBounds;
+  if (idx->getType()->isDoubleTy()) {
+    // Compared as doubles, so that NaN and numbers beyond the i64 range fail.
+    inBounds = S.builder->CreateAnd(
+        S.builder->CreateFCmpOGE(idx, ConstantFP::get(doubleTy, 0.0)),
+        S.builder->CreateFCmpOLT(idx, S.builder->CreateSIToFP(length, doubleTy)),
+        "inbounds");
+  } else {
+    idx = convertTo(S, idx, i64Ty);
+    // A negative index is a huge unsigned one.
+    inBounds = S.builder->CreateICmpULT(idx, length, "inbounds");
+  }
+
+  Function *f = S.builder->GetInsertBlock()->getParent();
+  BasicBlock *failBB = BasicBlock::Create(*S.context, "outofbounds", f);
+  BasicBlock *okBB = BasicBlock::Create(*S.context, "inbounds", f);
+  S.builder->CreateCondBr(inBounds, okBB, failBB,
+                          MDBuilder(*S.context).createBranchWeights(1 << 20, 1));
+
+  S.builder->SetInsertPoint(failBB);
+  FunctionCallee fail = S.module->getOrInsertFunction(
+      "toy_index_out_of_bounds", S.builder->getVoidTy(), doubleTy, i64Ty);
+  if (auto *failFn = dyn_cast<Function>(fail.getCallee())) {
+    failFn->setDoesNotReturn();
+    failFn->addFnAttr(Attribute::Cold);
+  }
+  S.builder->CreateCall(fail, {convertTo(S, idx, doubleTy), length});
+  S.builder->CreateUnreachable();
+
+  S.builder->SetInsertPoint(okBB);
+  return convertTo(S, idx, i64Ty);
+}
+
+static Value *createArray(CompilerSession &S, Value *length) {
+  Type *ptrTy = PointerType::getUnqual(*S.context);
+  FunctionCallee alloc = S.module->getOrInsertFunction(
+      "toy_array_alloc", ptrTy, ptrTy, Type::getDoubleTy(*S.context));
+
+  // Defined by each JIT'd session as the address of its arena, so that the
+  // code does not depend on the process that compiled it.
+  Value *arena = S.module->getOrInsertGlobal("__toy_arena", S.builder->getInt8Ty());
+  length = convertTo(S, length, Type::getDoubleTy(*S.context));
+  return S.builder->CreateCall(alloc, {arena, length}, "array");
+}
+
+// --profile instrumentation: the counter lives in the session's Profile and
+// its address is baked into the code.
+static Value *readCycleCounter(CompilerSession &S) {
+  return S.builder->CreateIntrinsic(Intrinsic::readcyclecounter, {}, {}, nullptr, "cycles");
+}
+
+// Applies op with delta to a ProfileCounter field; returns the old value.
+static Value *updateCounter(CompilerSession &S, std::atomic<uint64_t> &field, Value *delta,
+                            AtomicRMWInst::BinOp op = AtomicRMWInst::Add) {
+  Value *ptr = ConstantExpr::getIntToPtr(
+      S.builder->getInt64(reinterpret_cast<uint64_t>(&field)),
+      PointerType::getUnqual(*S.context));
+  return S.builder->CreateAtomicRMW(op, ptr, delta, MaybeAlign(8), AtomicOrdering::Monotonic);
+}
+
+// Start of a counted function call or loop run; returns its start cycles.
+static Value *enterCounter(CompilerSession &S, ProfileCounter *counter) {
+  updateCounter(S, counter->depth, S.builder->getInt64(1));
+  return readCycleCounter(S);
+}
+
+// End of what enterCounter started. Only the outermost of nested runs, e.g.
+// of a recursive function, adds its cycles: the inner ones are part of them.
+static void leaveCounter(CompilerSession &S, ProfileCounter *counter, Value *startCycles) {
+  Value *elapsed = S.builder->CreateSub(readCycleCounter(S), startCycles);
+  Value *depth = updateCounter(S, counter->depth, S.builder->getInt64(1), AtomicRMWInst::Sub);
+  Value *outermost = S.builder->CreateICmpEQ(depth, S.builder->getInt64(1), "outermost");
+  updateCounter(S, counter->cycles,
+                S.builder->CreateSelect(outermost, elapsed, S.builder->getInt64(0)));
+}
+
+// --safepoints: a poll loads the thread's pending word, fetched once at
+// function entry, and calls into the runtime only when it is set.
+static void emitSafepointPoll(CompilerSession &S) {
+  if (!S.safepointFlag)
+    return;
+
+  Function *f = S.builder->GetInsertBlock()->getParent();
+  LoadInst *pending = S.builder->CreateAlignedLoad(
+      S.builder->getInt32Ty(), S.safepointFlag, Align(4), "pending");
+  pending->setAtomic(AtomicOrdering::Monotonic);
+
+  BasicBlock *pollBB = BasicBlock::Create(*S.context, "safepoint", f);
+  BasicBlock *contBB = BasicBlock::Create(*S.context, "aftersafepoint", f);
+  S.builder->CreateCondBr(S.builder->CreateICmpNE(pending, S.builder->getInt32(0)),
+                          pollBB, contBB,
+                          MDBuilder(*S.context).createBranchWeights(1, 1 << 20));
+
+  S.builder->SetInsertPoint(pollBB);
+  FunctionCallee slow = S.module->getOrInsertFunction(
+      "toy_safepoint_slow", S.builder->getVoidTy(), S.builder->getPtrTy());
+  S.builder->CreateCall(slow, S.safepointFlag);
+  S.builder->CreateBr(contBB);
+  S.builder->SetInsertPoint(contBB);
+}
+
+static void beginSafepoints(CompilerSession &S) {
+  S.safepointFlag = nullptr;
+  if (!S.safepoints)
+    return;
+
+  FunctionCallee get =
+      S.module->getOrInsertFunction("toy_safepoint", S.builder->getPtrTy());
+  // Not readnone: the result is the calling thread's, which LLVM does not
+  // model, so the call must not be treated as a constant it may fold.
+  if (auto *getFn = dyn_cast<Function>(get.getCallee())) {
+    getFn->setDoesNotThrow();
+    getFn->setWillReturn();
+  }
+  S.safepointFlag = S.builder->CreateCall(get, {}, "safepoint");
+  emitSafepointPoll(S);
+}
+
+// Emits `for (i = 0; i < n; ++i) body(i)` with an i64 induction variable, the
+// shape the loop vectorizer handles best.
+static void emitCountedLoop(CompilerSession &S, Value *n,
+                            function_ref<void(Value *)> body) {
+  Function *f = S.builder->GetInsertBlock()->getParent();
+  Type *i64Ty = Type::getInt64Ty(*S.context);
+  Value *zero = ConstantInt::get(i64Ty, 0);
+
+  BasicBlock *preheaderBB = S.builder->GetInsertBlock();
+  BasicBlock *loopBB = BasicBlock::Create(*S.context, "arrayloop", f);
+  BasicBlock *afterBB = BasicBlock::Create(*S.context, "afterarrayloop", f);
+  S.builder->CreateCondBr(S.builder->CreateICmpSGT(n, zero), loopBB, afterBB);
+
+  S.builder->SetInsertPoint(loopBB);
+  PHINode *i = S.builder->CreatePHI(i64Ty, 2, "i");
+  i->addIncoming(zero, preheaderBB);
+
+  body(i);
+
+  Value *next = S.builder->CreateAdd(i, ConstantInt::get(i64Ty, 1), "next",
+                                     /*HasNUW=*/true, /*HasNSW=*/true);
+  i->addIncoming(next, S.builder->GetInsertBlock());
+  S.builder->CreateCondBr(S.builder->CreateICmpSLT(next, n), loopBB, afterBB);
+
+  S.builder->SetInsertPoint(afterBB);
+}
+
+Value *IndexExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
+  Value *arr = array->codegen(S);
+  Value *idx = index->codegen(S);
+  if(!arr || !idx)
+    return nullptr;
+
+  if(!isArray(arr) || isArray(idx))
+    return LogErrorV("only arrays can be indexed, by a number");
+
+  idx = emitCheckedIndex(S, arr, idx);
+  Value *elt = arrayElementPtr(S, loadArrayData(S, arr), idx);
+  return S.builder->CreateLoad(Type::getDoubleTy(*S.context), elt, "eltval");
+}
+
+Value *IndexExprAST::codegenAssign(CompilerSession &S, Value *val) {
+  Value *arr = array->codegen(S);
+  Value *idx = index->codegen(S);
+  if(!arr || !idx)
+    return nullptr;
+
+  if(!isArray(arr) || isArray(idx) || isArray(val))
+    return LogErrorV("only numbers can be stored into arrays");
+
+  idx = emitCheckedIndex(S, arr, idx);
+  S.builder->CreateStore(convertTo(S, val, Type::getDoubleTy(*S.context)),
+                         arrayElementPtr(S, loadArrayData(S, arr), idx));
+  return val;
+}
+
+Value *CallExprAST::codegenBuiltin(CompilerSession &S) {
+  Type *doubleTy = Type::getDoubleTy(*S.context);
+
+  if(callee == "map"){
+    auto *fnName = args.size() == 2 ? dyn_cast<VariableExprAST>(args[0].get()) : nullptr;
+    if(!fnName)
+      return LogErrorV("map expects a function name and an array");
+
+    Function *fn = S.getFunction(fnName->getName());
+    if(!fn || fn->arg_size() != 1 || !fn->getArg(0)->getType()->isDoubleTy() ||
+       !fn->getReturnType()->isDoubleTy())
+      return LogErrorV("map expects a function from number to number");
+
+    Value *in = args[1]->codegen(S);
+    if(!in)
+      return nullptr;
+    if(!isArray(in))
+      return LogErrorV("map expects an array");
+
+    Value *n = loadArrayLength(S, in);
+    Value *out = createArray(S, S.builder->CreateSIToFP(n, doubleTy));
+    Value *inData = loadArrayData(S, in);
+    Value *outData = loadArrayData(S, out);
+
+    // The result is a fresh allocation, so tell the vectorizer it cannot
+    // overlap the input.
+    MDBuilder MDB(*S.context);
+    MDNode *domain = MDB.createAnonymousAliasScopeDomain("map");
+    MDNode *inScope = MDNode::get(*S.context, MDB.createAnonymousAliasScope(domain, "in"));
+    MDNode *outScope = MDNode::get(*S.context, MDB.createAnonymousAliasScope(domain, "out"));
+
+    emitCountedLoop(S, n, [&](Value *i) {
+      LoadInst *x = S.builder->CreateLoad(doubleTy, arrayElementPtr(S, inData, i), "x");
+      x->setMetadata(LLVMContext::MD_alias_scope, inScope);
+      x->setMetadata(LLVMContext::MD_noalias, outScope);
+      Value *y = S.builder->CreateCall(fn, x, "y");
+      StoreInst *store = S.builder->CreateStore(y, arrayElementPtr(S, outData, i));
+      store->setMetadata(LLVMContext::MD_alias_scope, outScope);
+      store->setMetadata(LLVMContext::MD_noalias, inScope);
+    });
+    return out;
+  }
+
+  std::vector<Value *> argsV;
+  for (auto &arg : args) {
+    argsV.push_back(arg->codegen(S));
+    if (!argsV.back())
+      return nullptr;
+  }
+
+  if(callee == "array"){
+    if(argsV.size() != 1 || isArray(argsV[0]))
+      return LogErrorV("array expects a length");
+    return createArray(S, argsV[0]);
+  }
+
+  for (Value *arg : argsV)
+    if (!isArray(arg))
+      return LogErrorV("expected an array argument");
+
+  if(callee == "len"){
+    if(argsV.size() != 1)
+      return LogErrorV("len expects one array");
+    return S.builder->CreateSIToFP(loadArrayLength(S, argsV[0]), doubleTy, "lentmp");
+  }
+
+  bool isDot = callee == "dot";
+  if(argsV.size() != (isDot ? 2u : 1u))
+    return LogErrorV(isDot ? "dot expects two arrays" : "sum expects one array");
+
+  Value *n = loadArrayLength(S, argsV[0]);
+  if(isDot)
+    n = S.builder->CreateBinaryIntrinsic(Intrinsic::smin, n, loadArrayLength(S, argsV[1]));
+
+  Value *a = loadArrayData(S, argsV[0]);
+  Value *b = isDot ? loadArrayData(S, argsV[1]) : nullptr;
+
+  // The accumulator lives in an alloca that mem2reg turns into a phi;
+  // reassociation lets the vectorizer split it into vector partial sums.
+  Function *f = S.builder->GetInsertBlock()->getParent();
+  AllocaInst *acc = CreateEntryBlockAlloca(S, f, "acc");
+  S.builder->CreateStore(ConstantFP::get(doubleTy, 0.0), acc);
+
+  IRBuilder<>::FastMathFlagGuard guard(*S.builder);
+  FastMathFlags FMF;
+  FMF.setAllowReassoc();
+  S.builder->setFastMathFlags(FMF);
+
+  emitCountedLoop(S, n, [&](Value *i) {
+    Value *x = S.builder->CreateLoad(doubleTy, arrayElementPtr(S, a, i), "x");
+    if(isDot)
+      x = S.builder->CreateFMul(x, S.builder->CreateLoad(doubleTy, arrayElementPtr(S, b, i), "y"));
+    Value *sum = S.builder->CreateFAdd(S.builder->CreateLoad(doubleTy, acc), x, "sum");
+    S.builder->CreateStore(sum, acc);
+  });
+
+  return S.builder->CreateLoad(doubleTy, acc, "acc");
 }
 
 // BinaryExprAST implementation
 BinaryExprAST::BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
                              std::unique_ptr<ExprAST> RHS)
-    : op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    : ExprAST(Binary), op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+
+// Looks up the declared return type of a (possibly not yet emitted) function.
+static std::optional<ToyType> getReturnType(CompilerSession &S, const std::string &name) {
+  auto FI = S.FunctionProtos.find(name);
+  if (FI != S.FunctionProtos.end())
+    return FI->second->getReturnType();
+  if (Function *F = S.module->getFunction(name))
+    return getToyType(F->getReturnType());
+  return std::nullopt;
+}
 
-Value *BinaryExprAST::codegen() {
+std::optional<ToyType> BinaryExprAST::inferType(CompilerSession &S, const TypeEnv &env) const {
+  switch (op) {
+  case '=':
+    return RHS->inferType(S, env);
+  case '<':
+    return ToyType::Bool;
+  case '+':
+  case '-':
+  case '*':
+    return combineNumeric(LHS->inferType(S, env), RHS->inferType(S, env));
+  default:
+    return getReturnType(S, std::string("binary") + op);
+  }
+}
+
+Value *BinaryExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
   if(op == '='){
-    VariableExprAST * LHSE = static_cast<VariableExprAST*>(LHS.get());
-    if(!LHSE)
-      return LogErrorV("destination of '=' must be a variable");
-    
-    Value *val = RHS->codegen();
+    Value *val = RHS->codegen(S);
     if(!val)
       return nullptr;
-    
-    Value *variable = namedValues[LHSE->getName()];
-    if(!variable)
-      return LogErrorV("unknown variable name");
-    
-    builder->CreateStore(val, variable);
-    return val;
+
+    return LHS->codegenAssign(S, val);
   }
 
-  Value *l = LHS->codegen();
-  Value *r = RHS->codegen();
+  Value *l = LHS->codegen(S);
+  Value *r = RHS->codegen(S);
 
   if (!l || !r)
     return nullptr;
 
-  switch (op) {
-  case '+':
-    return builder->CreateFAdd(l, r, "addtmp");
+  if (isArray(l) || isArray(r))
+    return LogErrorV("operators are not defined on arrays");
 
-  case '-':
-    return builder->CreateFSub(l, r, "subtmp");
+  if (op == '+' || op == '-' || op == '*' || op == '<') {
+    // Integer arithmetic unless a double is involved; '<' yields a bool that
+    // branches use directly.
+    bool fp = l->getType()->isDoubleTy() || r->getType()->isDoubleTy();
+    Type *common = fp ? Type::getDoubleTy(*S.context) : Type::getInt64Ty(*S.context);
+    l = convertTo(S, l, common);
+    r = convertTo(S, r, common);
 
-  case '*':
-    return builder->CreateFMul(l, r, "multmp");
+    switch (op) {
+    case '+':
+      return fp ? S.builder->CreateFAdd(l, r, "addtmp") : S.builder->CreateAdd(l, r, "addtmp");
 
-  case '<':
-    l = builder->CreateFCmpULT(l, r, "cmptmp");
+    case '-':
+      return fp ? S.builder->CreateFSub(l, r, "subtmp") : S.builder->CreateSub(l, r, "subtmp");
 
-    return builder->CreateUIToFP(l, Type::getDoubleTy(*context), "booltmp");
+    case '*':
+      return fp ? S.builder->CreateFMul(l, r, "multmp") : S.builder->CreateMul(l, r, "multmp");
 
-  default:
-    break;
+    case '<':
+      return fp ? S.builder->CreateFCmpULT(l, r, "cmptmp") : S.builder->CreateICmpSLT(l, r, "cmptmp");
+    }
   }
-  Function *f = getFunction(std::string("binary") + op);
+  Function *f = S.getFunction(std::string("binary") + op);
   assert(f && "binary operator not found");
 
-  Value *ops[2] = {l, r};
+  Value *ops[2] = {convertTo(S, l, f->getArg(0)->getType()),
+                   convertTo(S, r, f->getArg(1)->getType())};
 
-  return builder->CreateCall(f, ops, "binop");
+  return S.builder->CreateCall(f, ops, "binop");
 }
 
 // CallExprAST implementation
 CallExprAST::CallExprAST(const std::string &callee,
                          std::vector<std::unique_ptr<ExprAST>> args)
-    : callee(callee), args(std::move(args)) {}
+    : ExprAST(Call), callee(callee), args(std::move(args)) {}
+
+static bool isBuiltin(const std::string &name) {
+  return name == "array" || name == "len" || name == "sum" || name == "dot" ||
+         name == "map";
+}
 
-Value *CallExprAST::codegen() {
-  Function *calleeF = getFunction(callee);
+Value *CallExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
+  Function *calleeF = S.getFunction(callee);
+  if (!calleeF && isBuiltin(callee))
+    return codegenBuiltin(S);
   if (!calleeF)
     return LogErrorV("Unknown function referenced");
 
   if (calleeF->arg_size() != args.size())
     return LogErrorV("Incorrect # arguments passed");
 
+  // Literal arguments are already folded into a specialization; pass the rest.
+  Function *specF = getSpecialization(S);
+
   std::vector<Value *> argsV;
 
   for (unsigned i = 0, e = args.size(); i < e; ++i) {
-    argsV.push_back(args[i]->codegen());
-    if (!argsV.back())
+    if (specF && isa<NumberExprAST>(args[i].get()) &&
+        !calleeF->getArg(i)->getType()->isPointerTy())
+      continue;
+    Value *arg = args[i]->codegen(S);
+    if (!arg)
       return nullptr;
+    argsV.push_back(convertTo(S, arg, calleeF->getArg(i)->getType()));
+    if (!argsV.back())
+      return LogErrorV("Argument type does not match the prototype");
   }
-  return builder->CreateCall(calleeF, argsV, "calltmp");
+  return S.builder->CreateCall(specF ? specF : calleeF, argsV, "calltmp");
+}
+
+std::optional<ToyType> CallExprAST::inferType(CompilerSession &S, const TypeEnv &env) const {
+  if (auto type = getReturnType(S, callee))
+    return type;
+  if (callee == "array" || callee == "map")
+    return ToyType::Array;
+  if (isBuiltin(callee))
+    return ToyType::Double;
+  return std::nullopt;
+}
+
+// Largest body (in AST nodes) worth copying per constant signature, and how
+// many copies one function may get.
+static constexpr unsigned SpecializeMaxBodySize = 128;
+static constexpr unsigned SpecializeMaxVariants = 8;
+
+static unsigned countNodes(ExprAST &e) {
+  unsigned n = 1;
+  e.forEachChild([&](std::unique_ptr<ExprAST> &child) { n += countNodes(*child); });
+  return n;
+}
+
+Function *CallExprAST::getSpecialization(CompilerSession &S) {
+  auto DI = S.FunctionDefs.find(callee);
+  if (DI == S.FunctionDefs.end())
+    return nullptr;
+  FunctionAST &def = *DI->second;
+  const PrototypeAST &proto = def.getProto();
+  if (proto.getArgs().size() != args.size())
+    return nullptr;
+
+  // Signature: which arguments are literals, and their values.
+  std::vector<std::optional<double>> consts(args.size());
+  std::string name = callee + ".spec(";
+  bool anyConst = false;
+  for (unsigned i = 0, e = args.size(); i != e; ++i) {
+    if (i)
+      name += ',';
+    auto *num = dyn_cast<NumberExprAST>(args[i].get());
+    if (!num || proto.getArgTypes()[i] == ToyType::Array) {
+      name += '_';
+      continue;
+    }
+    consts[i] = num->getValue();
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", num->getValue());
+    name += buf;
+    anyConst = true;
+  }
+  name += ')';
+  if (!anyConst)
+    return nullptr;
+
+  if (Function *F = S.getFunction(name))
+    return F;
+
+  auto &variants = S.Specializations[callee];
+  if (variants.size() >= SpecializeMaxVariants ||
+      countNodes(def.getBody()) > SpecializeMaxBodySize)
+    return nullptr;
+
+  Function *F = def.codegenSpecialized(S, name, consts);
+  if (!F) {
+    S.FunctionProtos.erase(name);
+    return nullptr;
+  }
+  variants.push_back({name, consts});
+  S.NewSpecializations.push_back(name);
+  return F;
 }
 
 // PrototypeAST implementation
 PrototypeAST::PrototypeAST(const std::string &name,
-                           std::vector<std::string> args, bool isOperator, unsigned prec)
-    : name(name), args(std::move(args)), isOperator(isOperator), precedence(prec) {}
+                           std::vector<std::string> args, bool isOperator, unsigned prec,
+                           std::vector<ToyType> argTypes, ToyType returnType)
+    : name(name), args(std::move(args)), isOperator(isOperator), precedence(prec),
+      argTypes(std::move(argTypes)), returnType(returnType) {
+  if (this->argTypes.empty())
+    this->argTypes.assign(this->args.size(), ToyType::Double);
+}
 
 const std::string &PrototypeAST::getName() const { return name; }
 
-Function *PrototypeAST::codegen() {
+Function *PrototypeAST::codegen(CompilerSession &S) {
 
-  std::vector<Type *> Doubles(args.size(), Type::getDoubleTy(*context));
+  std::vector<Type *> argTys;
+  for (ToyType type : argTypes)
+    argTys.push_back(getLLVMType(S, type));
 
   FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(*context), Doubles, false);
+      FunctionType::get(getLLVMType(S, returnType), argTys, false);
 
   Function *F =
-      Function::Create(FT, Function::ExternalLinkage, name, module.get());
+      Function::Create(FT, Function::ExternalLinkage, name, S.module.get());
 
   unsigned idX = 0;
   for (auto &arg : F->args())
@@ -136,39 +704,249 @@ Function *PrototypeAST::codegen() {
   return F;
 }
 
+hash_code PrototypeAST::hash() const {
+  hash_code h = hash_combine(name, isOperator, precedence, (int)returnType);
+  for (size_t i = 0; i < args.size(); ++i)
+    h = hash_combine(h, args[i], (int)argTypes[i]);
+  return h;
+}
+
 // FunctionAST implementation
 FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> proto,
                          std::unique_ptr<ExprAST> body)
     : proto(std::move(proto)), body(std::move(body)) {}
 
-Function *FunctionAST::codegen() {
+Function *FunctionAST::codegen(CompilerSession &S) {
   auto &p = *proto;
 
-  FunctionProtos[proto->getName()] = std::move(proto);
+  // Keep our own prototype so the definition can be emitted again later.
+  S.FunctionProtos[proto->getName()] = std::make_unique<PrototypeAST>(p);
+  S.DefinedFunctions.insert(p.getName());
 
-  Function *f = getFunction(p.getName());
+  Function *f = S.getFunction(p.getName());
   if(!f)
     return nullptr;
 
   if(p.isBinaryOp())
-    BinopPrecedence[p.getOperatorName()] = p.getBinaryPrecedence();
+    S.BinopPrecedence[p.getOperatorName()] = p.getBinaryPrecedence();
 
-  BasicBlock *BB = BasicBlock::Create(*context, "entry", f);
-  builder->SetInsertPoint(BB);
+  if (memoized)
+    return codegenMemoized(S, f);
+  return codegenBody(S, f, {});
+}
 
-  namedValues.clear();
+// A number as the bits of an i64, the form memo table keys and results take.
+static Value *toMemoBits(CompilerSession &S, Value *v) {
+  Type *i64Ty = S.builder->getInt64Ty();
+  if (v->getType()->isDoubleTy())
+    return S.builder->CreateBitCast(v, i64Ty);
+  return S.builder->CreateZExt(v, i64Ty);
+}
+
+static Value *fromMemoBits(CompilerSession &S, Value *bits, Type *type) {
+  if (type->isDoubleTy())
+    return S.builder->CreateBitCast(bits, type);
+  return S.builder->CreateTrunc(bits, type);
+}
+
+// A `memo def`: the body is emitted as f.memo, and f looks its arguments up in
+// the session's memo table (see Runtime.h) before calling it. Recursive calls
+// go through f too, so each distinct call is computed once.
+Function *FunctionAST::codegenMemoized(CompilerSession &S, Function *f) {
+  std::string error;
+  if (proto->getReturnType() == ToyType::Array ||
+      is_contained(proto->getArgTypes(), ToyType::Array))
+    error = "memo def cannot take or return arrays";
+  else if (f->arg_size() > MaxMemoArgs)
+    error = "memo def takes at most " + std::to_string(MaxMemoArgs) + " arguments";
+  if (!error.empty()) {
+    f->eraseFromParent();
+    LogError(error.c_str());
+    return nullptr;
+  }
+
+  Function *bodyFn = Function::Create(f->getFunctionType(), Function::InternalLinkage,
+                                      f->getName() + ".memo", S.module.get());
+  if (!codegenBody(S, bodyFn, {})) {
+    f->eraseFromParent();
+    return nullptr;
+  }
+
+  Type *i64Ty = S.builder->getInt64Ty();
+  Type *ptrTy = S.builder->getPtrTy();
+  unsigned numArgs = f->arg_size();
+  FunctionCallee lookup = S.module->getOrInsertFunction(
+      "toy_memo_lookup", S.builder->getInt32Ty(), ptrTy, ptrTy,
+      S.builder->getInt32Ty(), ptrTy, ptrTy);
+  FunctionCallee insert = S.module->getOrInsertFunction(
+      "toy_memo_insert", S.builder->getVoidTy(), ptrTy, ptrTy,
+      S.builder->getInt32Ty(), ptrTy, i64Ty);
+  // Defined by each JIT'd session as the address of its memo table.
+  Value *table = S.module->getOrInsertGlobal("__toy_memo", S.builder->getInt8Ty());
+
+  BasicBlock *entryBB = BasicBlock::Create(*S.context, "entry", f);
+  BasicBlock *hitBB = BasicBlock::Create(*S.context, "memohit", f);
+  BasicBlock *missBB = BasicBlock::Create(*S.context, "memomiss", f);
+  S.builder->SetInsertPoint(entryBB);
+  ArrayType *keyTy = ArrayType::get(i64Ty, std::max(numArgs, 1u));
+  Value *key = S.builder->CreateAlloca(keyTy, nullptr, "memokey");
+  Value *cached = S.builder->CreateAlloca(i64Ty, nullptr, "memoresult");
+  std::vector<Value *> args;
+  for (auto &arg : f->args()) {
+    args.push_back(&arg);
+    S.builder->CreateStore(toMemoBits(S, &arg),
+                           S.builder->CreateConstInBoundsGEP2_32(keyTy, key, 0,
+                                                                 arg.getArgNo()));
+  }
+  Value *found = S.builder->CreateCall(
+      lookup, {table, f, S.builder->getInt32(numArgs), key, cached});
+  S.builder->CreateCondBr(S.builder->CreateICmpNE(found, S.builder->getInt32(0)),
+                          hitBB, missBB);
+
+  S.builder->SetInsertPoint(hitBB);
+  S.builder->CreateRet(fromMemoBits(
+      S, S.builder->CreateLoad(i64Ty, cached), f->getReturnType()));
+
+  S.builder->SetInsertPoint(missBB);
+  Value *result = S.builder->CreateCall(bodyFn, args, "result");
+  S.builder->CreateCall(insert, {table, f, S.builder->getInt32(numArgs), key,
+                                 toMemoBits(S, result)});
+  S.builder->CreateRet(result);
+
+  verifyFunction(*f);
+  S.FPM->run(*f, *S.FAM);
+  return f;
+}
+
+void FunctionAST::simplify() { simplifyExpr(body, getArgumentTypes(*proto, *body)); }
+
+std::optional<double> FunctionAST::getConstantValue() const {
+  if (auto *num = dyn_cast<NumberExprAST>(body.get()))
+    return num->getValue();
+  return std::nullopt;
+}
+
+static hash_code hashExpr(ExprAST &e, std::set<std::string> &callees) {
+  if (auto *call = dyn_cast<CallExprAST>(&e))
+    callees.insert(call->getCallee());
+  else if (auto *unary = dyn_cast<UnaryExprAST>(&e))
+    callees.insert(std::string("unary") + unary->getOpcode());
+  else if (auto *bin = dyn_cast<BinaryExprAST>(&e))
+    if (!StringRef("=<+-*").contains(bin->getOp()))
+      callees.insert(std::string("binary") + bin->getOp());
+
+  hash_code h = e.hashNode();
+  e.forEachChild([&](std::unique_ptr<ExprAST> &child) {
+    h = hash_combine(h, hashExpr(*child, callees));
+  });
+  return h;
+}
+
+hash_code FunctionAST::hashBody(std::set<std::string> &callees) const {
+  return hashExpr(*body, callees);
+}
+
+static bool sameExpr(ExprAST &a, ExprAST &b) {
+  if (!a.sameNode(b))
+    return false;
+  std::vector<ExprAST *> aChildren, bChildren;
+  a.forEachChild([&](std::unique_ptr<ExprAST> &child) { aChildren.push_back(child.get()); });
+  b.forEachChild([&](std::unique_ptr<ExprAST> &child) { bChildren.push_back(child.get()); });
+  if (aChildren.size() != bChildren.size())
+    return false;
+  for (unsigned i = 0, e = aChildren.size(); i != e; ++i)
+    if (!sameExpr(*aChildren[i], *bChildren[i]))
+      return false;
+  return true;
+}
+
+bool FunctionAST::sameBody(const FunctionAST &other) const {
+  return sameExpr(*body, *other.body);
+}
+
+Function *FunctionAST::codegenSpecialized(CompilerSession &S, const std::string &name,
+                                          ArrayRef<std::optional<double>> consts) {
+  std::vector<std::string> args;
+  std::vector<ToyType> argTypes;
+  for (unsigned i = 0, e = proto->getArgs().size(); i != e; ++i)
+    if (!consts[i]) {
+      args.push_back(proto->getArgs()[i]);
+      argTypes.push_back(proto->getArgTypes()[i]);
+    }
 
-  for (auto &arg : f->args()){
-    AllocaInst* alloca = CreateEntryBlockAlloca(f, arg.getName());
-    builder->CreateStore(&arg, alloca);
-    namedValues[std::string(arg.getName())] = alloca;
+  // Register the prototype before the body so that recursive calls with the
+  // same constants, and later modules, reuse this copy.
+  S.FunctionProtos[name] = std::make_unique<PrototypeAST>(
+      name, std::move(args), false, 0, std::move(argTypes), proto->getReturnType());
+  Function *f = S.getFunction(name);
+
+  // We are in the middle of emitting the caller.
+  IRBuilderBase::InsertPointGuard guard(*S.builder);
+  std::map<std::string, AllocaInst*> callerValues = std::move(S.namedValues);
+
+  f = codegenBody(S, f, consts);
+  if (f)
+    S.SpecializeFPM->run(*f, *S.FAM);
+
+  S.namedValues = std::move(callerValues);
+  return f;
+}
+
+Function *FunctionAST::codegenBody(CompilerSession &S, Function *f,
+                                   ArrayRef<std::optional<double>> consts) {
+  BasicBlock *BB = BasicBlock::Create(*S.context, "entry", f);
+  S.builder->SetInsertPoint(BB);
+
+  DIScope *outerScope = S.debugScope;
+  Value *outerSafepoint = S.safepointFlag;
+  DISubprogram *SP = S.beginDebugFunction(f, proto->getLocation());
+  auto leaveScope = make_scope_exit([&] {
+    if (SP)
+      S.DBuilder->finalizeSubprogram(SP);
+    S.safepointFlag = outerSafepoint;
+    S.debugScope = outerScope;
+    if (!outerScope)
+      S.builder->SetCurrentDebugLocation(DebugLoc());
+  });
+
+  S.namedValues.clear();
+
+  auto argIt = f->arg_begin();
+  for (unsigned i = 0, e = proto->getArgs().size(); i != e; ++i){
+    const std::string &name = proto->getArgs()[i];
+    Type *type = getLLVMType(S, proto->getArgTypes()[i]);
+    Value *val = i < consts.size() && consts[i]
+                     ? convertTo(S, ConstantFP::get(*S.context, APFloat(*consts[i])), type)
+                     : &*argIt++;
+    AllocaInst* alloca = CreateEntryBlockAlloca(S, f, name, type);
+    S.builder->CreateStore(val, alloca);
+    S.namedValues[name] = alloca;
   }
 
-  if(Value *retVal = body->codegen()) {
-    builder->CreateRet(retVal);
+  // Top-level expressions only run once; their loops are still counted.
+  ProfileCounter *counter = nullptr;
+  Value *startCycles = nullptr;
+  if(S.profile && !f->getName().starts_with("__anon_expr")){
+    counter = S.profile->getCounter(f->getName().str(), Profile::Function);
+    updateCounter(S, counter->count, S.builder->getInt64(1));
+    startCycles = enterCounter(S, counter);
+  }
+  beginSafepoints(S);
+
+  Value *retVal = body->codegen(S);
+  if(retVal){
+    retVal = convertTo(S, retVal, f->getReturnType());
+    if(!retVal)
+      LogError("Function body does not match the declared return type");
+  }
+
+  if(retVal) {
+    if(counter)
+      leaveCounter(S, counter, startCycles);
+    S.builder->CreateRet(retVal);
 
     verifyFunction(*f);
-    FPM->run(*f, *FAM);
+    S.FPM->run(*f, *S.FAM);
     return f;
   }
 
@@ -176,148 +954,231 @@ Function *FunctionAST::codegen() {
   return nullptr;
 }
 
-Value *IfExprAST::codegen(){
-  Value *condV = Cond->codegen();
+Value *IfExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
+  Value *condV = Cond->codegen(S);
   if(!condV)
     return nullptr;
+
+  if(isArray(condV))
+    return LogErrorV("condition must be a number");
   
-  condV = builder->CreateFCmpONE(condV, ConstantFP::get(*context, APFloat(0.0)), "ifcond");
+  condV = toCondition(S, condV, "ifcond");
 
-  Function *function = builder->GetInsertBlock()->getParent();
-  BasicBlock *thenBB = BasicBlock::Create(*context, "then", function);
-  BasicBlock *elseBB = BasicBlock::Create(*context, "else");
-  BasicBlock *mergeBB = BasicBlock::Create(*context, "ifcont");
+  Function *function = S.builder->GetInsertBlock()->getParent();
+  BasicBlock *thenBB = BasicBlock::Create(*S.context, "then", function);
+  BasicBlock *elseBB = BasicBlock::Create(*S.context, "else");
+  BasicBlock *mergeBB = BasicBlock::Create(*S.context, "ifcont");
 
-  builder->CreateCondBr(condV, thenBB, elseBB);
+  S.builder->CreateCondBr(condV, thenBB, elseBB);
 
-  builder->SetInsertPoint(thenBB);
-  Value * thenV = Then->codegen();
+  S.builder->SetInsertPoint(thenBB);
+  Value * thenV = Then->codegen(S);
   if(!thenV)
     return nullptr;
   
-  builder->CreateBr(mergeBB);
-  thenBB = builder->GetInsertBlock();
+  S.builder->CreateBr(mergeBB);
+  thenBB = S.builder->GetInsertBlock();
 
   function->insert(function->end(), elseBB);
 
-  builder->SetInsertPoint(elseBB);
-  Value *elseV = Else->codegen();
+  S.builder->SetInsertPoint(elseBB);
+  Value *elseV = Else->codegen(S);
   if(!elseV)
     return nullptr;
+
+  if(elseV->getType() != thenV->getType()){
+    if(isArray(thenV) || isArray(elseV))
+      return LogErrorV("then and else have different types");
+
+    // Widen the narrower branch: bool < int < double.
+    auto rank = [](Type *t) { return t->isDoubleTy() ? 2 : t->isIntegerTy(64) ? 1 : 0; };
+    if(rank(thenV->getType()) < rank(elseV->getType())){
+      IRBuilderBase::InsertPointGuard guard(*S.builder);
+      S.builder->SetInsertPoint(thenBB->getTerminator());
+      thenV = convertTo(S, thenV, elseV->getType());
+    }else{
+      elseV = convertTo(S, elseV, thenV->getType());
+    }
+  }
   
-  builder->CreateBr(mergeBB);
-  elseBB = builder->GetInsertBlock();
+  S.builder->CreateBr(mergeBB);
+  elseBB = S.builder->GetInsertBlock();
 
   function->insert(function->end(), mergeBB);
-  builder->SetInsertPoint(mergeBB);
+  S.builder->SetInsertPoint(mergeBB);
 
-  PHINode *PN = builder->CreatePHI(Type::getDoubleTy(*context), 2, "iftmp");
+  PHINode *PN = S.builder->CreatePHI(thenV->getType(), 2, "iftmp");
   PN->addIncoming(thenV, thenBB);
   PN->addIncoming(elseV, elseBB);
   
   return PN;
 }
 
-Value *ForExprAST::codegen(){
-  Function *f = builder->GetInsertBlock()->getParent();
-  AllocaInst *alloca = CreateEntryBlockAlloca(f, varName);
+Value *ForExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
+  Function *f = S.builder->GetInsertBlock()->getParent();
 
-  Value* startVal = start->codegen();
+  Value* startVal = start->codegen(S);
   if(!startVal)
     return nullptr;
 
-  builder->CreateStore(startVal, alloca);
+  if(isArray(startVal))
+    return LogErrorV("loop variable must be a number");
+
+  // Only a plain counter is an integer; anything that computes with the
+  // variable stays a double, which cannot wrap.
+  bool isInt = isIntCounter(*getToyType(startVal->getType()), step.get(), *body, varName);
+  Type *varType = isInt ? Type::getInt64Ty(*S.context) : Type::getDoubleTy(*S.context);
+
+  AllocaInst *alloca = CreateEntryBlockAlloca(S, f, varName, varType);
+  S.builder->CreateStore(convertTo(S, startVal, varType), alloca);
+
+  ProfileCounter *counter = nullptr;
+  Value *startCycles = nullptr;
+  if(S.profile){
+    StringRef fnName = f->getName().starts_with("__anon_expr") ? "<top-level>" : f->getName();
+    std::string name = (fnName + ": for " + varName).str();
+    if(getLocation().line)
+      name += " (line " + std::to_string(getLocation().line) + ")";
+    counter = S.profile->getCounter(name, Profile::Loop);
+    startCycles = enterCounter(S, counter);
+  }
 
-  BasicBlock *PreheaderBB = builder->GetInsertBlock();
-  BasicBlock *LoopBB = BasicBlock::Create(*context, "loop", f);
+  BasicBlock *PreheaderBB = S.builder->GetInsertBlock();
+  BasicBlock *LoopBB = BasicBlock::Create(*S.context, "loop", f);
 
-  builder->CreateBr(LoopBB);
-  builder->SetInsertPoint(LoopBB);
+  S.builder->CreateBr(LoopBB);
+  S.builder->SetInsertPoint(LoopBB);
+  if(counter)
+    updateCounter(S, counter->count, S.builder->getInt64(1));
   
-  AllocaInst *oldVal = namedValues[varName];
-  namedValues[varName] = alloca;
+  AllocaInst *oldVal = S.namedValues[varName];
+  S.namedValues[varName] = alloca;
 
-  if(!body->codegen())
+  if(!body->codegen(S))
     return nullptr;
   
   Value *stepVal = nullptr;
 
   if(step){
-    stepVal = step->codegen();
+    stepVal = step->codegen(S);
     if(!stepVal)
       return nullptr;
   }else{
-    stepVal = ConstantFP::get(*context, APFloat(1.0));
+    stepVal = isInt ? ConstantInt::get(varType, 1) : ConstantFP::get(*S.context, APFloat(1.0));
   }
 
 
-  Value *endcond = end->codegen();
+  Value *endcond = end->codegen(S);
 
   if(!endcond)
     return nullptr;
 
-  Value *curVar = builder->CreateLoad(alloca->getAllocatedType(), alloca, varName.c_str());
-  Value *nextVar = builder->CreateFAdd(curVar, stepVal, "nextVar");
-  builder->CreateStore(nextVar, alloca);
+  if(isArray(stepVal) || isArray(endcond))
+    return LogErrorV("loop step and condition must be numbers");
 
-  endcond = builder->CreateFCmpONE(endcond,
-      ConstantFP::get(*context, APFloat(0.0)), "loopcond");
+  Value *curVar = S.builder->CreateLoad(alloca->getAllocatedType(), alloca, varName.c_str());
+  stepVal = convertTo(S, stepVal, varType);
+  Value *nextVar = isInt ? S.builder->CreateNSWAdd(curVar, stepVal, "nextVar")
+                         : S.builder->CreateFAdd(curVar, stepVal, "nextVar");
+  S.builder->CreateStore(nextVar, alloca);
+
+  endcond = toCondition(S, endcond, "loopcond");
+  emitSafepointPoll(S);
     
-  BasicBlock *loopEndBB = builder->GetInsertBlock();
-  BasicBlock *afterBB = BasicBlock::Create(*context, "afterloop", f);
+  BasicBlock *loopEndBB = S.builder->GetInsertBlock();
+  BasicBlock *afterBB = BasicBlock::Create(*S.context, "afterloop", f);
 
-  builder->CreateCondBr(endcond, LoopBB, afterBB);
+  S.builder->CreateCondBr(endcond, LoopBB, afterBB);
 
-  builder->SetInsertPoint(afterBB);
+  S.builder->SetInsertPoint(afterBB);
+  if(counter)
+    leaveCounter(S, counter, startCycles);
 
   if(oldVal)
-    namedValues[varName] = oldVal;
+    S.namedValues[varName] = oldVal;
   else  
-    namedValues.erase(varName);
+    S.namedValues.erase(varName);
 
-  return Constant::getNullValue(Type::getDoubleTy(*context));
+  return Constant::getNullValue(Type::getDoubleTy(*S.context));
 }
 
-Value *UnaryExprAST::codegen(){
-  Value *operandV = operand->codegen();
+Value *UnaryExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
+  Value *operandV = operand->codegen(S);
   if(!operandV)
     return nullptr;
+
+  if(isArray(operandV))
+    return LogErrorV("operators are not defined on arrays");
   
-  Function *f = getFunction(std::string("unary") + opcode);
+  Function *f = S.getFunction(std::string("unary") + opcode);
   if(!f)
     return LogErrorV("Unknown unary operator");
   
-  return builder->CreateCall(f, operandV, "unop");
+  return S.builder->CreateCall(f, convertTo(S, operandV, f->getArg(0)->getType()), "unop");
+}
+
+std::optional<ToyType> IfExprAST::inferType(CompilerSession &S, const TypeEnv &env) const {
+  auto thenType = Then->inferType(S, env);
+  auto elseType = Else->inferType(S, env);
+  if (thenType == elseType)
+    return thenType;
+  if (thenType == ToyType::Bool && elseType == ToyType::Bool)
+    return ToyType::Bool;
+  return combineNumeric(thenType, elseType);
+}
+
+std::optional<ToyType> UnaryExprAST::inferType(CompilerSession &S, const TypeEnv &env) const {
+  return getReturnType(S, std::string("unary") + opcode);
 }
 
-Value *VarExprAST::codegen(){
+Value *VarExprAST::codegen(CompilerSession &S) {
+  S.emitLocation(getLocation());
   std::vector<AllocaInst*> oldBindings;
-  Function *f = builder->GetInsertBlock()->getParent();
+  Function *f = S.builder->GetInsertBlock()->getParent();
 
   for(unsigned i = 0, e = varNames.size(); i != e; ++i){
     const std::string &varName = varNames[i].first;
     ExprAST *init = varNames[i].second.get();
     Value* initVal;
     if(init){
-      initVal = init->codegen();
+      initVal = init->codegen(S);
       if(!initVal)
         return nullptr;
     }else{
-      initVal = ConstantFP::get(*context, APFloat(0.0));
+      initVal = ConstantFP::get(*S.context, APFloat(0.0));
     }
 
-      AllocaInst* alloca = CreateEntryBlockAlloca(f, varName);
-      builder->CreateStore(initVal, alloca);
-      oldBindings.push_back(namedValues[varName]);
-      namedValues[varName] = alloca;
+    // An annotation fixes the type. Without one a variable is an int only if
+    // declared `: int`, so a product like x = x * i cannot wrap; a bool
+    // initializer stays a bool if every later assignment is one too.
+    Type *varType = initVal->getType();
+    if(varTypes[i]){
+      varType = getLLVMType(S, *varTypes[i]);
+    }else if(varType->isIntegerTy(64) ||
+             (varType->isIntegerTy(1) &&
+              !assignmentsFit(S, *body, varName, ToyType::Bool, {{varName, ToyType::Bool}}))){
+      varType = Type::getDoubleTy(*S.context);
+    }
+
+    Value *stored = convertTo(S, initVal, varType);
+    if(!stored)
+      return LogErrorV("initializer does not match the declared type");
+
+      AllocaInst* alloca = CreateEntryBlockAlloca(S, f, varName, varType);
+      S.builder->CreateStore(stored, alloca);
+      oldBindings.push_back(S.namedValues[varName]);
+      S.namedValues[varName] = alloca;
     
   }
 
-  Value* bodyVal = body->codegen();
+  Value* bodyVal = body->codegen(S);
       if(!bodyVal)
         return nullptr;
   for(unsigned i = 0, e = varNames.size(); i!=e; ++i)
-    namedValues[varNames[i].first] = oldBindings[i];
+    S.namedValues[varNames[i].first] = oldBindings[i];
   
   return bodyVal;
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define AST_H
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/bit.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
@@ -23,48 +25,156 @@
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
 #include "KaleidoscopeJIT/KaleidoscopeJIT.h"
+#include "Lexer.h"
 #include "llvm/Transforms/Utils/Mem2Reg.h"
 
 #include <string>
 #include <memory>
 #include <vector>
 #include<map>
+#include<optional>
+#include<set>
 
 
 using namespace llvm;
 using namespace orc;
 
+class CompilerSession;
+
+// Value types of the language. Arrays are passed around as a pointer to a
+// ToyArray descriptor (see Runtime.h).
+enum class ToyType { Double, Int, Bool, Array };
+
+Type *getLLVMType(CompilerSession &S, ToyType type);
+
+// Variable types assumed while inferring, on top of the session's scope.
+using TypeEnv = std::map<std::string, ToyType>;
+
+class ExprAST;
+// Whether every assignment to name inside e stores a value representable as
+// type, so that name can keep type instead of widening to double.
+bool assignmentsFit(CompilerSession &S, ExprAST &e, const std::string &name,
+                    ToyType type, const TypeEnv &env);
+// Whether name is the target of an assignment anywhere inside e.
+bool isAssigned(ExprAST &e, const std::string &name);
+// Whether a for loop's variable can be an integer: it starts as one, moves
+// only by an integer literal step and is never assigned, so it cannot wrap.
+bool isIntCounter(ToyType startType, ExprAST *step, ExprAST &body, const std::string &name);
+
 class ExprAST {
 public:
+    // Discriminator for isa<>/dyn_cast<>, since LLVM builds without RTTI.
+    enum ExprKind { Number, Variable, Index, Binary, Call, If, For, Unary, Var };
+
+    ExprAST(ExprKind kind) : kind(kind) {}
     virtual ~ExprAST() = default;
-    virtual Value* codegen() = 0;
+    ExprKind getKind() const { return kind; }
+
+    virtual Value* codegen(CompilerSession &S) = 0;
+    // Stores val into this expression when it is the destination of '='.
+    virtual Value* codegenAssign(CompilerSession &S, Value *val);
+    // Type this expression will have, if it is known without generating code.
+    virtual std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const {
+        return std::nullopt;
+    }
+    // Calls fn on every direct subexpression; fn may replace it.
+    virtual void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) {}
+    // Hash of this node alone, without its subexpressions.
+    virtual hash_code hashNode() const { return hash_value(kind); }
+    // Whether other is the same node, ignoring subexpressions: equal nodes
+    // hash alike.
+    virtual bool sameNode(const ExprAST &other) const { return kind == other.kind; }
+
+    SourceLocation getLocation() const { return loc; }
+    void setLocation(SourceLocation l) { loc = l; }
+
+private:
+    const ExprKind kind;
+    SourceLocation loc;
 };
 
+// A literal. The parser produces Double and Int literals; folding a
+// comparison produces a Bool one.
 class NumberExprAST : public ExprAST {
     double val;
+    ToyType type;
 
 public:
-    NumberExprAST(double val);
-    Value* codegen() override;
+    NumberExprAST(double val, ToyType type = ToyType::Double);
+    Value* codegen(CompilerSession &S) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override;
+    double getValue() const { return val; }
+    ToyType getType() const { return type; }
+    bool isIntegerLiteral() const { return type == ToyType::Int; }
+    hash_code hashNode() const override { return hash_combine(getKind(), bit_cast<uint64_t>(val), type); }
+    bool sameNode(const ExprAST &other) const override {
+        auto *num = dyn_cast<NumberExprAST>(&other);
+        return num && bit_cast<uint64_t>(num->val) == bit_cast<uint64_t>(val) && num->type == type;
+    }
+    static bool classof(const ExprAST *e) { return e->getKind() == Number; }
 };
 
 class VariableExprAST : public ExprAST {
     std::string name;
 
 public:
-    VariableExprAST(const std::string& name) : name(name) {}
-    Value* codegen() override;
+    VariableExprAST(const std::string& name) : ExprAST(Variable), name(name) {}
+    Value* codegen(CompilerSession &S) override;
+    Value* codegenAssign(CompilerSession &S, Value *val) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override;
     const std::string &getName() const{return name;}
+    hash_code hashNode() const override { return hash_combine(getKind(), name); }
+    bool sameNode(const ExprAST &other) const override {
+        auto *var = dyn_cast<VariableExprAST>(&other);
+        return var && var->name == name;
+    }
+    static bool classof(const ExprAST *e) { return e->getKind() == Variable; }
 
 };
 
+class IndexExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> array, index;
+
+public:
+    IndexExprAST(std::unique_ptr<ExprAST> array, std::unique_ptr<ExprAST> index)
+    : ExprAST(Index), array(std::move(array)), index(std::move(index)) {}
+    Value* codegen(CompilerSession &S) override;
+    Value* codegenAssign(CompilerSession &S, Value *val) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override {
+        return ToyType::Double;
+    }
+    void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) override {
+        fn(array);
+        fn(index);
+    }
+    ExprAST &getArray() const { return *array; }
+    ExprAST &getIndex() const { return *index; }
+    static bool classof(const ExprAST *e) { return e->getKind() == Index; }
+};
+
 class BinaryExprAST : public ExprAST {
     char op;
     std::unique_ptr<ExprAST> LHS, RHS;
 
 public:
     BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS);
-    Value* codegen() override;
+    Value* codegen(CompilerSession &S) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override;
+    void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) override {
+        fn(LHS);
+        fn(RHS);
+    }
+    char getOp() const { return op; }
+    ExprAST &getLHS() const { return *LHS; }
+    ExprAST &getRHS() const { return *RHS; }
+    std::unique_ptr<ExprAST> takeLHS() { return std::move(LHS); }
+    std::unique_ptr<ExprAST> takeRHS() { return std::move(RHS); }
+    hash_code hashNode() const override { return hash_combine(getKind(), op); }
+    bool sameNode(const ExprAST &other) const override {
+        auto *bin = dyn_cast<BinaryExprAST>(&other);
+        return bin && bin->op == op;
+    }
+    static bool classof(const ExprAST *e) { return e->getKind() == Binary; }
 };
 
 class CallExprAST : public ExprAST {
@@ -73,7 +183,26 @@ class CallExprAST : public ExprAST {
 
 public:
     CallExprAST(const std::string& callee, std::vector<std::unique_ptr<ExprAST>> args);
-    Value* codegen() override;
+    Value* codegen(CompilerSession &S) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override;
+    void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) override {
+        for (auto &arg : args)
+            fn(arg);
+    }
+    const std::string &getCallee() const { return callee; }
+    const std::vector<std::unique_ptr<ExprAST>> &getArgs() const { return args; }
+    hash_code hashNode() const override { return hash_combine(getKind(), callee, args.size()); }
+    bool sameNode(const ExprAST &other) const override {
+        auto *call = dyn_cast<CallExprAST>(&other);
+        return call && call->callee == callee && call->args.size() == args.size();
+    }
+    static bool classof(const ExprAST *e) { return e->getKind() == Call; }
+
+private:
+    // array(n), len(a), sum(a), dot(a, b) and map(f, a).
+    Value* codegenBuiltin(CompilerSession &S);
+    // Copy of the callee with the literal arguments folded in, or nullptr.
+    Function* getSpecialization(CompilerSession &S);
 };
 
 class PrototypeAST {
@@ -81,12 +210,27 @@ class PrototypeAST {
     std::vector<std::string> args;
     bool isOperator;
     unsigned precedence;
+    std::vector<ToyType> argTypes;
+    ToyType returnType;
+    SourceLocation loc;
 
 public:
     PrototypeAST(const std::string& name, std::vector<std::string> args,
-    bool isOperator = false, unsigned prec = 0);
+    bool isOperator = false, unsigned prec = 0,
+    std::vector<ToyType> argTypes = {}, ToyType returnType = ToyType::Double);
     const std::string& getName() const;
-    Function* codegen();
+    Function* codegen(CompilerSession &S);
+    ToyType getReturnType() const { return returnType; }
+    const std::vector<std::string> &getArgs() const { return args; }
+    const std::vector<ToyType> &getArgTypes() const { return argTypes; }
+    SourceLocation getLocation() const { return loc; }
+    void setLocation(SourceLocation l) { loc = l; }
+    bool hasSameSignature(const PrototypeAST &other) const {
+        return argTypes == other.argTypes && returnType == other.returnType;
+    }
+    // Changes whenever anything but the location does, including the
+    // precedence, which affects how callers parse.
+    hash_code hash() const;
 
     bool isUnaryOp() const{ return isOperator && args.size() == 1;}
     bool isBinaryOp() const{ return isOperator && args.size() == 2;}
@@ -100,10 +244,35 @@ public:
 class FunctionAST {
     std::unique_ptr<PrototypeAST> proto;
     std::unique_ptr<ExprAST> body;
+    // Defined with `memo def`: results are cached per argument values.
+    bool memoized = false;
 
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body);
-    Function* codegen();
+    Function* codegen(CompilerSession &S);
+    // Emits a copy named name whose parameters with a value in consts are
+    // replaced by those constants and dropped from the signature.
+    Function* codegenSpecialized(CompilerSession &S, const std::string &name,
+                                 ArrayRef<std::optional<double>> consts);
+    const std::string &getName() const { return proto->getName(); }
+    const PrototypeAST &getProto() const { return *proto; }
+    ExprAST &getBody() const { return *body; }
+    bool isMemoized() const { return memoized; }
+    void setMemoized(bool m) { memoized = m; }
+    // Folds constants in the body before codegen.
+    void simplify();
+    // The value of a body that folded down to a single number.
+    std::optional<double> getConstantValue() const;
+    // Structural hash of the body. Adds the functions and operators it calls
+    // to callees.
+    hash_code hashBody(std::set<std::string> &callees) const;
+    // Whether other's body is structurally the same as this one's.
+    bool sameBody(const FunctionAST &other) const;
+
+private:
+    Function* codegenBody(CompilerSession &S, Function *f,
+                          ArrayRef<std::optional<double>> consts);
+    Function* codegenMemoized(CompilerSession &S, Function *f);
 };
 
 class IfExprAST : public ExprAST{
@@ -111,8 +280,20 @@ class IfExprAST : public ExprAST{
 public:
     IfExprAST(std::unique_ptr<ExprAST>Cond, std::unique_ptr<ExprAST> Then, 
     std::unique_ptr<ExprAST> Else) 
-    : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
-    Value *codegen() override;
+    : ExprAST(If), Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+    Value *codegen(CompilerSession &S) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override;
+    void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) override {
+        fn(Cond);
+        fn(Then);
+        fn(Else);
+    }
+    ExprAST &getCond() const { return *Cond; }
+    ExprAST &getThen() const { return *Then; }
+    ExprAST &getElse() const { return *Else; }
+    std::unique_ptr<ExprAST> takeThen() { return std::move(Then); }
+    std::unique_ptr<ExprAST> takeElse() { return std::move(Else); }
+    static bool classof(const ExprAST *e) { return e->getKind() == If; }
 };
 
 class ForExprAST : public ExprAST{
@@ -120,9 +301,33 @@ class ForExprAST : public ExprAST{
     std::unique_ptr<ExprAST> start, end, step, body;
 public:
     ForExprAST(const std::string& varName, std::unique_ptr<ExprAST> start, std::unique_ptr<ExprAST> end, 
-    std::unique_ptr<ExprAST> step, std::unique_ptr<ExprAST> body) : varName(varName), start(std::move(start)), end(std::move(end)),
+    std::unique_ptr<ExprAST> step, std::unique_ptr<ExprAST> body) : ExprAST(For), varName(varName), start(std::move(start)), end(std::move(end)),
     step(std::move(step)), body(std::move(body)) {}
-    Value *codegen() override;
+    Value *codegen(CompilerSession &S) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override {
+        return ToyType::Double;
+    }
+    void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) override {
+        fn(start);
+        fn(end);
+        if (step)
+            fn(step);
+        fn(body);
+    }
+    const std::string &getVarName() const { return varName; }
+    ExprAST &getStart() const { return *start; }
+    ExprAST &getEnd() const { return *end; }
+    // nullptr for the default step of 1.
+    ExprAST *getStep() const { return step.get(); }
+    ExprAST &getBody() const { return *body; }
+    hash_code hashNode() const override {
+        return hash_combine(getKind(), varName, step != nullptr);
+    }
+    bool sameNode(const ExprAST &other) const override {
+        auto *loop = dyn_cast<ForExprAST>(&other);
+        return loop && loop->varName == varName && (loop->step != nullptr) == (step != nullptr);
+    }
+    static bool classof(const ExprAST *e) { return e->getKind() == For; }
 };
 
 class UnaryExprAST : public ExprAST{
@@ -131,37 +336,66 @@ class UnaryExprAST : public ExprAST{
 
 public: 
     UnaryExprAST(char opcode, std::unique_ptr<ExprAST> operand)
-    : opcode(opcode), operand(std::move(operand)) {}
-    Value *codegen() override;
+    : ExprAST(Unary), opcode(opcode), operand(std::move(operand)) {}
+    Value *codegen(CompilerSession &S) override;
+    std::optional<ToyType> inferType(CompilerSession &S, const TypeEnv &env) const override;
+    void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) override {
+        fn(operand);
+    }
+    char getOpcode() const { return opcode; }
+    ExprAST &getOperand() const { return *operand; }
+    hash_code hashNode() const override { return hash_combine(getKind(), opcode); }
+    bool sameNode(const ExprAST &other) const override {
+        auto *unary = dyn_cast<UnaryExprAST>(&other);
+        return unary && unary->opcode == opcode;
+    }
+    static bool classof(const ExprAST *e) { return e->getKind() == Unary; }
 };
 
 class VarExprAST : public ExprAST{
     std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames;
+    std::vector<std::optional<ToyType>> varTypes;
     std::unique_ptr<ExprAST> body;
 public:
     VarExprAST(
         std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames,
-        std::unique_ptr<ExprAST> body) 
-        : varNames(std::move(varNames)), body(std::move(body)) {}
-    Value *codegen() override;
+        std::unique_ptr<ExprAST> body,
+        std::vector<std::optional<ToyType>> varTypes = {}) 
+        : ExprAST(Var), varNames(std::move(varNames)), varTypes(std::move(varTypes)), body(std::move(body)) {
+        this->varTypes.resize(this->varNames.size());
+    }
+    Value *codegen(CompilerSession &S) override;
+    void forEachChild(function_ref<void(std::unique_ptr<ExprAST> &)> fn) override {
+        for (auto &var : varNames)
+            if (var.second)
+                fn(var.second);
+        fn(body);
+    }
+    // Names with their initializers (nullptr for 0.0) and annotated types.
+    const std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> &getVarNames() const {
+        return varNames;
+    }
+    const std::vector<std::optional<ToyType>> &getVarTypes() const { return varTypes; }
+    ExprAST &getBody() const { return *body; }
+    hash_code hashNode() const override {
+        hash_code h = hash_value(getKind());
+        for (unsigned i = 0, e = varNames.size(); i != e; ++i)
+            h = hash_combine(h, varNames[i].first, varNames[i].second != nullptr,
+                             varTypes[i].has_value(), varTypes[i].value_or(ToyType::Double));
+        return h;
+    }
+    bool sameNode(const ExprAST &other) const override {
+        auto *var = dyn_cast<VarExprAST>(&other);
+        if (!var || var->varNames.size() != varNames.size() || var->varTypes != varTypes)
+            return false;
+        for (unsigned i = 0, e = varNames.size(); i != e; ++i)
+            if (var->varNames[i].first != varNames[i].first ||
+                (var->varNames[i].second != nullptr) != (varNames[i].second != nullptr))
+                return false;
+        return true;
+    }
+    static bool classof(const ExprAST *e) { return e->getKind() == Var; }
 };
 
 
-extern std::unique_ptr<LLVMContext> context;
-extern std::unique_ptr<IRBuilder<>> builder;
-extern std::unique_ptr<Module> module;
-extern std::map<std::string, AllocaInst*> namedValues;
-extern std::unique_ptr<KaleidoscopeJIT> JIT;
-extern std::unique_ptr<FunctionPassManager> FPM;
-extern std::unique_ptr<LoopAnalysisManager> LAM;
-extern std::unique_ptr<FunctionAnalysisManager> FAM;
-extern std::unique_ptr<CGSCCAnalysisManager> CGAM;
-extern std::unique_ptr<ModuleAnalysisManager> MAM;
-extern std::unique_ptr<PassInstrumentationCallbacks> PIC;
-extern std::unique_ptr<StandardInstrumentations> SI;
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-extern std::map<char, int> BinopPrecedence;
-
-extern ExitOnError ExitOnErr;
-
 #endif
@@ -0,0 +1,129 @@
+#include "BulkEval.h"
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <fstream>
+
+// Rows handed to the kernel per call, so output streams while input is read.
+static constexpr size_t BlockRows = 1 << 16;
+
+// Runs the kernel over rows rows. A runtime error in it, or a cancel, ends
+// the evaluation.
+static Error runKernel(const BulkKernel &kernel, const double *const *columns,
+                       double *out, size_t rows) {
+  if (runCancellable([&] { kernel.fn(columns, out, rows); }))
+    return Error::success();
+  const std::string &error = getThreadSafepoint().error;
+  return createStringError(inconvertibleErrorCode(), "%s",
+                           error.empty() ? "Evaluation cancelled" : error.c_str());
+}
+
+static Error evaluateCSV(const BulkKernel &kernel, StringRef path,
+                         raw_ostream &out) {
+  std::ifstream in(path.str());
+  if (!in)
+    return createStringError(inconvertibleErrorCode(), "could not open %s",
+                             path.str().c_str());
+
+  std::vector<std::vector<double>> columns(kernel.numArgs);
+  std::vector<const double *> columnPtrs(kernel.numArgs);
+  std::vector<double> results;
+
+  auto flush = [&]() -> Error {
+    size_t rows = columns[0].size();
+    for (unsigned c = 0; c < kernel.numArgs; ++c)
+      columnPtrs[c] = columns[c].data();
+    results.resize(rows);
+    if (auto Err = runKernel(kernel, columnPtrs.data(), results.data(), rows))
+      return Err;
+
+    for (double result : results)
+      out << format("%.17g\n", result);
+    for (auto &column : columns)
+      column.clear();
+    return Error::success();
+  };
+
+  std::string line;
+  SmallVector<StringRef, 8> fields;
+  for (size_t lineNo = 1; std::getline(in, line); ++lineNo) {
+    if (StringRef(line).trim().empty())
+      continue;
+
+    fields.clear();
+    StringRef(line).split(fields, ',');
+    if (fields.size() != kernel.numArgs)
+      return createStringError(inconvertibleErrorCode(),
+                               "line %zu: expected %u columns", lineNo,
+                               kernel.numArgs);
+
+    SmallVector<double, 8> values(fields.size());
+    bool ok = true;
+    for (unsigned c = 0; c < fields.size() && ok; ++c)
+      ok = !fields[c].trim().getAsDouble(values[c]);
+
+    if (!ok) {
+      if (lineNo == 1) // header
+        continue;
+      return createStringError(inconvertibleErrorCode(),
+                               "line %zu: invalid number", lineNo);
+    }
+
+    for (unsigned c = 0; c < fields.size(); ++c)
+      columns[c].push_back(values[c]);
+    if (columns[0].size() == BlockRows)
+      if (auto Err = flush())
+        return Err;
+  }
+  return flush();
+}
+
+static Error evaluateBinary(const BulkKernel &kernel, StringRef path,
+                            raw_ostream &out) {
+  // Columns are used in place from the mapped file.
+  auto buffer = MemoryBuffer::getFile(path, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!buffer)
+    return errorCodeToError(buffer.getError());
+
+  size_t rowBytes = sizeof(double) * kernel.numArgs;
+  size_t size = (*buffer)->getBufferSize();
+  if (size % rowBytes)
+    return createStringError(inconvertibleErrorCode(),
+                             "%s: size is not a multiple of %u columns",
+                             path.str().c_str(), kernel.numArgs);
+
+  size_t n = size / rowBytes;
+  auto *base = reinterpret_cast<const double *>((*buffer)->getBufferStart());
+  std::vector<const double *> columnPtrs(kernel.numArgs);
+  std::vector<double> results(std::min(n, BlockRows));
+
+  for (size_t row = 0; row < n; row += BlockRows) {
+    size_t rows = std::min(BlockRows, n - row);
+    for (unsigned c = 0; c < kernel.numArgs; ++c)
+      columnPtrs[c] = base + c * n + row;
+
+    if (auto Err = runKernel(kernel, columnPtrs.data(), results.data(), rows))
+      return Err;
+    out.write(reinterpret_cast<const char *>(results.data()),
+              rows * sizeof(double));
+  }
+
+  return Error::success();
+}
+
+Error runBulkEvaluation(CompilerSession &S, const std::string &fnName,
+                        StringRef inputPath, raw_ostream &out) {
+  auto kernel = S.compileBulkKernel(fnName);
+  if (!kernel)
+    return kernel.takeError();
+
+  if (kernel->numArgs == 0)
+    return createStringError(inconvertibleErrorCode(),
+                             "'%s' takes no arguments", fnName.c_str());
+
+  if (inputPath.ends_with(".csv"))
+    return evaluateCSV(*kernel, inputPath, out);
+  return evaluateBinary(*kernel, inputPath, out);
+}
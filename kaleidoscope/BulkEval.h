@@ -0,0 +1,14 @@
+#ifndef BULK_EVAL_H
+#define BULK_EVAL_H
+
+#include "CompilerSession.h"
+
+// Evaluates fnName once per input row and streams one result per row to out.
+// Inputs ending in ".csv" hold one comma-separated column per parameter (an
+// optional header line is skipped) and produce one result per line. Any other
+// input is raw native doubles stored column after column and produces raw
+// doubles.
+Error runBulkEvaluation(CompilerSession &S, const std::string &fnName,
+                        StringRef inputPath, raw_ostream &out);
+
+#endif
@@ -0,0 +1,1446 @@
+#include "CompilerSession.h"
+#include "ErrorHandler.h"
+#include "MLIRGen.h"
+#include "Runtime.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/Remarks/RemarkSerializer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/SCCP.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <sys/resource.h>
+#include <set>
+#include <thread>
+
+static ExitOnError ExitOnErr;
+
+// Compiled top-level expressions kept around for reuse.
+static constexpr size_t MaxCachedExprs = 256;
+// How many items the reader of piped input may be ahead of the session.
+static constexpr size_t PipelineDepth = 16;
+
+Expected<std::unique_ptr<CompilerSession>>
+CompilerSession::Create(const JITOptions &opts) {
+  static std::once_flag targetInit;
+  std::call_once(targetInit, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+  });
+
+  // The runtime only provides what toy code does not define itself, so that
+  // e.g. `def log(x)` still works.
+  JITOptions jitOpts = opts;
+  for (auto &symbol : getRuntimeSymbols())
+    jitOpts.HostSymbols.emplace_back(symbol.first,
+                                     ExecutorAddr::fromPtr(symbol.second));
+  jitOpts.LazyCallFailed = ExecutorAddr::fromPtr(&toy_lazy_call_failed);
+  auto JIT = KaleidoscopeJIT::Create(jitOpts);
+  if (!JIT)
+    return JIT.takeError();
+
+  DataLayout DL = (*JIT)->getDataLayout();
+  auto S = std::make_unique<CompilerSession>(DL, std::move(*JIT));
+  if (auto Err = S->defineSessionSymbols())
+    return std::move(Err);
+  return std::move(S);
+}
+
+// Points the __toy_arena symbol, through which code allocates arrays, and
+// __toy_memo, the table of memo def results, at this session's.
+Error CompilerSession::defineSessionSymbols() {
+  if (auto Err = JIT->defineAbsolute(*JD, "__toy_arena", ExecutorAddr::fromPtr(arena)))
+    return Err;
+  return JIT->defineAbsolute(*JD, "__toy_memo", ExecutorAddr::fromPtr(&memoTable));
+}
+
+CompilerSession::CompilerSession(const DataLayout &DL,
+                                 std::unique_ptr<KaleidoscopeJIT> JIT)
+    : JIT(JIT.get()), JD(JIT ? &JIT->getMainJITDylib() : nullptr),
+      parser(lex, BinopPrecedence), DL(DL), ownJIT(std::move(JIT)) {
+  BinopPrecedence['='] = 2;
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['*'] = 40; // highest.
+
+  if (auto JTMB = JITTargetMachineBuilder::detectHost()) {
+    if (auto TM = JTMB->createTargetMachine())
+      this->TM = std::move(*TM);
+    else
+      consumeError(TM.takeError());
+  } else {
+    consumeError(JTMB.takeError());
+  }
+
+  initializeModule();
+}
+
+CompilerSession::~CompilerSession() {
+  resetPassState();
+  module.reset();
+  context.reset();
+
+  // A client's code goes away with it.
+  if (JIT && !ownJIT) {
+    ExprCache.clear();
+    BodyTrackers.clear();
+    BodiesByIR.clear();
+    BulkTrackers.clear();
+    if (auto Err = JIT->removeClientJITDylib(*JD))
+      logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+  }
+}
+
+Expected<std::unique_ptr<CompilerSession>> CompilerSession::createClientSession() {
+  if (!JIT)
+    return createStringError(inconvertibleErrorCode(),
+                             "session has no JIT to share");
+
+  auto client = std::make_unique<CompilerSession>(DL);
+  client->JIT = JIT;
+  client->JD = &JIT->createClientJITDylib();
+  client->BinopPrecedence = BinopPrecedence;
+  for (auto &entry : FunctionProtos)
+    client->FunctionProtos[entry.first] =
+        std::make_unique<PrototypeAST>(*entry.second);
+  client->DefinedFunctions = DefinedFunctions;
+  client->profile = profile;
+  client->safepoints = safepoints;
+  client->memoryBudget = memoryBudget;
+  if (mlirLowering)
+    cantFail(client->enableMLIR(mlirLowering->getPipeline()));
+  if (auto Err = client->defineSessionSymbols())
+    return std::move(Err);
+  return std::move(client);
+}
+
+Function *CompilerSession::getFunction(const std::string &name) {
+  if(auto *F = module->getFunction(name))
+    return F;
+
+  auto FI = FunctionProtos.find(name);
+  if(FI != FunctionProtos.end())
+    return FI->second->codegen(*this);
+
+  return nullptr;
+}
+
+// Tears down the pass state. It caches analyses of, and refers to, a module
+// that is about to be handed to another owner.
+void CompilerSession::resetPassState() {
+  SI.reset();
+  PIC.reset();
+  MAM.reset();
+  CGAM.reset();
+  FAM.reset();
+  LAM.reset();
+  SpecializeFPM.reset();
+  FPM.reset();
+  debugScope = nullptr;
+  debugUnit = nullptr;
+  DBuilder.reset();
+  builder.reset();
+}
+
+void CompilerSession::initializeModule() {
+  resetPassState();
+  module.reset();
+
+  context = std::make_unique<LLVMContext>();
+  module = std::make_unique<Module>("KaleidoscopeJIT", *context);
+  module->setDataLayout(DL);
+
+  // create a new builder for the module
+  builder = std::make_unique<IRBuilder<>>(*context);
+
+  if (remarksOut) {
+    // Each remark is a YAML document of its own, so the streams of successive
+    // contexts can share one file.
+    auto serializer = cantFail(remarks::createRemarkSerializer(
+        remarks::Format::YAML, remarks::SerializerMode::Separate, *remarksOut));
+    context->setMainRemarkStreamer(
+        std::make_unique<remarks::RemarkStreamer>(std::move(serializer)));
+    context->setLLVMRemarkStreamer(
+        std::make_unique<LLVMRemarkStreamer>(*context->getMainRemarkStreamer()));
+
+    DBuilder = std::make_unique<DIBuilder>(*module);
+    debugUnit = DBuilder->createCompileUnit(
+        dwarf::DW_LANG_C, DBuilder->createFile(sourceName, "."),
+        "Kaleidoscope Compiler", /*isOptimized=*/true, "", 0);
+    module->addModuleFlag(Module::Warning, "Debug Info Version",
+                          DEBUG_METADATA_VERSION);
+  }
+
+  FPM = std::make_unique<FunctionPassManager>();
+
+  LAM = std::make_unique<LoopAnalysisManager>();
+
+  FAM = std::make_unique<FunctionAnalysisManager>();
+
+  CGAM = std::make_unique<CGSCCAnalysisManager>();
+
+  MAM = std::make_unique<ModuleAnalysisManager>();
+
+  PIC = std::make_unique<PassInstrumentationCallbacks>();
+
+  SI = std::make_unique<StandardInstrumentations>(*context, true);
+
+  SI->registerCallbacks(*PIC, MAM.get());
+  FPM->addPass(PromotePass());
+  FPM->addPass(InstCombinePass());
+  FPM->addPass(ReassociatePass());
+  FPM->addPass(GVNPass());
+  FPM->addPass(SimplifyCFGPass());
+  FPM->addPass(LoopVectorizePass());
+  FPM->addPass(InstCombinePass());
+
+  SpecializeFPM = std::make_unique<FunctionPassManager>();
+  SpecializeFPM->addPass(SCCPPass());
+  SpecializeFPM->addPass(LoopUnrollPass());
+  SpecializeFPM->addPass(InstCombinePass());
+  SpecializeFPM->addPass(SimplifyCFGPass());
+  NewSpecializations.clear();
+
+  PassBuilder PB(TM.get());
+  PB.registerModuleAnalyses(*MAM);
+  PB.registerFunctionAnalyses(*FAM);
+  PB.crossRegisterProxies(*LAM, *FAM, *CGAM, *MAM);
+}
+
+ThreadSafeModule CompilerSession::takeModule() {
+  // Runtime helpers are inlined while the pass pipeline is still there to
+  // clean up after them. If that fails, the module calls the native ones.
+  if (auto inlined = linkRuntimeBitcode(*module, DefinedFunctions)) {
+    for (Function *F : *inlined) {
+      FAM->clear(*F, F->getName());
+      FPM->run(*F, *FAM);
+    }
+  } else {
+    LogError(toString(inlined.takeError()).c_str());
+  }
+  if (DBuilder)
+    DBuilder->finalize();
+  // The JIT generates machine code later, maybe after remarksOut is gone;
+  // only the remarks of our own pipelines are wanted anyway.
+  context->setLLVMRemarkStreamer(nullptr);
+  context->setMainRemarkStreamer(nullptr);
+  resetPassState();
+  auto TSM = ThreadSafeModule(std::move(module), std::move(context));
+  initializeModule();
+  return TSM;
+}
+
+Error CompilerSession::handleDefinition() {
+  if (auto fnAST = parser.parseDefinition()) {
+    fnAST->simplify();
+    return defineFunction(std::move(fnAST));
+  } else {
+    // Skip token for error recovery.
+    lex.getNextToken();
+  }
+  return Error::success();
+}
+
+void CompilerSession::handleExtern(bool interactive) {
+  if (auto protoAST = parser.parseExtern()) {
+    if (auto *fnIR = protoAST->codegen(*this)) {
+      if (interactive)
+        fnIR->print(errs());
+      FunctionProtos[protoAST->getName()] = std::move(protoAST);
+    }
+  } else {
+    // Skip token for error recovery.
+    lex.getNextToken();
+  }
+}
+
+// Moves the current module out like takeModule. The specializations emitted
+// into it are first split off and added as bodies of their own, so that they
+// outlive a freed top-level expression and can be replaced on redefinition.
+Expected<ThreadSafeModule> CompilerSession::takeModuleAddingSpecializations() {
+  std::vector<std::pair<std::string, std::unique_ptr<Module>>> specs;
+  for (const std::string &name : NewSpecializations) {
+    ValueToValueMapTy VMap;
+    specs.emplace_back(name, CloneModule(*module, VMap, [&](const GlobalValue *GV) {
+      return GV->getName() == name;
+    }));
+    module->getFunction(name)->deleteBody();
+  }
+
+  auto TSM = takeModule();
+  for (auto &spec : specs)
+    if (auto Err = addBody(spec.first, ThreadSafeModule(std::move(spec.second),
+                                                        TSM.getContext())))
+      return std::move(Err);
+  return std::move(TSM);
+}
+
+// Hash of the code of name, the only function M defines, with name and all
+// local value names blanked out, so that it is the same for definitions that
+// differ only in names. std::nullopt if M defines more than name or has
+// debug info, which refers to the source of one definition only.
+static std::optional<BodyKey> hashBodyIR(Module &M, const std::string &name) {
+  Function *f = M.getFunction(name);
+  if (!f || f->getSubprogram())
+    return std::nullopt;
+  for (Function &other : M)
+    if (&other != f && !other.isDeclaration())
+      return std::nullopt;
+  for (GlobalVariable &global : M.globals())
+    if (!global.isDeclaration())
+      return std::nullopt;
+
+  for (Argument &arg : f->args())
+    arg.setName("");
+  for (BasicBlock &BB : *f) {
+    BB.setName("");
+    for (Instruction &I : BB)
+      I.setName("");
+  }
+
+  f->setName("__toy_body");
+  std::string IR;
+  raw_string_ostream OS(IR);
+  f->print(OS);
+  f->setName(name);
+  return SHA1::hash(arrayRefFromStringRef(OS.str()));
+}
+
+// Adds TSM, which defines the function name, as name's new body and points
+// name's stub at it. The body it replaces is freed. If the same code is
+// already in the JIT as the body of another function, name shares that.
+Error CompilerSession::addBody(const std::string &name, ThreadSafeModule TSM) {
+  auto key = TSM.withModuleDo([&](Module &M) { return hashBodyIR(M, name); });
+  if (key) {
+    auto BI = BodiesByIR.find(*key);
+    if (BI != BodiesByIR.end())
+      return redirectBody(name, BI->second.bodyName, BI->second.RT);
+  }
+
+  std::string bodyName = name + ".v" + std::to_string(NextBodyId++);
+  TSM.withModuleDo([&](Module &M) { M.getFunction(name)->setName(bodyName); });
+
+  auto RT = JD->createResourceTracker();
+  if (auto Err = JIT->addModule(std::move(TSM), RT))
+    return Err;
+  if (key)
+    BodiesByIR[*key] = {bodyName, RT};
+  return redirectBody(name, bodyName, std::move(RT));
+}
+
+// Points name's stub at bodyName, whose code RT holds, and frees the body it
+// replaces unless another function still uses it.
+Error CompilerSession::redirectBody(const std::string &name,
+                                    const std::string &bodyName,
+                                    ResourceTrackerSP RT) {
+  if (auto Err = JIT->redirect(*JD, name, bodyName))
+    return joinErrors(std::move(Err), releaseBody(std::move(RT)));
+
+  ImageBodies.erase(name);
+  DefinitionHashes.erase(name);
+  DefinedFunctions.insert(name);
+  std::swap(BodyTrackers[name], RT);
+  return releaseBody(std::move(RT));
+}
+
+// Frees the body RT holds, if any, once no function uses it.
+Error CompilerSession::releaseBody(ResourceTrackerSP RT) {
+  if (!RT)
+    return Error::success();
+  for (auto &entry : BodyTrackers)
+    if (entry.second == RT)
+      return Error::success();
+
+  for (auto BI = BodiesByIR.begin(); BI != BodiesByIR.end();) {
+    if (BI->second.RT == RT)
+      BI = BodiesByIR.erase(BI);
+    else
+      ++BI;
+  }
+  return RT->remove();
+}
+
+// Compiles fnAST and makes it the definition of its name. Code already linked
+// against an earlier definition calls the new one from now on.
+Error CompilerSession::defineFunction(std::unique_ptr<FunctionAST> fnAST) {
+  std::string name = fnAST->getName();
+  if (auto Err = enforceBudget())
+    return Err;
+  if (overBudget()) {
+    LogError(("Memory budget exceeded; definition of '" + name + "' rejected").c_str());
+    return Error::success();
+  }
+
+  auto &def = FunctionDefs[name];
+  if (def && !def->getProto().hasSameSignature(fnAST->getProto())) {
+    LogError(("Redefinition of '" + name + "' changes its signature").c_str());
+    return Error::success();
+  }
+
+  // The new AST is the one to specialize from, also within its own body.
+  std::unique_ptr<FunctionAST> previous = std::move(def);
+  def = std::move(fnAST);
+  std::vector<Specialization> specs = Specializations[name];
+  if (auto TSM = lowerThroughMLIR(*def)) {
+    if (auto Err = addBody(name, std::move(*TSM)))
+      return Err;
+    return invalidateFunction(name);
+  }
+  if (!def->codegen(*this)) {
+    def = std::move(previous);
+    if (!def)
+      FunctionDefs.erase(name);
+    return Error::success();
+  }
+
+  // Specializations of the previous body are emitted again from this one.
+  for (const Specialization &spec : specs)
+    if (def->codegenSpecialized(*this, spec.name, spec.consts))
+      NewSpecializations.push_back(spec.name);
+
+  auto TSM = takeModuleAddingSpecializations();
+  if (!TSM)
+    return TSM.takeError();
+  if (auto Err = addBody(name, std::move(*TSM)))
+    return Err;
+  return invalidateFunction(name);
+}
+
+// Identifies a top-level expression by its folded AST and the current version
+// of every function it calls, so redefining a callee changes the key.
+size_t CompilerSession::exprCacheKey(const FunctionAST &fnAST,
+                                     std::set<std::string> &callees) {
+  hash_code key = fnAST.hashBody(callees);
+  for (const std::string &callee : callees)
+    key = hash_combine(key, callee, FunctionVersions[callee]);
+  return key;
+}
+
+// Adds the __anon_expr just emitted from ast to the JIT under its own tracker
+// and remembers it under key.
+Expected<CompilerSession::CachedExpr *>
+CompilerSession::cacheAnonExpr(size_t key, std::set<std::string> callees,
+                               std::unique_ptr<FunctionAST> ast) {
+  if (ExprCache.size() >= MaxCachedExprs)
+    if (auto Err = evictCachedExpr())
+      return std::move(Err);
+
+  // Cached expressions stay in the JIT side by side, so each needs its own name.
+  std::string name = "__anon_expr." + std::to_string(NextExprId++);
+  module->getFunction("__anon_expr")->setName(name);
+
+  auto TSM = takeModuleAddingSpecializations();
+  if (!TSM)
+    return TSM.takeError();
+
+  auto RT = JD->createResourceTracker();
+  if (auto Err = JIT->addModule(std::move(*TSM), RT))
+    return std::move(Err);
+
+  auto ExprSymbol = JIT->lookup(*JD, name);
+  if (!ExprSymbol)
+    return joinErrors(ExprSymbol.takeError(), RT->remove());
+
+  double (*FP)() = ExprSymbol->getAddress().toPtr<double(*)()>();
+  CachedExpr &entry = ExprCache[key];
+  entry = {RT, FP, std::move(callees), ++UseClock, std::move(ast)};
+  return &entry;
+}
+
+// Frees the least recently run cached expression.
+Error CompilerSession::evictCachedExpr() {
+  auto LRU = ExprCache.begin();
+  for (auto CI = ExprCache.begin(); CI != ExprCache.end(); ++CI)
+    if (CI->second.lastUse < LRU->second.lastUse)
+      LRU = CI;
+
+  Error Err = LRU->second.RT->remove();
+  ExprCache.erase(LRU);
+  return Err;
+}
+
+bool CompilerSession::overBudget() const {
+  if (!memoryBudget)
+    return false;
+  auto [code, data] = JIT->getMemoryStats().getDylibBytes(*JD);
+  return code + data > memoryBudget;
+}
+
+// Evicts cached expressions until the session is within its memory budget or
+// there is nothing left to evict.
+Error CompilerSession::enforceBudget() {
+  while (overBudget() && !ExprCache.empty())
+    if (auto Err = evictCachedExpr())
+      return Err;
+  return Error::success();
+}
+
+SessionStats CompilerSession::getStats() const {
+  SessionStats stats;
+  const JITMemoryStats &mem = JIT->getMemoryStats();
+  std::tie(stats.codeBytes, stats.dataBytes) = mem.getDylibBytes(*JD);
+  stats.jitCodeBytes = mem.codeBytes;
+  stats.jitDataBytes = mem.dataBytes;
+  std::set<ResourceTracker *> bodies;
+  for (auto &entry : BodyTrackers)
+    bodies.insert(entry.second.get());
+  stats.functionBodies = bodies.size();
+  stats.sharedBodies = BodyTrackers.size() - bodies.size();
+  stats.cachedExprs = ExprCache.size();
+  stats.bulkKernels = BulkTrackers.size();
+  stats.stubs = JIT->getNumStubs(*JD);
+  stats.resourceTrackers =
+      stats.functionBodies + stats.cachedExprs + stats.bulkKernels + stats.stubs;
+  stats.functionProtos = FunctionProtos.size();
+  stats.functionDefs = FunctionDefs.size();
+  for (auto &specs : Specializations)
+    stats.specializations += specs.second.size();
+  stats.memoEntries = memoTable.size();
+  stats.memoEvictions = memoTable.getEvictions();
+  stats.arenaBytes = arena->getBytesAllocated();
+  stats.mallocBytes = sys::Process::GetMallocUsage();
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    stats.peakRSSBytes = (uint64_t)usage.ru_maxrss * 1024; // ru_maxrss is in KiB
+  return stats;
+}
+
+void CompilerSession::printStats(raw_ostream &out) const {
+  SessionStats stats = getStats();
+  out << "JIT code bytes:        " << stats.codeBytes << "\n"
+      << "JIT data bytes:        " << stats.dataBytes << "\n";
+  if (stats.jitCodeBytes != stats.codeBytes || stats.jitDataBytes != stats.dataBytes)
+    out << "shared JIT bytes:      " << stats.jitCodeBytes << " code, "
+        << stats.jitDataBytes << " data (all sessions)\n";
+  if (memoryBudget)
+    out << "memory budget:         " << memoryBudget << "\n";
+  out << "resource trackers:     " << stats.resourceTrackers << " ("
+      << stats.functionBodies << " function bodies, " << stats.cachedExprs
+      << " cached expressions, " << stats.bulkKernels << " bulk kernels, "
+      << stats.stubs << " stubs)\n"
+      << "deduplicated bodies:   " << stats.sharedBodies << "\n"
+      << "prototypes:            " << stats.functionProtos << "\n"
+      << "definitions:           " << stats.functionDefs << "\n"
+      << "specializations:       " << stats.specializations << "\n"
+      << "memoized results:      " << stats.memoEntries << " ("
+      << stats.memoEvictions << " evicted)\n"
+      << "array arena bytes:     " << stats.arenaBytes << "\n"
+      << "process malloc bytes:  " << stats.mallocBytes << "\n"
+      << "process peak RSS:      " << stats.peakRSSBytes << "\n";
+}
+
+// Frees every cached expression that calls name, which was just (re)defined,
+// and the bulk kernel that inlined its previous body. Memoized results are
+// all dropped: any of them may depend on name, and the address of a freed
+// body can be reused by new code.
+Error CompilerSession::invalidateFunction(const std::string &name) {
+  ++FunctionVersions[name];
+  memoTable.clear();
+
+  Error Err = Error::success();
+  auto BI = BulkTrackers.find(name);
+  if (BI != BulkTrackers.end()) {
+    Err = BI->second->remove();
+    BulkTrackers.erase(BI);
+    BulkKernels.erase(name);
+  }
+
+  for (auto CI = ExprCache.begin(); CI != ExprCache.end();) {
+    if (CI->second.callees.count(name)) {
+      Err = joinErrors(std::move(Err), CI->second.RT->remove());
+      CI = ExprCache.erase(CI);
+    } else {
+      ++CI;
+    }
+  }
+  return Err;
+}
+
+// Calls fn, a compiled top-level expression. A runtime error in it, or a
+// cancel with safepoints on (see ToySafepoint), is logged and gives
+// std::nullopt.
+std::optional<double> CompilerSession::runExpr(double (*fn)()) {
+  double result = 0;
+  if (runCancellable([&] { result = fn(); }))
+    return result;
+  // The frames fn left are still counted as under way. Clients share their
+  // profile with code running on other threads, so only a session's own is
+  // reset.
+  if (profile && profile == ownProfile.get())
+    profile->resetDepths();
+  const std::string &error = getThreadSafepoint().error;
+  LogError(error.empty() ? "Evaluation cancelled" : error.c_str());
+  return std::nullopt;
+}
+
+// Runs the __anon_expr held by TSM once and frees its code again. No value
+// if it was cancelled.
+Expected<std::optional<double>>
+CompilerSession::evaluateAnonExpr(ThreadSafeModule TSM) {
+  auto RT = JD->createResourceTracker();
+
+  if (auto Err = JIT->addModule(std::move(TSM), RT))
+    return std::move(Err);
+
+  auto ExprSymbol = JIT->lookup(*JD, "__anon_expr");
+  if (!ExprSymbol)
+    return joinErrors(ExprSymbol.takeError(), RT->remove());
+
+  double (*FP)() = ExprSymbol->getAddress().toPtr<double(*)()>();
+  std::optional<double> result = runExpr(FP);
+
+  if (auto Err = RT->remove())
+    return std::move(Err);
+  return result;
+}
+
+Error CompilerSession::handleTopLevelExpression(bool interactive) {
+
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto fnAST = parser.parseTopLevelExpr()) {
+    fnAST->simplify();
+
+    // Constant expressions need no code at all.
+    if (auto value = fnAST->getConstantValue()) {
+      if (interactive)
+        fprintf(stderr, "Evaluated to %f\n", *value);
+      if (onResult)
+        onResult(*value);
+      return Error::success();
+    }
+
+    // Run the compiled code again if this expression was seen before.
+    std::set<std::string> callees;
+    size_t key = exprCacheKey(*fnAST, callees);
+    CachedExpr *cached = nullptr;
+    auto CI = ExprCache.find(key);
+    std::optional<double> result;
+    if (CI != ExprCache.end() && CI->second.ast->sameBody(*fnAST)) {
+      cached = &CI->second;
+    } else if (fnAST->codegen(*this)) {
+      if (auto Err = enforceBudget())
+        return Err;
+
+      if (overBudget() || ExprCache.count(key)) {
+        // No room to keep it, or another expression has its key: compile,
+        // run and free as a one-off.
+        auto TSM = takeModuleAddingSpecializations();
+        if (!TSM)
+          return TSM.takeError();
+        auto value = evaluateAnonExpr(std::move(*TSM));
+        if (!value)
+          return value.takeError();
+        result = *value;
+      } else {
+        auto entry = cacheAnonExpr(key, std::move(callees), std::move(fnAST));
+        if (!entry)
+          return entry.takeError();
+        cached = *entry;
+      }
+    }
+
+    if (cached) {
+      cached->lastUse = ++UseClock;
+      result = runExpr(cached->fn);
+    }
+    if (result && interactive)
+      fprintf(stderr, "Evaluated to %f\n", *result);
+    if (result && onResult)
+      onResult(*result);
+  } else {
+    lex.getNextToken();
+  }
+  return Error::success();
+}
+
+void CompilerSession::enableProfiling() {
+  if (!ownProfile)
+    ownProfile = std::make_unique<Profile>();
+  profile = ownProfile.get();
+}
+
+Error CompilerSession::enableRemarks(StringRef path) {
+  std::error_code EC;
+  ownRemarksFile = std::make_unique<raw_fd_ostream>(path, EC);
+  if (EC)
+    return createFileError(path, EC);
+
+  remarksOut = ownRemarksFile.get();
+  initializeModule();
+  return Error::success();
+}
+
+Error CompilerSession::enableMLIR(StringRef pipeline) {
+  auto lowering = MLIRLowering::Create(*this, pipeline, TM.get());
+  if (!lowering)
+    return lowering.takeError();
+  mlirLowering = std::move(*lowering);
+  return Error::success();
+}
+
+std::optional<ThreadSafeModule> CompilerSession::lowerThroughMLIR(const FunctionAST &fn) {
+  if (!mlirLowering || profile || DBuilder || safepoints || fn.isMemoized())
+    return std::nullopt;
+  auto SI = Specializations.find(fn.getName());
+  if (SI != Specializations.end() && !SI->second.empty())
+    return std::nullopt;
+
+  // What FunctionAST::codegen registers, which calls (also recursive ones)
+  // are typed by.
+  const PrototypeAST &proto = fn.getProto();
+  FunctionProtos[proto.getName()] = std::make_unique<PrototypeAST>(proto);
+  if (proto.isBinaryOp())
+    BinopPrecedence[proto.getOperatorName()] = proto.getBinaryPrecedence();
+  return mlirLowering->lower(fn);
+}
+
+DISubprogram *CompilerSession::beginDebugFunction(Function *f, SourceLocation loc) {
+  if (!DBuilder)
+    return nullptr;
+
+  DIFile *file = debugUnit->getFile();
+  DISubprogram *SP = DBuilder->createFunction(
+      file, f->getName(), StringRef(), file, loc.line,
+      DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray({})),
+      loc.line, DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+  f->setSubprogram(SP);
+  debugScope = SP;
+  emitLocation(loc);
+  return SP;
+}
+
+void CompilerSession::emitLocation(SourceLocation loc) {
+  if (!debugScope)
+    return;
+  builder->SetCurrentDebugLocation(
+      DILocation::get(*context, loc.line, loc.col, debugScope));
+}
+
+// REPL commands:
+//   :stats        print memory and resource counters (see getStats)
+//   :profile      print the --profile counters so far
+//   :save <file>  write a session image (see saveImage)
+//   :load <file>  load a source file; loading it again only compiles what changed
+//   :reload       load the last loaded file again
+// Reads a command from lex, which is at its ':'. The token after it is not
+// read yet: in the REPL, that waits for the next line.
+static bool lexCommand(Lexer &lex, std::string &command, std::string &argument) {
+  lex.getNextToken(); // eat ':'.
+  if (lex.CurTok != IDENTIFIER) {
+    LogError("Expected a command name after ':'");
+    return false;
+  }
+  command = lex.IdentifierStr;
+  // A file name is not made of tokens; take the rest of the line.
+  argument = command == "save" || command == "load" ? lex.readLine() : "";
+  return true;
+}
+
+void CompilerSession::handleCommand() {
+  std::string command, argument;
+  if (!lexCommand(lex, command, argument))
+    return;
+  if (commandsAllowed)
+    runCommand(command, argument);
+  else
+    LogError(("Command ':" + command + "' is not available here").c_str());
+  lex.getNextToken();
+}
+
+void CompilerSession::runCommand(const std::string &command,
+                                 const std::string &argument) {
+  if (command == "stats") {
+    printStats(errs());
+  } else if (command == "profile") {
+    if (profile)
+      profile->print(errs());
+    else
+      LogError("Profiling is off; start toy with --profile");
+  } else if (command == "load" || command == "reload") {
+    std::string path = command == "load" ? argument : LastLoadedPath;
+    if (path.empty())
+      LogError(command == "load" ? "Expected a file name after ':load'"
+                                 : "Nothing to reload; use ':load <file>'");
+    else if (auto Err = loadSourceFile(path))
+      LogError(toString(std::move(Err)).c_str());
+  } else if (command == "save") {
+    if (argument.empty())
+      LogError("Expected a file name after ':save'");
+    else if (auto Err = saveImage(argument))
+      LogError(toString(std::move(Err)).c_str());
+  } else {
+    LogError(("Unknown command ':" + command + "'").c_str());
+  }
+}
+
+Error CompilerSession::runTopLevel(bool interactive) {
+  while (true) {
+    switch (lex.CurTok) {
+    case TK_EOF:
+      return Error::success();
+    case ':':
+      handleCommand();
+      break;
+    case ';': // ignore top-level semicolons.
+      lex.getNextToken();
+
+      break;
+    case DEF:
+    case MEMO:
+
+      if (auto Err = handleDefinition())
+        return Err;
+      break;
+    case EXTERN:
+
+      handleExtern(interactive);
+      break;
+    default:
+
+      if (auto Err = handleTopLevelExpression(interactive))
+        return Err;
+      break;
+    }
+    if (interactive)
+      fprintf(stderr, "ready> ");
+  }
+}
+
+void CompilerSession::mainLoop() {
+  fprintf(stderr, "ready> ");
+  lex.getNextToken();
+
+  ExitOnErr(runTopLevel(true));
+}
+
+Error CompilerSession::compile(StringRef source,
+                               function_ref<void(double)> onResult,
+                               bool allowCommands) {
+  std::string src = source.str();
+  ErrorCapture errors;
+
+  this->onResult = onResult;
+  commandsAllowed = allowCommands;
+  lex.setInputBuffer(&src);
+  lex.getNextToken();
+  Error Err = runTopLevel(false);
+  lex.setInputBuffer(nullptr);
+  this->onResult = nullptr;
+  commandsAllowed = true;
+
+  return joinErrors(std::move(Err), errors.takeError());
+}
+
+Expected<BulkKernel> CompilerSession::compileBulkKernel(const std::string &name) {
+  auto KI = BulkKernels.find(name);
+  if (KI != BulkKernels.end())
+    return KI->second;
+
+  auto DI = FunctionDefs.find(name);
+  if (DI == FunctionDefs.end())
+    return createStringError(inconvertibleErrorCode(),
+                             "unknown function '%s'", name.c_str());
+
+  // Emit the definition again next to the loop so it can be inlined. Internal
+  // linkage keeps it from clashing with the JIT'd copy.
+  Function *callee = DI->second->codegen(*this);
+  if (!callee) {
+    initializeModule();
+    return createStringError(inconvertibleErrorCode(),
+                             "could not compile '%s'", name.c_str());
+  }
+  callee->setLinkage(GlobalValue::InternalLinkage);
+  unsigned numArgs = callee->arg_size();
+
+  for (auto &arg : callee->args())
+    if (!arg.getType()->isDoubleTy()) {
+      initializeModule();
+      return createStringError(inconvertibleErrorCode(),
+                               "'%s' takes non-double arguments", name.c_str());
+    }
+  if (!callee->getReturnType()->isDoubleTy()) {
+    initializeModule();
+    return createStringError(inconvertibleErrorCode(),
+                             "'%s' does not return a double", name.c_str());
+  }
+
+  Type *doubleTy = builder->getDoubleTy();
+  Type *ptrTy = builder->getPtrTy();
+  Type *i64Ty = builder->getInt64Ty();
+  FunctionType *FT =
+      FunctionType::get(builder->getVoidTy(), {ptrTy, ptrTy, i64Ty}, false);
+  Function *kernel = Function::Create(FT, Function::ExternalLinkage,
+                                      "__bulk_" + name, module.get());
+  kernel->addParamAttr(1, Attribute::NoAlias);
+  beginDebugFunction(kernel, DI->second->getProto().getLocation());
+  Value *columns = kernel->getArg(0);
+  Value *out = kernel->getArg(1);
+  Value *n = kernel->getArg(2);
+
+  BasicBlock *entryBB = BasicBlock::Create(*context, "entry", kernel);
+  BasicBlock *loopBB = BasicBlock::Create(*context, "loop", kernel);
+  BasicBlock *exitBB = BasicBlock::Create(*context, "exit", kernel);
+
+  builder->SetInsertPoint(entryBB);
+  std::vector<Value *> columnPtrs;
+  for (unsigned c = 0; c < numArgs; ++c) {
+    Value *slot = builder->CreateConstInBoundsGEP1_64(ptrTy, columns, c);
+    columnPtrs.push_back(builder->CreateLoad(ptrTy, slot, "column"));
+  }
+  Value *zero = ConstantInt::get(i64Ty, 0);
+  builder->CreateCondBr(builder->CreateICmpSGT(n, zero), loopBB, exitBB);
+
+  builder->SetInsertPoint(loopBB);
+  PHINode *i = builder->CreatePHI(i64Ty, 2, "i");
+  i->addIncoming(zero, entryBB);
+
+  std::vector<Value *> args;
+  for (Value *column : columnPtrs)
+    args.push_back(builder->CreateLoad(
+        doubleTy, builder->CreateInBoundsGEP(doubleTy, column, i), "arg"));
+  Value *result = builder->CreateCall(callee, args, "result");
+  builder->CreateStore(result, builder->CreateInBoundsGEP(doubleTy, out, i));
+
+  Value *next = builder->CreateAdd(i, ConstantInt::get(i64Ty, 1), "next",
+                                   /*HasNUW=*/true, /*HasNSW=*/true);
+  i->addIncoming(next, loopBB);
+  builder->CreateCondBr(builder->CreateICmpSLT(next, n), loopBB, exitBB);
+
+  builder->SetInsertPoint(exitBB);
+  builder->CreateRetVoid();
+  verifyFunction(*kernel);
+
+  // The full O3 pipeline with the host's TTI does the inlining and vectorization.
+  {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM.get());
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3).run(*module, MAM);
+  }
+
+  auto TSM = takeModuleAddingSpecializations();
+  if (!TSM)
+    return TSM.takeError();
+  auto RT = JD->createResourceTracker();
+  if (auto Err = JIT->addModule(std::move(*TSM), RT))
+    return std::move(Err);
+  BulkTrackers[name] = RT;
+
+  auto fn = lookup<void(const double *const *, double *, int64_t)>("__bulk_" + name);
+  if (!fn)
+    return fn.takeError();
+
+  return BulkKernels[name] = BulkKernel{*fn, numArgs};
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel file loading: the source is cut at every 'def'/'extern', each chunk
+// is parsed and codegen'd by a worker session with its own LLVMContext, and the
+// resulting modules are handed to the JIT in source order.
+//
+// Loading a file again only compiles the definitions whose AST changed since
+// the last load, plus the callers of functions whose prototype changed (an
+// operator's precedence changes how they parse). Unchanged functions keep
+// their compiled body.
+//===----------------------------------------------------------------------===//
+
+namespace {
+struct CompiledItem {
+  enum Kind { Definition, Extern, Expression } kind;
+  std::optional<ThreadSafeModule> TSM;
+  std::string externIR;
+  std::unique_ptr<FunctionAST> def;
+  // Value of an expression that folded to a constant; it has no TSM.
+  std::optional<double> value;
+  // Of a definition's prototype and AST.
+  size_t hash = 0;
+  // Of an extern.
+  std::optional<PrototypeAST> proto;
+};
+
+// What the workers need to know about the whole file.
+struct LoadContext {
+  std::vector<PrototypeAST> protos;
+  std::map<char, int> precedence;
+  // See CompilerSession::DefinedFunctions.
+  std::set<std::string> defined;
+  // Hashes of the definitions installed by earlier loads.
+  std::map<std::string, size_t> previousHashes;
+  // Definitions to compile even if their hash did not change.
+  std::set<std::string> forced;
+};
+} // namespace
+
+static size_t hashDefinition(const FunctionAST &fnAST) {
+  std::set<std::string> callees;
+  return hash_combine(fnAST.getProto().hash(), fnAST.hashBody(callees),
+                      fnAST.isMemoized());
+}
+
+// Parses and codegens the top-level item at S.lex.CurTok, which is not ';'.
+// Definitions that are unchanged since an earlier load (see LoadContext) are
+// skipped, as are items that do not parse or compile.
+static std::optional<CompiledItem> compileItem(CompilerSession &S,
+                                               const LoadContext &load) {
+  switch (S.lex.CurTok) {
+  case DEF:
+  case MEMO:
+    if (auto fnAST = S.parser.parseDefinition()) {
+      size_t hash = hashDefinition(*fnAST);
+      auto HI = load.previousHashes.find(fnAST->getName());
+      if (HI != load.previousHashes.end() && HI->second == hash &&
+          !load.forced.count(fnAST->getName()))
+        return std::nullopt;
+
+      fnAST->simplify();
+      if (auto TSM = S.lowerThroughMLIR(*fnAST))
+        return CompiledItem{CompiledItem::Definition, std::move(*TSM), "",
+                            std::move(fnAST), std::nullopt, hash};
+      if (fnAST->codegen(S))
+        return CompiledItem{CompiledItem::Definition, S.takeModule(), "",
+                            std::move(fnAST), std::nullopt, hash};
+    } else {
+      S.lex.getNextToken();
+    }
+    return std::nullopt;
+  case EXTERN:
+    if (auto protoAST = S.parser.parseExtern()) {
+      if (auto *fnIR = protoAST->codegen(S)) {
+        std::string IR;
+        raw_string_ostream OS(IR);
+        fnIR->print(OS);
+        CompiledItem item{CompiledItem::Extern, std::nullopt, OS.str(), nullptr};
+        item.proto = *protoAST;
+        S.FunctionProtos[protoAST->getName()] = std::move(protoAST);
+        return item;
+      }
+    } else {
+      S.lex.getNextToken();
+    }
+    return std::nullopt;
+  default:
+    if (auto fnAST = S.parser.parseTopLevelExpr()) {
+      fnAST->simplify();
+      if (auto value = fnAST->getConstantValue())
+        return CompiledItem{CompiledItem::Expression, std::nullopt, "", nullptr, value};
+      if (fnAST->codegen(S))
+        return CompiledItem{CompiledItem::Expression, S.takeModule(), "", nullptr};
+    } else {
+      S.lex.getNextToken();
+    }
+    return std::nullopt;
+  }
+}
+
+// remarks, if not null, receives the optimization remarks of the chunk.
+static std::vector<CompiledItem>
+compileChunk(CompilerSession &S, const std::string &chunk, unsigned firstLine,
+             const LoadContext &load, std::string *remarks) {
+  S.BinopPrecedence = load.precedence;
+  S.DefinedFunctions = load.defined;
+  S.FunctionProtos.clear();
+  for (auto &proto : load.protos)
+    S.FunctionProtos[proto.getName()] = std::make_unique<PrototypeAST>(proto);
+
+  std::optional<raw_string_ostream> remarksOS;
+  if (remarks)
+    S.remarksOut = &remarksOS.emplace(*remarks);
+
+  S.initializeModule();
+  S.lex.setInputBuffer(&chunk, firstLine);
+  S.lex.getNextToken();
+
+  std::vector<CompiledItem> items;
+  while (S.lex.CurTok != TK_EOF) {
+    if (S.lex.CurTok == ';') {
+      S.lex.getNextToken();
+      continue;
+    }
+    if (auto item = compileItem(S, load))
+      items.push_back(std::move(*item));
+  }
+  S.lex.setInputBuffer(nullptr);
+
+  // Drop the context streaming into remarksOS before it goes away.
+  S.remarksOut = nullptr;
+  S.initializeModule();
+  return items;
+}
+
+// Logs the text of an ErrorCapture from a worker thread, one error per line.
+static void logCapturedErrors(StringRef errors) {
+  if (errors.empty())
+    return;
+  SmallVector<StringRef, 1> lines;
+  errors.split(lines, '\n');
+  for (StringRef line : lines)
+    LogError(line.str().c_str());
+}
+
+Error CompilerSession::loadSourceFile(StringRef path) {
+  auto buffer = MemoryBuffer::getFile(path, /*IsText=*/true);
+  if (!buffer)
+    return createFileError(path, buffer.getError());
+
+  LastLoadedPath = path.str();
+  return loadFile((*buffer)->getBuffer().str());
+}
+
+Error CompilerSession::loadFile(const std::string &src) {
+  std::vector<size_t> starts = splitTopLevelItems(src);
+  std::vector<std::string> chunks;
+  std::vector<unsigned> firstLines;
+  unsigned line = 1;
+  for (size_t i = 0; i < starts.size(); ++i) {
+    size_t end = i + 1 < starts.size() ? starts[i + 1] : src.size();
+    chunks.push_back(src.substr(starts[i], end - starts[i]));
+    firstLines.push_back(line);
+    line += std::count(chunks.back().begin(), chunks.back().end(), '\n');
+  }
+
+  // Every chunk may call functions and use operators defined in any other, so
+  // parse just the prototype of each item up front. They only become the
+  // session's once their definition is installed.
+  // (With a lexer of its own: this may run from a command in the middle of
+  // the session's input.)
+  Lexer protoLex;
+  std::map<char, int> precedence = BinopPrecedence;
+  Parser protoParser(protoLex, precedence);
+  LoadContext load;
+  load.defined = DefinedFunctions;
+  std::set<std::string> changedProtos;
+  for (size_t c = 0; c < chunks.size(); ++c) {
+    protoLex.setInputBuffer(&chunks[c], firstLines[c]);
+    if (protoLex.getNextToken() == MEMO)
+      protoLex.getNextToken();
+    if (protoLex.CurTok != DEF && protoLex.CurTok != EXTERN)
+      continue;
+
+    bool isDef = protoLex.CurTok == DEF;
+    protoLex.getNextToken();
+    if (auto proto = protoParser.parsePrototype()) {
+      if (isDef)
+        load.defined.insert(proto->getName());
+      if (proto->isBinaryOp())
+        precedence[proto->getOperatorName()] = proto->getBinaryPrecedence();
+      auto known = FunctionProtos.find(proto->getName());
+      if (known != FunctionProtos.end() && known->second->hash() != proto->hash())
+        changedProtos.insert(proto->getName());
+      load.protos.push_back(*proto);
+    }
+  }
+  // The file can also call what the session has but it does not declare.
+  std::set<std::string> declared;
+  for (auto &proto : load.protos)
+    declared.insert(proto.getName());
+  for (auto &entry : FunctionProtos)
+    if (!declared.count(entry.first))
+      load.protos.push_back(*entry.second);
+  load.precedence = precedence;
+  load.previousHashes = DefinitionHashes;
+
+  // The call graph, from the current ASTs.
+  if (!changedProtos.empty())
+    for (auto &entry : FunctionDefs) {
+      std::set<std::string> callees;
+      entry.second->hashBody(callees);
+      for (const std::string &callee : callees)
+        if (changedProtos.count(callee))
+          load.forced.insert(entry.first);
+    }
+
+  std::vector<std::promise<std::vector<CompiledItem>>> promises(chunks.size());
+  std::vector<std::future<std::vector<CompiledItem>>> results;
+  for (auto &promise : promises)
+    results.push_back(promise.get_future());
+
+  // Written by the workers, copied to remarksOut in source order.
+  std::vector<std::string> chunkRemarks(chunks.size());
+  // Errors of each chunk, logged in source order as it is installed.
+  std::vector<std::string> chunkErrors(chunks.size());
+
+  std::atomic<size_t> next{0};
+  unsigned numWorkers = std::max(1u, std::thread::hardware_concurrency());
+  numWorkers = std::min<size_t>(numWorkers, chunks.size());
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < numWorkers; ++i)
+    workers.emplace_back([&] {
+      CompilerSession worker(DL);
+      worker.arena = arena;
+      worker.profile = profile;
+      worker.safepoints = safepoints;
+      worker.sourceName = sourceName;
+      if (mlirLowering)
+        cantFail(worker.enableMLIR(mlirLowering->getPipeline()));
+      for (size_t c = next++; c < chunks.size(); c = next++) {
+        ErrorCapture errors;
+        std::vector<CompiledItem> items =
+            compileChunk(worker, chunks[c], firstLines[c], load,
+                         remarksOut ? &chunkRemarks[c] : nullptr);
+        chunkErrors[c] = toString(errors.takeError());
+        promises[c].set_value(std::move(items));
+      }
+    });
+
+  Error Err = Error::success();
+  for (size_t c = 0; c < results.size(); ++c) {
+    std::vector<CompiledItem> items = results[c].get();
+    if (remarksOut)
+      *remarksOut << chunkRemarks[c];
+    if (!Err)
+      logCapturedErrors(chunkErrors[c]);
+
+    for (auto &item : items) {
+      if (Err)
+        continue;
+
+      switch (item.kind) {
+      case CompiledItem::Definition:
+        Err = installDefinition(std::move(item.def), std::move(*item.TSM),
+                                item.hash);
+        break;
+      case CompiledItem::Extern:
+        errs() << item.externIR;
+        FunctionProtos[item.proto->getName()] =
+            std::make_unique<PrototypeAST>(*item.proto);
+        break;
+      case CompiledItem::Expression:
+        if (item.value)
+          fprintf(stderr, "Evaluated to %f\n", *item.value);
+        else if (auto result = evaluateAnonExpr(std::move(*item.TSM))) {
+          if (*result)
+            fprintf(stderr, "Evaluated to %f\n", **result);
+        } else {
+          Err = result.takeError();
+        }
+        break;
+      }
+    }
+  }
+
+  for (auto &worker : workers)
+    worker.join();
+
+  return Err;
+}
+
+// Makes fnAST, compiled into TSM, the definition of its name, unless that
+// changes its signature or the memory budget is exhausted. Nothing is
+// specialized from it.
+Error CompilerSession::installDefinition(std::unique_ptr<FunctionAST> fnAST,
+                                         ThreadSafeModule TSM, size_t hash) {
+  std::string name = fnAST->getName();
+  auto &def = FunctionDefs[name];
+  if (def && !def->getProto().hasSameSignature(fnAST->getProto())) {
+    LogError(("Redefinition of '" + name + "' changes its signature").c_str());
+    return Error::success();
+  }
+  if (auto Err = enforceBudget())
+    return Err;
+  if (overBudget()) {
+    LogError(("Memory budget exceeded; definition of '" + name + "' rejected").c_str());
+    return Error::success();
+  }
+
+  const PrototypeAST &proto = fnAST->getProto();
+  FunctionProtos[name] = std::make_unique<PrototypeAST>(proto);
+  if (proto.isBinaryOp())
+    BinopPrecedence[proto.getOperatorName()] = proto.getBinaryPrecedence();
+  def = std::move(fnAST);
+  if (auto Err = addBody(name, std::move(TSM)))
+    return Err;
+  if (auto Err = invalidateFunction(name))
+    return Err;
+  DefinitionHashes[name] = hash;
+  return Error::success();
+}
+
+//===----------------------------------------------------------------------===//
+// Piped input: a reader thread parses and codegens the items of the script
+// while the session thread compiles and runs the ones before them, so a
+// script takes about as long as the slower of the two, not their sum.
+// Everything an item prints, its errors included, still comes in input order.
+//===----------------------------------------------------------------------===//
+
+namespace {
+// An item of piped input, handed from the reader to the session thread.
+struct PipedItem {
+  std::optional<CompiledItem> compiled;
+  // Set for a command, which runs on the session thread. The reader waits
+  // for it: a command can define functions the next items call.
+  std::promise<LoadContext> *commandDone = nullptr;
+  std::string command, argument;
+  // Parse and codegen errors, logged when the item's turn comes.
+  std::string errors;
+  std::string remarks;
+  bool end = false;
+};
+
+// Items in input order. The reader blocks when it is PipelineDepth items
+// ahead.
+class PipedItemQueue {
+  std::mutex M;
+  std::condition_variable CV;
+  std::deque<PipedItem> items;
+
+public:
+  void push(PipedItem item) {
+    std::unique_lock<std::mutex> lock(M);
+    CV.wait(lock, [&] { return items.size() < PipelineDepth; });
+    items.push_back(std::move(item));
+    CV.notify_all();
+  }
+
+  PipedItem pop() {
+    std::unique_lock<std::mutex> lock(M);
+    CV.wait(lock, [&] { return !items.empty(); });
+    PipedItem item = std::move(items.front());
+    items.pop_front();
+    CV.notify_all();
+    return item;
+  }
+};
+} // namespace
+
+Error CompilerSession::runPipelined() {
+  // What the reader needs to know about the session before an item.
+  auto context = [&] {
+    LoadContext load;
+    load.precedence = BinopPrecedence;
+    load.defined = DefinedFunctions;
+    for (auto &entry : FunctionProtos)
+      load.protos.push_back(*entry.second);
+    return load;
+  };
+
+  PipedItemQueue queue;
+  std::thread reader([&, load = context()]() mutable {
+    CompilerSession worker(DL);
+    worker.arena = arena;
+    worker.profile = profile;
+    worker.safepoints = safepoints;
+    worker.sourceName = sourceName;
+    if (mlirLowering)
+      cantFail(worker.enableMLIR(mlirLowering->getPipeline()));
+    auto sync = [&] {
+      worker.BinopPrecedence = load.precedence;
+      worker.DefinedFunctions = load.defined;
+      worker.FunctionProtos.clear();
+      for (auto &proto : load.protos)
+        worker.FunctionProtos[proto.getName()] =
+            std::make_unique<PrototypeAST>(proto);
+    };
+    sync();
+
+    std::string remarks;
+    std::optional<raw_string_ostream> remarksOS;
+    if (remarksOut)
+      worker.remarksOut = &remarksOS.emplace(remarks);
+    worker.initializeModule();
+    worker.lex.getNextToken();
+
+    // Piped input has no earlier load; load.previousHashes stays empty.
+    while (worker.lex.CurTok != TK_EOF) {
+      if (worker.lex.CurTok == ';') {
+        worker.lex.getNextToken();
+        continue;
+      }
+
+      PipedItem item;
+      std::promise<LoadContext> commandDone;
+      {
+        ErrorCapture errors;
+        if (worker.lex.CurTok != ':')
+          item.compiled = compileItem(worker, load);
+        else if (lexCommand(worker.lex, item.command, item.argument))
+          item.commandDone = &commandDone;
+        item.errors = toString(errors.takeError());
+      }
+      item.remarks = std::move(remarks);
+      remarks.clear();
+
+      bool isCommand = item.commandDone != nullptr;
+      queue.push(std::move(item));
+      if (isCommand) {
+        load = commandDone.get_future().get();
+        sync();
+        worker.lex.getNextToken();
+      }
+    }
+
+    // Drop the context streaming into remarksOS before it goes away.
+    worker.remarksOut = nullptr;
+    worker.initializeModule();
+    PipedItem end;
+    end.end = true;
+    queue.push(std::move(end));
+  });
+
+  // After an error, items are still taken (and commands answered) so that
+  // the reader can finish.
+  Error Err = Error::success();
+  for (PipedItem item = queue.pop(); !item.end; item = queue.pop()) {
+    if (remarksOut)
+      *remarksOut << item.remarks;
+    if (!Err)
+      logCapturedErrors(item.errors);
+
+    if (item.commandDone) {
+      if (!Err)
+        runCommand(item.command, item.argument);
+      item.commandDone->set_value(context());
+      continue;
+    }
+    if (Err || !item.compiled)
+      continue;
+
+    CompiledItem &compiled = *item.compiled;
+    switch (compiled.kind) {
+    case CompiledItem::Definition:
+      Err = installDefinition(std::move(compiled.def), std::move(*compiled.TSM),
+                              compiled.hash);
+      break;
+    case CompiledItem::Extern:
+      errs() << compiled.externIR;
+      FunctionProtos[compiled.proto->getName()] =
+          std::make_unique<PrototypeAST>(*compiled.proto);
+      break;
+    case CompiledItem::Expression:
+      if (compiled.value)
+        fprintf(stderr, "Evaluated to %f\n", *compiled.value);
+      else if (auto result = evaluateAnonExpr(std::move(*compiled.TSM))) {
+        if (*result)
+          fprintf(stderr, "Evaluated to %f\n", **result);
+      } else {
+        Err = result.takeError();
+      }
+      break;
+    }
+  }
+
+  reader.join();
+  return Err;
+}
@@ -0,0 +1,311 @@
+#ifndef COMPILER_SESSION_H
+#define COMPILER_SESSION_H
+
+#include "AST.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Profile.h"
+#include "Runtime.h"
+
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/Support/Allocator.h"
+
+#include <array>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+// A JIT'd loop over whole columns: out[i] = fn(columns[0][i], columns[1][i], ...).
+struct BulkKernel {
+    void (*fn)(const double *const *columns, double *out, int64_t n);
+    unsigned numArgs;
+};
+
+// Snapshot of what a session holds (see CompilerSession::getStats).
+struct SessionStats {
+    uint64_t codeBytes = 0;   // JIT'd code of this session currently loaded
+    uint64_t dataBytes = 0;   // JIT'd data of this session currently loaded
+    // The same for every session sharing the JIT (see createClientSession).
+    uint64_t jitCodeBytes = 0;
+    uint64_t jitDataBytes = 0;
+    size_t functionBodies = 0;
+    // Functions whose body is the code of another one, which has the same
+    // optimized IR but for names.
+    size_t sharedBodies = 0;
+    size_t cachedExprs = 0;
+    size_t bulkKernels = 0;
+    size_t stubs = 0;
+    size_t resourceTrackers = 0; // all of the above hold one each
+    size_t functionProtos = 0;
+    size_t functionDefs = 0;
+    size_t specializations = 0;
+    size_t memoEntries = 0;      // cached results of memo def functions
+    uint64_t memoEvictions = 0;
+    uint64_t arenaBytes = 0;     // toy arrays
+    // Process-wide, shared by all sessions in the process.
+    uint64_t mallocBytes = 0;
+    uint64_t peakRSSBytes = 0;
+};
+
+class MLIRLowering;
+
+// SHA-1 of a function body's IR (see CompilerSession::addBody).
+using BodyKey = std::array<uint8_t, 20>;
+
+// A copy of a function with some arguments fixed to constants.
+struct Specialization {
+    std::string name;
+    std::vector<std::optional<double>> consts;
+};
+
+// Everything one compilation needs: lexer, parser, codegen state and the JIT.
+// Sessions share nothing, so independent sessions can run on different
+// threads at the same time.
+class CompilerSession {
+public:
+    std::unique_ptr<LLVMContext> context;
+    std::unique_ptr<IRBuilder<>> builder;
+    std::unique_ptr<Module> module;
+    std::map<std::string, AllocaInst*> namedValues;
+    // The session's own JIT, or the one of the session it is a client of.
+    KaleidoscopeJIT *JIT = nullptr;
+    // Where this session's code goes.
+    JITDylib *JD = nullptr;
+    std::unique_ptr<FunctionPassManager> FPM;
+    // Extra cleanup for specializations: their constants can fold whole loops.
+    std::unique_ptr<FunctionPassManager> SpecializeFPM;
+    std::unique_ptr<LoopAnalysisManager> LAM;
+    std::unique_ptr<FunctionAnalysisManager> FAM;
+    std::unique_ptr<CGSCCAnalysisManager> CGAM;
+    std::unique_ptr<ModuleAnalysisManager> MAM;
+    std::unique_ptr<PassInstrumentationCallbacks> PIC;
+    std::unique_ptr<StandardInstrumentations> SI;
+    std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+    std::map<char, int> BinopPrecedence;
+    // Backing memory of toy arrays. Worker sessions point at their parent's.
+    ToyArena *arena = &ownArena;
+    // Set by enableProfiling to instrument functions and loops. Worker
+    // sessions point at their parent's.
+    Profile *profile = nullptr;
+    // Hard cap on the JIT'd code and data bytes of this session's JITDylib,
+    // 0 for none; client sessions get a budget of their own. When it is
+    // reached, cached expressions are evicted; if that is not enough, new
+    // expressions run uncached and new definitions are rejected.
+    uint64_t memoryBudget = 0;
+    // Set by enableRemarks: optimization remarks of every module go here as
+    // YAML. Worker sessions write to a buffer of their own.
+    raw_ostream *remarksOut = nullptr;
+    // Compile safepoint polls into function entries and loop back-edges (see
+    // ToySafepoint in Runtime.h), so that running code can be paused or
+    // cancelled from another thread. Worker and client sessions copy it.
+    bool safepoints = false;
+    // ToySafepoint of the thread running the function being emitted, if it
+    // polls.
+    Value *safepointFlag = nullptr;
+    // Name of the source in debug locations (and so in remarks).
+    std::string sourceName = "<stdin>";
+    // Debug info of the current module, only built while remarks are on so
+    // that they can point at toy source lines.
+    std::unique_ptr<DIBuilder> DBuilder;
+    DICompileUnit *debugUnit = nullptr;
+    // Subprogram of the function being emitted, if any.
+    DIScope *debugScope = nullptr;
+    // ASTs of all compiled definitions, so they can be emitted into other modules.
+    std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+    // Names of all functions toy code defines, whether or not the session has
+    // their AST; for a worker session, also those of its parent and of the
+    // rest of the input. Calls to them never bind to the runtime bitcode.
+    std::set<std::string> DefinedFunctions;
+    // Constant-argument specializations emitted so far, per original function.
+    std::map<std::string, std::vector<Specialization>> Specializations;
+    // Specializations emitted into the current module.
+    std::vector<std::string> NewSpecializations;
+
+    Lexer lex;
+    Parser parser;
+
+    // Creates a session with its own JIT.
+    static Expected<std::unique_ptr<CompilerSession>>
+    Create(const JITOptions &opts = JITOptions());
+
+    // Creates a codegen-only session (no JIT) producing modules for DL, or
+    // one owning JIT.
+    explicit CompilerSession(const DataLayout &DL,
+                             std::unique_ptr<KaleidoscopeJIT> JIT = nullptr);
+    ~CompilerSession();
+
+    CompilerSession(const CompilerSession &) = delete;
+    CompilerSession &operator=(const CompilerSession &) = delete;
+
+    Function *getFunction(const std::string &name);
+
+    // Starts a fresh module (and pass pipeline) for the next top-level item.
+    void initializeModule();
+    // Moves the current module out of the session and starts a fresh one.
+    ThreadSafeModule takeModule();
+
+    // Creates a session compiling into a JITDylib of its own, which sees
+    // everything compiled in this session so far without compiling it again.
+    // The client can redefine those functions for itself only. This session
+    // must not compile anything else while it has clients.
+    Expected<std::unique_ptr<CompilerSession>> createClientSession();
+
+    // Compiles every top-level item of source into the JIT, running top-level
+    // expressions for their side effects. onResult, if given, receives the
+    // value of each. Parse and codegen errors are collected into the
+    // returned error. Without allowCommands, REPL commands such as ':load'
+    // are rejected with an error instead of run, for sources from clients
+    // that must not reach the files or stats of the process.
+    Error compile(StringRef source, function_ref<void(double)> onResult = nullptr,
+                  bool allowCommands = true);
+
+    // Address of the compiled function name, e.g. lookup<double(double, double)>("f").
+    template <typename Fn> Expected<Fn *> lookup(StringRef name) {
+        auto sym = JIT->lookup(*JD, name);
+        if (!sym)
+            return sym.takeError();
+        return sym->getAddress().template toPtr<Fn *>();
+    }
+
+    // Compiles (once) a bulk kernel around the function name. The function is
+    // inlined into the loop and the loop is vectorized for the host CPU.
+    Expected<BulkKernel> compileBulkKernel(const std::string &name);
+
+    // Writes the session's functions, prototypes and operators to a session
+    // image at path, with every function compiled to an object file.
+    // Top-level expressions, specializations and bulk kernels are not saved.
+    Error saveImage(StringRef path);
+    // Adds everything in the session image at path to this session, which
+    // must run on the CPU the image was compiled for. Nothing is parsed or
+    // compiled; the objects are linked straight from the mapped file.
+    // Functions from an image cannot be specialized or bulk evaluated.
+    Error loadImage(StringRef path);
+
+    // Instruments all code compiled from now on with call counts and cycles.
+    void enableProfiling();
+    // Writes optimization remarks of all code compiled from now on to path.
+    Error enableRemarks(StringRef path);
+    // Compiles definitions from now on through MLIR where it covers them (see
+    // MLIRGen.h), running pipeline instead of the default one if not empty.
+    Error enableMLIR(StringRef pipeline = "");
+    // fn compiled through MLIR, if that is enabled and applies to fn. Code
+    // that is profiled, has debug info or safepoints, is memoized or has
+    // specialized callers takes the AST codegen path.
+    std::optional<ThreadSafeModule> lowerThroughMLIR(const FunctionAST &fn);
+
+    // Gives f a debug subprogram at loc, if debug info is on, and makes it
+    // the scope of the code emitted next.
+    DISubprogram *beginDebugFunction(Function *f, SourceLocation loc);
+    // Locates the instructions emitted next at loc, if debug info is on.
+    void emitLocation(SourceLocation loc);
+
+    SessionStats getStats() const;
+    void printStats(raw_ostream &out) const;
+
+    // Interactive read-eval-print loop over stdin.
+    void mainLoop();
+    // Runs the items of a script piped to stdin. Each is parsed and lowered
+    // to IR on a thread of its own while the items before it compile and
+    // run; what they print comes in input order. Calls are not specialized
+    // and expressions are not cached, as with loadFile.
+    Error runPipelined();
+    // Compiles the top-level items of src on worker threads and runs them in
+    // order. Definitions that are unchanged since an earlier load (and do not
+    // depend on a changed prototype) are not compiled again.
+    Error loadFile(const std::string &src);
+    // loadFile on the contents of the file at path.
+    Error loadSourceFile(StringRef path);
+
+private:
+    DataLayout DL;
+    // Host target, so the pass pipeline sees real vector widths and costs.
+    std::unique_ptr<TargetMachine> TM;
+    ToyArena ownArena;
+    // Results of the memo def functions compiled in this session's JITDylib.
+    ToyMemoTable memoTable;
+    std::unique_ptr<Profile> ownProfile;
+    std::unique_ptr<raw_fd_ostream> ownRemarksFile;
+    std::unique_ptr<KaleidoscopeJIT> ownJIT;
+    // Set by enableMLIR.
+    std::unique_ptr<MLIRLowering> mlirLowering;
+    // Set while compile runs.
+    function_ref<void(double)> onResult;
+    bool commandsAllowed = true;
+    std::map<std::string, BulkKernel> BulkKernels;
+
+    // A top-level expression kept in the JIT so it can run again.
+    struct CachedExpr {
+        ResourceTrackerSP RT;
+        double (*fn)();
+        std::set<std::string> callees;
+        uint64_t lastUse;
+        // The folded expression, compared on lookup since keys can collide.
+        std::unique_ptr<FunctionAST> ast;
+    };
+    // Keyed by exprCacheKey.
+    std::map<size_t, CachedExpr> ExprCache;
+    // Bumped whenever a function is (re)defined; part of the cache key.
+    std::map<std::string, unsigned> FunctionVersions;
+    unsigned NextExprId = 0;
+    uint64_t UseClock = 0;
+
+    // Current body of every function; each public name is a stub into these.
+    // Functions with identical code share one body and its tracker.
+    std::map<std::string, ResourceTrackerSP> BodyTrackers;
+    unsigned NextBodyId = 0;
+    // Bodies that can be shared, by their IR.
+    struct SharedBody {
+        std::string bodyName;
+        ResourceTrackerSP RT;
+    };
+    std::map<BodyKey, SharedBody> BodiesByIR;
+    // Code of each compiled bulk kernel, freed when its function is redefined.
+    std::map<std::string, ResourceTrackerSP> BulkTrackers;
+
+    // Images loaded so far, mapped for as long as the session lives.
+    std::vector<std::unique_ptr<MemoryBuffer>> Images;
+    std::set<uint64_t> ImageIds;
+    // Functions whose current body came from an image. They have no AST, so
+    // saving copies their object from the image.
+    struct ImageBody {
+        std::string symbol;
+        StringRef object;
+    };
+    std::map<std::string, ImageBody> ImageBodies;
+
+    // Hash of each function's definition as of the loadFile (or piped input)
+    // that installed its current body.
+    std::map<std::string, size_t> DefinitionHashes;
+    std::string LastLoadedPath;
+
+    void resetPassState();
+    Error defineSessionSymbols();
+    Expected<ThreadSafeModule> takeModuleAddingSpecializations();
+    Error addBody(const std::string &name, ThreadSafeModule TSM);
+    Error redirectBody(const std::string &name, const std::string &bodyName,
+                       ResourceTrackerSP RT);
+    Error releaseBody(ResourceTrackerSP RT);
+    Error defineFunction(std::unique_ptr<FunctionAST> fnAST);
+    Error installDefinition(std::unique_ptr<FunctionAST> fnAST,
+                            ThreadSafeModule TSM, size_t hash);
+    size_t exprCacheKey(const FunctionAST &fnAST, std::set<std::string> &callees);
+    Expected<CachedExpr *> cacheAnonExpr(size_t key, std::set<std::string> callees,
+                                          std::unique_ptr<FunctionAST> ast);
+    Error invalidateFunction(const std::string &name);
+    Error evictCachedExpr();
+    bool overBudget() const;
+    Error enforceBudget();
+    /// top ::= definition | external | expression | ';'
+    Error runTopLevel(bool interactive);
+    /// command ::= ':' identifier
+    void handleCommand();
+    void runCommand(const std::string &command, const std::string &argument);
+    Error handleDefinition();
+    void handleExtern(bool interactive);
+    Error handleTopLevelExpression(bool interactive);
+    Expected<std::optional<double>> evaluateAnonExpr(ThreadSafeModule TSM);
+    std::optional<double> runExpr(double (*fn)());
+};
+
+#endif
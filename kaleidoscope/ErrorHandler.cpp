@@ -1,6 +1,12 @@
 #include "ErrorHandler.h"
 
+static thread_local std::string *CapturedErrors = nullptr;
+
 std::unique_ptr<ExprAST> LogError(const char *str) {
+  if (CapturedErrors) {
+    *CapturedErrors += std::string(CapturedErrors->empty() ? "" : "\n") + str;
+    return nullptr;
+  }
   fprintf(stderr, "Error: %s\n", str);
   return nullptr;
 }
@@ -13,4 +19,19 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *str) {
 Value *LogErrorV(const char *str) {
   LogError(str);
   return nullptr;
-}
\ No newline at end of file
+}
+
+ErrorCapture::ErrorCapture() : previous(CapturedErrors) {
+  CapturedErrors = &errors;
+}
+
+ErrorCapture::~ErrorCapture() { CapturedErrors = previous; }
+
+Error ErrorCapture::takeError() {
+  if (errors.empty())
+    return Error::success();
+
+  auto err = make_error<StringError>(errors, inconvertibleErrorCode());
+  errors.clear();
+  return err;
+}
@@ -5,4 +5,17 @@
 std::unique_ptr<ExprAST> LogError(const char *str);
 std::unique_ptr<PrototypeAST> LogErrorP(const char *str);
 Value *LogErrorV(const char *str);
-#endif
\ No newline at end of file
+
+// While alive, errors logged on this thread are collected here instead of
+// being printed to stderr.
+class ErrorCapture {
+    std::string errors;
+    std::string *previous;
+
+public:
+    ErrorCapture();
+    ~ErrorCapture();
+    bool empty() const { return errors.empty(); }
+    Error takeError();
+};
+#endif
@@ -0,0 +1,122 @@
+#include "JITMemory.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+void JITMemoryStats::add(const JITDylib &JD, uint64_t code, uint64_t data) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto &bytes = dylibBytes[&JD];
+  bytes.first += code;
+  bytes.second += data;
+  codeBytes += code;
+  dataBytes += data;
+}
+
+void JITMemoryStats::remove(const JITDylib &JD, uint64_t code, uint64_t data) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto I = dylibBytes.find(&JD);
+  if (I != dylibBytes.end()) {
+    I->second.first -= code;
+    I->second.second -= data;
+    // A JITDylib created later at the same address starts from nothing.
+    if (!I->second.first && !I->second.second)
+      dylibBytes.erase(I);
+  }
+  codeBytes -= code;
+  dataBytes -= data;
+}
+
+std::pair<uint64_t, uint64_t> JITMemoryStats::getDylibBytes(const JITDylib &JD) const {
+  std::lock_guard<std::mutex> guard(lock);
+  auto I = dylibBytes.find(&JD);
+  return I != dylibBytes.end() ? I->second : std::pair<uint64_t, uint64_t>();
+}
+
+// The manager of the object this thread is loading, until it is attributed.
+static thread_local CountingMemoryManager *Loading = nullptr;
+
+CountingMemoryManager::CountingMemoryManager(std::shared_ptr<JITMemoryStats> stats)
+    : stats(std::move(stats)) {
+  Loading = this;
+}
+
+CountingMemoryManager::~CountingMemoryManager() {
+  if (Loading == this)
+    Loading = nullptr;
+  if (JD)
+    stats->remove(*JD, code, data);
+}
+
+void CountingMemoryManager::attributeLoading(const JITDylib &JD) {
+  CountingMemoryManager *MM = Loading;
+  Loading = nullptr;
+  if (!MM || MM->JD)
+    return;
+  MM->JD = &JD;
+  MM->stats->add(JD, MM->code, MM->data);
+}
+
+uint8_t *CountingMemoryManager::allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                                    unsigned SectionID,
+                                                    StringRef SectionName) {
+  code += Size;
+  if (JD)
+    stats->add(*JD, Size, 0);
+  return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID,
+                                                   SectionName);
+}
+
+uint8_t *CountingMemoryManager::allocateDataSection(uintptr_t Size, unsigned Alignment,
+                                                    unsigned SectionID,
+                                                    StringRef SectionName,
+                                                    bool IsReadOnly) {
+  data += Size;
+  if (JD)
+    stats->add(*JD, 0, Size);
+  return SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID,
+                                                   SectionName, IsReadOnly);
+}
+
+void MemoryAccountingPlugin::modifyPassConfig(MaterializationResponsibility &MR,
+                                              jitlink::LinkGraph &G,
+                                              jitlink::PassConfiguration &Config) {
+  Config.PostAllocationPasses.push_back([this, &MR](jitlink::LinkGraph &G) {
+    uint64_t code = 0, data = 0;
+    for (auto &Sec : G.sections()) {
+      uint64_t size = jitlink::SectionRange(Sec).getSize();
+      if ((Sec.getMemProt() & MemProt::Exec) != MemProt::None)
+        code += size;
+      else
+        data += size;
+    }
+
+    return MR.withResourceKeyDo([&](ResourceKey K) {
+      std::lock_guard<std::mutex> guard(lock);
+      bytes[K].first += code;
+      bytes[K].second += data;
+      stats->add(MR.getTargetJITDylib(), code, data);
+    });
+  });
+}
+
+Error MemoryAccountingPlugin::notifyRemovingResources(JITDylib &JD, ResourceKey K) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto I = bytes.find(K);
+  if (I != bytes.end()) {
+    stats->remove(JD, I->second.first, I->second.second);
+    bytes.erase(I);
+  }
+  return Error::success();
+}
+
+void MemoryAccountingPlugin::notifyTransferringResources(JITDylib &JD, ResourceKey DstKey,
+                                                         ResourceKey SrcKey) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto I = bytes.find(SrcKey);
+  if (I == bytes.end())
+    return;
+  std::pair<uint64_t, uint64_t> moved = I->second;
+  bytes.erase(I);
+  bytes[DstKey].first += moved.first;
+  bytes[DstKey].second += moved.second;
+}
@@ -0,0 +1,80 @@
+#ifndef JIT_MEMORY_H
+#define JIT_MEMORY_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+// Bytes of JIT'd code and data currently held by one JIT, in total and per
+// JITDylib, so that sessions sharing the JIT are accounted separately.
+class JITMemoryStats {
+    mutable std::mutex lock;
+    // Code and data bytes of each JITDylib holding any.
+    llvm::DenseMap<const llvm::orc::JITDylib *, std::pair<uint64_t, uint64_t>> dylibBytes;
+
+public:
+    // Totals over all JITDylibs.
+    std::atomic<uint64_t> codeBytes{0};
+    std::atomic<uint64_t> dataBytes{0};
+
+    void add(const llvm::orc::JITDylib &JD, uint64_t code, uint64_t data);
+    void remove(const llvm::orc::JITDylib &JD, uint64_t code, uint64_t data);
+    // Code and data bytes of JD.
+    std::pair<uint64_t, uint64_t> getDylibBytes(const llvm::orc::JITDylib &JD) const;
+};
+
+// RuntimeDyld: a SectionMemoryManager (one per object) that counts its sections
+// while the object is loaded. RuntimeDyld does not tell a memory manager which
+// JITDylib its object is for, so the sections count from attributeLoading on.
+class CountingMemoryManager : public llvm::SectionMemoryManager {
+    std::shared_ptr<JITMemoryStats> stats;
+    const llvm::orc::JITDylib *JD = nullptr;
+    uint64_t code = 0, data = 0;
+
+public:
+    explicit CountingMemoryManager(std::shared_ptr<JITMemoryStats> stats);
+    ~CountingMemoryManager() override;
+
+    // Attributes the sections of the object this thread is loading to JD. The
+    // layer creates the manager and loads the object on one thread, then calls
+    // its NotifyLoaded, which knows the JITDylib.
+    static void attributeLoading(const llvm::orc::JITDylib &JD);
+
+    uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                 unsigned SectionID,
+                                 llvm::StringRef SectionName) override;
+    uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                                 unsigned SectionID, llvm::StringRef SectionName,
+                                 bool IsReadOnly) override;
+};
+
+// JITLink: counts the sections of every linked graph until its resources are
+// removed.
+class MemoryAccountingPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+    std::shared_ptr<JITMemoryStats> stats;
+    std::mutex lock;
+    // Code and data bytes per resource tracker.
+    llvm::DenseMap<llvm::orc::ResourceKey, std::pair<uint64_t, uint64_t>> bytes;
+
+public:
+    explicit MemoryAccountingPlugin(std::shared_ptr<JITMemoryStats> stats)
+        : stats(std::move(stats)) {}
+
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR,
+                          llvm::jitlink::LinkGraph &G,
+                          llvm::jitlink::PassConfiguration &Config) override;
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility &MR) override {
+        return llvm::Error::success();
+    }
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib &JD,
+                                        llvm::orc::ResourceKey K) override;
+    void notifyTransferringResources(llvm::orc::JITDylib &JD,
+                                     llvm::orc::ResourceKey DstKey,
+                                     llvm::orc::ResourceKey SrcKey) override;
+};
+
+#endif
@@ -13,24 +13,86 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "JITMemory.h"
+#include "PerfMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/DebugObjectManagerPlugin.h"
+#include "llvm/ExecutionEngine/Orc/EPCDebugObjectRegistrar.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/MapperJITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/MemoryMapper.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace llvm {
 namespace orc {
 
+struct JITOptions {
+  // Link with JITLink into preallocated slabs shared by all objects, instead
+  // of RuntimeDyld with separate page mappings for every object.
+  bool UseJITLink = false;
+  // Address space reserved at a time for the slabs when UseJITLink is set.
+  size_t SlabSize = 64 * 1024 * 1024;
+  // Write /tmp/perf-<pid>.map, plus a jitdump file when LLVM was built with
+  // perf support and RuntimeDyld is used, so perf can name JIT'd functions.
+  bool PerfMap = false;
+  // Register emitted objects with GDB's JIT interface.
+  bool GDBRegistration = false;
+  // Symbols of the host a lookup resolves to, before searching the process,
+  // when nothing in the JIT defines the name itself.
+  std::vector<std::pair<std::string, ExecutorAddr>> HostSymbols;
+  // Where a call through a redirect stub goes if its body fails to compile
+  // or link. It is entered with the arguments of the call and must not
+  // return. Null crashes the caller.
+  ExecutorAddr LazyCallFailed;
+};
+
+// Defines the symbols of a fixed map in a JITDylib, but only those that a
+// lookup fails to find otherwise: code added to the JITDylib can still define
+// the same names.
+class FallbackSymbolsGenerator : public DefinitionGenerator {
+  SymbolMap Symbols;
+
+public:
+  FallbackSymbolsGenerator(SymbolMap Symbols) : Symbols(std::move(Symbols)) {}
+
+  Error tryToGenerate(LookupState &LS, LookupKind K, JITDylib &JD,
+                      JITDylibLookupFlags JDLookupFlags,
+                      const SymbolLookupSet &LookupSet) override {
+    SymbolMap Found;
+    for (auto &KV : LookupSet) {
+      auto I = Symbols.find(KV.first);
+      if (I != Symbols.end())
+        Found[KV.first] = I->second;
+    }
+    if (Found.empty())
+      return Error::success();
+    return JD.define(absoluteSymbols(std::move(Found)));
+  }
+};
+
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
@@ -38,27 +100,59 @@ private:
   DataLayout DL;
   MangleAndInterner Mangle;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  // Shared with the memory managers and plugins that update it.
+  std::shared_ptr<JITMemoryStats> MemStats;
+  std::unique_ptr<ObjectLayer> ObjLayer;
   IRCompileLayer CompileLayer;
 
   JITDylib &MainJD;
+  std::atomic<unsigned> NextClientId{0};
+  // Names of JITOptions::HostSymbols.
+  DenseSet<SymbolStringPtr> HostSymbolNames;
+
+  // Redirectable functions: each public name is a stub jumping to its body.
+  std::unique_ptr<LazyCallThroughManager> LCTM;
+  std::function<std::unique_ptr<IndirectStubsManager>()> ISMBuilder;
+  struct StubSet {
+    std::unique_ptr<IndirectStubsManager> ISM;
+    // Tracker of each stub; one that nothing has linked against yet is
+    // simply replaced on redirect.
+    std::map<std::string, ResourceTrackerSP> Trackers;
+  };
+  // Stubs of each JITDylib. The mutex guards the map; a set is only used by
+  // the one session owning its JITDylib.
+  std::mutex StubsMutex;
+  std::map<JITDylib *, StubSet> Stubs;
+
+  StubSet &getStubs(JITDylib &JD) {
+    std::lock_guard<std::mutex> Lock(StubsMutex);
+    StubSet &Set = Stubs[&JD];
+    if (!Set.ISM)
+      Set.ISM = ISMBuilder();
+    return Set;
+  }
 
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  std::unique_ptr<LazyCallThroughManager> LCTM,
+                  std::shared_ptr<JITMemoryStats> MemStats,
+                  std::unique_ptr<ObjectLayer> ObjLayer,
+                  SymbolMap HostSymbols = SymbolMap())
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+        MemStats(std::move(MemStats)), ObjLayer(std::move(ObjLayer)),
+        CompileLayer(*this->ES, *this->ObjLayer,
+                     std::make_unique<ConcurrentIRCompiler>(JTMB)),
+        MainJD(this->ES->createBareJITDylib("<main>")), LCTM(std::move(LCTM)),
+        ISMBuilder(createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())) {
+    for (auto &KV : HostSymbols)
+      HostSymbolNames.insert(KV.first);
+    if (!HostSymbols.empty())
+      MainJD.addGenerator(
+          std::make_unique<FallbackSymbolsGenerator>(std::move(HostSymbols)));
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
-      ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-      ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
-    }
   }
 
   ~KaleidoscopeJIT() {
@@ -66,37 +160,168 @@ public:
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(const JITOptions &Opts = JITOptions()) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    // Code is generated for the host CPU and its features, which the pass
+    // pipeline (see CompilerSession) tunes it for too.
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    auto LCTM = createLocalLazyCallThroughManager(JTMB->getTargetTriple(), *ES,
+                                                  Opts.LazyCallFailed);
+    if (!LCTM)
+      return LCTM.takeError();
+
+    auto MemStats = std::make_shared<JITMemoryStats>();
+    std::unique_ptr<ObjectLayer> ObjLayer;
+    if (Opts.UseJITLink) {
+      auto MemMgr = MapperJITLinkMemoryManager::CreateWithMapper<
+          InProcessMemoryMapper>(Opts.SlabSize);
+      if (!MemMgr)
+        return MemMgr.takeError();
+      auto LinkLayer =
+          std::make_unique<ObjectLinkingLayer>(*ES, std::move(*MemMgr));
+      LinkLayer->addPlugin(std::make_unique<MemoryAccountingPlugin>(MemStats));
+      if (Opts.PerfMap)
+        LinkLayer->addPlugin(std::make_unique<PerfMapPlugin>());
+      if (Opts.GDBRegistration) {
+        auto Registrar = createJITLoaderGDBRegistrar(*ES);
+        if (!Registrar)
+          return Registrar.takeError();
+        LinkLayer->addPlugin(std::make_unique<DebugObjectManagerPlugin>(
+            *ES, std::move(*Registrar)));
+      }
+      ObjLayer = std::move(LinkLayer);
+    } else {
+      auto RTDyldLayer = std::make_unique<RTDyldObjectLinkingLayer>(
+          *ES, [MemStats]() {
+            return std::make_unique<CountingMemoryManager>(MemStats);
+          });
+      RTDyldLayer->setNotifyLoaded(
+          [](MaterializationResponsibility &R, const object::ObjectFile &,
+             const RuntimeDyld::LoadedObjectInfo &) {
+            CountingMemoryManager::attributeLoading(R.getTargetJITDylib());
+          });
+      if (JTMB->getTargetTriple().isOSBinFormatCOFF()) {
+        RTDyldLayer->setOverrideObjectFlagsWithResponsibilityFlags(true);
+        RTDyldLayer->setAutoClaimResponsibilityForObjectSymbols(true);
+      }
+      // The listeners are process-wide singletons, so they outlive the layer.
+      if (Opts.PerfMap) {
+        RTDyldLayer->registerJITEventListener(PerfMapListener::get());
+        if (auto *JitDump = JITEventListener::createPerfJITEventListener())
+          RTDyldLayer->registerJITEventListener(*JitDump);
+      }
+      if (Opts.GDBRegistration)
+        RTDyldLayer->registerJITEventListener(
+            *JITEventListener::createGDBRegistrationListener());
+      ObjLayer = std::move(RTDyldLayer);
+    }
+
+    MangleAndInterner HostMangle(*ES, *DL);
+    SymbolMap HostSymbols;
+    for (auto &Sym : Opts.HostSymbols)
+      HostSymbols[HostMangle(Sym.first)] = ExecutorSymbolDef(
+          Sym.second, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*JTMB),
+                                             std::move(*DL), std::move(*LCTM),
+                                             std::move(MemStats),
+                                             std::move(ObjLayer),
+                                             std::move(HostSymbols));
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  // Creates a JITDylib that resolves what it does not define itself in the
+  // main one, so clients can share code compiled there.
+  JITDylib &createClientJITDylib() {
+    JITDylib &JD = ES->createBareJITDylib("<client " +
+                                          std::to_string(NextClientId++) + ">");
+    JD.setLinkOrder({{&MainJD, JITDylibLookupFlags::MatchExportedSymbolsOnly}});
+    return JD;
+  }
+
+  // Frees all code of a JITDylib from createClientJITDylib, and its stubs.
+  Error removeClientJITDylib(JITDylib &JD) {
+    Error Err = ES->removeJITDylib(JD);
+    std::lock_guard<std::mutex> Lock(StubsMutex);
+    Stubs.erase(&JD);
+    return Err;
+  }
+
+  const JITMemoryStats &getMemoryStats() const { return *MemStats; }
+  size_t getNumStubs(JITDylib &JD) { return getStubs(JD).Trackers.size(); }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
-  Expected<ExecutorSymbolDef> lookup(StringRef Name) {
-    return ES->lookup({&MainJD}, Mangle(Name.str()));
+  // Adds an already compiled object file.
+  Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj, ResourceTrackerSP RT) {
+    return ObjLayer->add(std::move(RT), std::move(Obj));
   }
+
+  Error defineAbsolute(JITDylib &JD, StringRef Name, ExecutorAddr Addr) {
+    return JD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          {Addr, JITSymbolFlags::Exported | JITSymbolFlags::Callable}}}));
+  }
+
+  Error defineAbsolute(StringRef Name, ExecutorAddr Addr) {
+    return defineAbsolute(MainJD, Name, Addr);
+  }
+
+  // Makes calls to Name in JD run Body (also in JD) instead, including calls
+  // in code that is already linked. Until something links against Name, Body is not
+  // compiled; afterwards it is compiled here and the stub is re-pointed.
+  Error redirect(JITDylib &JD, StringRef Name, StringRef Body) {
+    StubSet &Set = getStubs(JD);
+    auto MangledName = Mangle(Name.str());
+    if (Set.ISM->findStub(*MangledName, false).getAddress()) {
+      auto BodySym = lookup(JD, Body);
+      if (!BodySym)
+        return BodySym.takeError();
+      return Set.ISM->updatePointer(*MangledName, BodySym->getAddress());
+    }
+
+    ResourceTrackerSP &RT = Set.Trackers[Name.str()];
+    if (RT)
+      if (auto Err = RT->remove())
+        return Err;
+    RT = JD.createResourceTracker();
+
+    // Code that called a host function of this name before keeps calling it.
+    if (&JD == &MainJD && HostSymbolNames.count(MangledName))
+      if (auto Err = JD.remove({MangledName}))
+        consumeError(std::move(Err));
+
+    SymbolAliasMap Alias;
+    Alias[MangledName] = SymbolAliasMapEntry(
+        Mangle(Body.str()), JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    return JD.define(lazyReexports(*LCTM, *Set.ISM, JD, std::move(Alias)), RT);
+  }
+
+  Expected<ExecutorSymbolDef> lookup(JITDylib &JD, StringRef Name) {
+    return ES->lookup(makeJITDylibSearchOrder(&JD), Mangle(Name.str()));
+  }
+
+  Expected<ExecutorSymbolDef> lookup(StringRef Name) { return lookup(MainJD, Name); }
 };
 
 } // end namespace orc
@@ -2,22 +2,94 @@
 
 #include <iostream>
 
-// Global variables
-std::string IdentifierStr;
-double NumVal;
-int CurTok;
+int Lexer::readChar() {
+  int c;
+  if (!Pushback.empty()) {
+    c = Pushback.back();
+    Pushback.pop_back();
+  } else if (!InputBuffer)
+    c = getchar();
+  else if (InputPos >= InputBuffer->size())
+    c = EOF;
+  else
+    c = (unsigned char)(*InputBuffer)[InputPos++];
 
-static int LastChar = ' ';
+  if (LastChar == '\n') {
+    ++LexLoc.line;
+    LexLoc.col = 0;
+  }
+  if (c != EOF)
+    ++LexLoc.col;
+  return c;
+}
+
+void Lexer::setInputBuffer(const std::string *buffer, unsigned firstLine) {
+  InputBuffer = buffer;
+  InputPos = 0;
+  LastChar = ' ';
+  LexLoc = {firstLine, 0};
+  Pushback.clear();
+  PendingDef = false;
+}
 
-int gettok() {
+// Whether the 'memo' just read is followed by 'def', the only place where it
+// is a keyword; elsewhere it is an identifier like any other. If so, the
+// 'def' is read too and is the next token; if not, everything read after
+// 'memo' is given back.
+bool Lexer::lexMemoDef() {
+  int savedChar = LastChar;
+  SourceLocation savedLoc = LexLoc;
+  size_t savedPos = InputPos;
+  std::vector<int> read;
+  auto next = [&] {
+    LastChar = readChar();
+    read.push_back(LastChar);
+  };
 
   while (isspace(LastChar))
-    LastChar = getchar();
+    next();
+  size_t defOffset = InputPos ? InputPos - 1 : 0;
+  SourceLocation defLoc = LexLoc;
+  std::string word;
+  while (isalnum(LastChar) && word.size() < 4) {
+    word += LastChar;
+    next();
+  }
+  if (word == "def" && !isalnum(LastChar)) {
+    PendingDef = true;
+    PendingDefOffset = defOffset;
+    PendingDefLoc = defLoc;
+    return true;
+  }
+
+  if (InputBuffer)
+    InputPos = savedPos;
+  else
+    Pushback.insert(Pushback.end(), read.rbegin(), read.rend());
+  LastChar = savedChar;
+  LexLoc = savedLoc;
+  return false;
+}
+
+int Lexer::gettok() {
+  if (PendingDef) {
+    PendingDef = false;
+    TokOffset = PendingDefOffset;
+    TokLoc = PendingDefLoc;
+    return DEF;
+  }
+
+  while (isspace(LastChar))
+    LastChar = readChar();
+
+  // LastChar was the last character read, so the token starts one before InputPos.
+  TokOffset = InputPos ? InputPos - 1 : 0;
+  TokLoc = LexLoc;
 
   if (isalpha(LastChar)) {
     IdentifierStr = LastChar;
 
-    while (isalnum(LastChar = getchar()))
+    while (isalnum(LastChar = readChar()))
       IdentifierStr += LastChar;
     if (IdentifierStr == "def")
       return DEF;
@@ -43,6 +115,8 @@ int gettok() {
       return BINARY;
     if(IdentifierStr == "var")
       return VAR;
+    if(IdentifierStr == "memo" && lexMemoDef())
+      return MEMO;
       
     return IDENTIFIER;
   }
@@ -52,16 +126,17 @@ int gettok() {
 
     do {
       numStr += LastChar;
-      LastChar = getchar();
+      LastChar = readChar();
     } while (isdigit(LastChar) || LastChar == '.');
 
     NumVal = strtod(numStr.c_str(), 0); // add error checking
+    NumIsInteger = numStr.find('.') == std::string::npos && NumVal <= 9007199254740992.0;
     return NUMBER;
   }
 
   if (LastChar == '#') {
     do
-      LastChar = getchar();
+      LastChar = readChar();
     while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if (LastChar != EOF)
@@ -71,11 +146,40 @@ int gettok() {
     return TK_EOF;
 
   int thisChar = LastChar;
-  LastChar = getchar();
+  LastChar = readChar();
   return thisChar;
 }
 
-int getNextToken() {
+int Lexer::getNextToken() {
   CurTok = gettok();
   return CurTok;
+}
+
+std::string Lexer::readLine() {
+  while (LastChar == ' ' || LastChar == '\t')
+    LastChar = readChar();
+
+  std::string line;
+  while (LastChar != EOF && LastChar != '\n' && LastChar != '\r') {
+    line += LastChar;
+    LastChar = readChar();
+  }
+  line.erase(line.find_last_not_of(" \t") + 1);
+  return line;
+}
+
+std::vector<size_t> splitTopLevelItems(const std::string &src) {
+  std::vector<size_t> starts{0};
+
+  // 'def' (unless after 'memo'), 'memo def' and 'extern' can only begin a
+  // top-level item, so every one of them is a safe place to cut the source.
+  Lexer lex;
+  lex.setInputBuffer(&src);
+  int prev = 0;
+  for (int tok = lex.gettok(); tok != TK_EOF; prev = tok, tok = lex.gettok())
+    if ((tok == MEMO || (tok == DEF && prev != MEMO) || tok == EXTERN) &&
+        lex.TokOffset != 0)
+      starts.push_back(lex.TokOffset);
+
+  return starts;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define LEXER_H
 
 #include<string>
+#include<vector>
 
 enum Token{
     TK_EOF = -1,
@@ -23,13 +24,54 @@ enum Token{
 
     BINARY = -11,
     UNARY = -12,
-    VAR = -13
+    VAR = -13,
+
+    MEMO = -14
+};
+
+// 1-based line and column in the source; line 0 means unknown.
+struct SourceLocation {
+    unsigned line = 0;
+    unsigned col = 0;
 };
 
-extern std::string IdentifierStr;
-extern double NumVal;
-extern int CurTok;
+class Lexer {
+    int LastChar = ' ';
+    const std::string *InputBuffer = nullptr;
+    size_t InputPos = 0;
+    // Position of LastChar.
+    SourceLocation LexLoc{1, 0};
+    // Characters of stdin read ahead and given back, the next one last.
+    std::vector<int> Pushback;
+    // Set once MEMO is returned: the DEF after it, already read.
+    bool PendingDef = false;
+    size_t PendingDefOffset = 0;
+    SourceLocation PendingDefLoc;
+
+    int readChar();
+    bool lexMemoDef();
+
+public:
+    std::string IdentifierStr;
+    double NumVal = 0;
+    // Whether NumVal was written without a '.' and fits an int exactly.
+    bool NumIsInteger = false;
+    int CurTok = 0;
+    size_t TokOffset = 0;
+    SourceLocation TokLoc;
+
+    // Lex from an in-memory buffer instead of stdin; nullptr switches back to stdin.
+    // firstLine is the line the buffer starts at in the original source.
+    void setInputBuffer(const std::string *buffer, unsigned firstLine = 1);
+
+    int gettok();
+    int getNextToken();
+    // Rest of the current line, without surrounding blanks. The next token
+    // is read from the line after.
+    std::string readLine();
+};
 
-int gettok();
-int getNextToken();
-#endif
\ No newline at end of file
+// Offsets of every top-level item start ('def'/'memo def'/'extern') in src,
+// always starting with 0.
+std::vector<size_t> splitTopLevelItems(const std::string &src);
+#endif
@@ -0,0 +1,907 @@
+#include "MLIRGen.h"
+#include "CompilerSession.h"
+#include "Runtime.h"
+
+const char MLIRLowering::DefaultPipeline[] =
+    "func.func(affine-loop-normalize,affine-loop-invariant-code-motion,"
+    "affine-scalrep,affine-loop-fusion,affine-tile-bands,"
+    "affine-full-unroll{max-trip-count=4},canonicalize,cse),"
+    "lower-affine,convert-scf-to-cf,convert-arith-to-llvm,convert-cf-to-llvm,"
+    "finalize-memref-to-llvm,convert-func-to-llvm,reconcile-unrealized-casts";
+
+#ifdef TOY_HAVE_MLIR
+
+#include "lib/Transform/Affine/Passes.h"
+#include "mlir/Conversion/Passes.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/Passes.h"
+#include "mlir/Dialect/Arith/IR/Arith.h"
+#include "mlir/Dialect/ControlFlow/IR/ControlFlow.h"
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Dialect/LLVMIR/LLVMDialect.h"
+#include "mlir/Dialect/MemRef/IR/MemRef.h"
+#include "mlir/Dialect/SCF/IR/SCF.h"
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/BuiltinOps.h"
+#include "mlir/IR/Diagnostics.h"
+#include "mlir/IR/MLIRContext.h"
+#include "mlir/IR/Verifier.h"
+#include "mlir/Pass/PassManager.h"
+#include "mlir/Pass/PassRegistry.h"
+#include "mlir/Target/LLVMIR/Dialect/Builtin/BuiltinToLLVMIRTranslation.h"
+#include "mlir/Target/LLVMIR/Dialect/LLVMIR/LLVMToLLVMIRTranslation.h"
+#include "mlir/Target/LLVMIR/Export.h"
+#include "mlir/Transforms/Passes.h"
+
+#include <mutex>
+
+namespace {
+// Emits the MLIR of one function definition.
+class MLIRGen {
+public:
+  MLIRGen(CompilerSession &S, mlir::MLIRContext &context) : S(S), builder(&context) {}
+
+  // A module holding fn, or null if fn is not covered. A function taking
+  // arrays is named with ".mlir" appended, since it takes them as memrefs.
+  mlir::OwningOpRef<mlir::ModuleOp> lower(const FunctionAST &fn);
+
+private:
+  // A variable is a rank-0 memref if it is ever assigned, else its value.
+  // Induction variables of affine loops are bound to the index itself.
+  struct Binding {
+    mlir::Value value;
+    ToyType type;
+    bool inMemory;
+  };
+
+  // Operands of the affine maps of one op.
+  struct AffineOperands {
+    SmallVector<mlir::Value, 4> dims, symbols;
+
+    SmallVector<mlir::Value, 8> all() const {
+      SmallVector<mlir::Value, 8> operands(dims.begin(), dims.end());
+      operands.append(symbols.begin(), symbols.end());
+      return operands;
+    }
+    mlir::AffineMap map(mlir::AffineExpr e) const {
+      return mlir::AffineMap::get(dims.size(), symbols.size(), e);
+    }
+  };
+
+  // A toy loop that can be an affine.for: start to bound by step.
+  struct AffineBounds {
+    AffineOperands operands;
+    mlir::AffineExpr lower, bound;
+    int64_t step;
+  };
+
+  CompilerSession &S;
+  mlir::OpBuilder builder;
+  mlir::ModuleOp module;
+  mlir::Block *entry = nullptr;
+  std::map<std::string, Binding> scope;
+  // Every name the body assigns to, in any scope.
+  std::set<std::string> assigned;
+
+  mlir::Location loc(SourceLocation l);
+  mlir::Type getType(ToyType type);
+  mlir::FunctionType getFunctionType(const PrototypeAST &proto);
+  mlir::func::FuncOp declare(const PrototypeAST &proto);
+  TypeEnv typeEnv() const;
+  std::optional<Binding> bind(const std::string &name, Binding b);
+  void unbind(const std::string &name, std::optional<Binding> old);
+
+  mlir::Value constant(mlir::Location l, mlir::Type type, double v);
+  mlir::Value convert(mlir::Value v, mlir::Type to);
+  mlir::Value toCondition(mlir::Value v);
+  mlir::Value toIndex(mlir::Value v);
+  mlir::Value createEntryAlloca(mlir::Type type);
+  mlir::Value read(const Binding &b, mlir::Location l);
+  mlir::AffineExpr getAffineExpr(ExprAST &e, AffineOperands &ops);
+
+  mlir::Value gen(ExprAST &e);
+  void genBoundsCheck(mlir::Location l, mlir::Value memref, mlir::Value index);
+  mlir::Value genIndex(IndexExprAST &e, mlir::Value store);
+  mlir::Value genAssign(ExprAST &dest, mlir::Value val);
+  mlir::Value genBinary(BinaryExprAST &e);
+  mlir::Value genCall(const std::string &callee, SmallVector<mlir::Value, 4> args,
+                      mlir::Location l);
+  mlir::Value genIf(IfExprAST &e);
+  mlir::Value genFor(ForExprAST &e);
+  bool getAffineBounds(ForExprAST &e, AffineBounds &b);
+  bool genAffineFor(ForExprAST &e, const AffineBounds &b);
+  bool genWhile(ForExprAST &e, mlir::Value start, bool isInt);
+  bool genLoopBody(ForExprAST &e, mlir::Value var);
+  mlir::Value genVar(VarExprAST &e);
+};
+} // namespace
+
+static std::optional<ToyType> getToyType(mlir::Type type) {
+  if (type.isF64())
+    return ToyType::Double;
+  if (type.isInteger(64))
+    return ToyType::Int;
+  if (type.isInteger(1))
+    return ToyType::Bool;
+  if (isa<mlir::MemRefType>(type))
+    return ToyType::Array;
+  return std::nullopt;
+}
+
+static void collectAssigned(ExprAST &e, std::set<std::string> &names) {
+  if (auto *bin = dyn_cast<BinaryExprAST>(&e))
+    if (auto *var = dyn_cast<VariableExprAST>(&bin->getLHS()))
+      if (bin->getOp() == '=')
+        names.insert(var->getName());
+  e.forEachChild([&](std::unique_ptr<ExprAST> &child) { collectAssigned(*child, names); });
+}
+
+static bool mentions(ExprAST &e, const std::string &name) {
+  if (auto *var = dyn_cast<VariableExprAST>(&e))
+    return var->getName() == name;
+  bool found = false;
+  e.forEachChild([&](std::unique_ptr<ExprAST> &child) {
+    found = found || mentions(*child, name);
+  });
+  return found;
+}
+
+mlir::Location MLIRGen::loc(SourceLocation l) {
+  return mlir::FileLineColLoc::get(builder.getStringAttr(S.sourceName), l.line, l.col);
+}
+
+mlir::Type MLIRGen::getType(ToyType type) {
+  switch (type) {
+  case ToyType::Double:
+    return builder.getF64Type();
+  case ToyType::Int:
+    return builder.getI64Type();
+  case ToyType::Bool:
+    return builder.getI1Type();
+  case ToyType::Array:
+    return mlir::MemRefType::get({mlir::ShapedType::kDynamic}, builder.getF64Type());
+  }
+  llvm_unreachable("unknown toy type");
+}
+
+mlir::FunctionType MLIRGen::getFunctionType(const PrototypeAST &proto) {
+  SmallVector<mlir::Type, 4> argTypes;
+  for (ToyType type : proto.getArgTypes())
+    argTypes.push_back(getType(type));
+  return builder.getFunctionType(argTypes, getType(proto.getReturnType()));
+}
+
+// The function name in this module, declared on first use.
+mlir::func::FuncOp MLIRGen::declare(const PrototypeAST &proto) {
+  if (auto fn = module.lookupSymbol<mlir::func::FuncOp>(proto.getName()))
+    return fn;
+
+  mlir::OpBuilder::InsertionGuard guard(builder);
+  builder.setInsertionPointToStart(module.getBody());
+  auto fn = builder.create<mlir::func::FuncOp>(loc(proto.getLocation()), proto.getName(),
+                                               getFunctionType(proto));
+  fn.setPrivate();
+  return fn;
+}
+
+// Types of the variables in scope, for ExprAST::inferType.
+TypeEnv MLIRGen::typeEnv() const {
+  TypeEnv env;
+  for (auto &entry : scope)
+    env[entry.first] = entry.second.type;
+  return env;
+}
+
+std::optional<MLIRGen::Binding> MLIRGen::bind(const std::string &name, Binding b) {
+  std::optional<Binding> old;
+  auto BI = scope.find(name);
+  if (BI != scope.end())
+    old = BI->second;
+  scope[name] = b;
+  return old;
+}
+
+void MLIRGen::unbind(const std::string &name, std::optional<Binding> old) {
+  if (old)
+    scope[name] = *old;
+  else
+    scope.erase(name);
+}
+
+mlir::Value MLIRGen::constant(mlir::Location l, mlir::Type type, double v) {
+  if (type.isF64())
+    return builder.create<mlir::arith::ConstantOp>(l, builder.getF64FloatAttr(v));
+  return builder.create<mlir::arith::ConstantOp>(l, builder.getIntegerAttr(type, (int64_t)v));
+}
+
+// Converts a number between double, int and bool as AST codegen does; null
+// for anything else.
+mlir::Value MLIRGen::convert(mlir::Value v, mlir::Type to) {
+  mlir::Type from = v.getType();
+  if (from == to)
+    return v;
+  auto fromType = getToyType(from), toType = getToyType(to);
+  if (!fromType || !toType || *fromType == ToyType::Array || *toType == ToyType::Array)
+    return nullptr;
+
+  mlir::Location l = v.getLoc();
+  if (to.isF64()) {
+    if (from.isInteger(1))
+      return builder.create<mlir::arith::UIToFPOp>(l, to, v);
+    return builder.create<mlir::arith::SIToFPOp>(l, to, v);
+  }
+  if (to.isInteger(1)) {
+    if (from.isF64())
+      return builder.create<mlir::arith::CmpFOp>(l, mlir::arith::CmpFPredicate::ONE, v,
+                                                 constant(l, from, 0.0));
+    return builder.create<mlir::arith::CmpIOp>(l, mlir::arith::CmpIPredicate::ne, v,
+                                               constant(l, from, 0.0));
+  }
+  if (from.isF64())
+    return builder.create<mlir::arith::FPToSIOp>(l, to, v);
+  return builder.create<mlir::arith::ExtUIOp>(l, to, v);
+}
+
+// Branch condition: comparisons are used directly, numbers compare against 0.
+mlir::Value MLIRGen::toCondition(mlir::Value v) {
+  return convert(v, builder.getI1Type());
+}
+
+// v as an index, cast right where v is defined so that the cast is a valid
+// affine symbol wherever v is one.
+mlir::Value MLIRGen::toIndex(mlir::Value v) {
+  mlir::OpBuilder::InsertionGuard guard(builder);
+  builder.setInsertionPointAfterValue(v);
+  return builder.createOrFold<mlir::arith::IndexCastOp>(v.getLoc(), builder.getIndexType(), v);
+}
+
+mlir::Value MLIRGen::createEntryAlloca(mlir::Type type) {
+  mlir::OpBuilder::InsertionGuard guard(builder);
+  builder.setInsertionPointToStart(entry);
+  return builder.create<mlir::memref::AllocaOp>(builder.getUnknownLoc(),
+                                                mlir::MemRefType::get({}, type));
+}
+
+mlir::Value MLIRGen::read(const Binding &b, mlir::Location l) {
+  if (b.inMemory)
+    return builder.create<mlir::affine::AffineLoadOp>(l, b.value, mlir::ValueRange());
+  if (b.value.getType().isIndex())
+    return builder.create<mlir::arith::IndexCastOp>(l, builder.getI64Type(), b.value);
+  return b.value;
+}
+
+// e as an affine expression over ops, or null if it is not one: integer
+// literals, induction variables of affine loops and unassigned integer
+// variables that are valid symbols, added, subtracted and multiplied by
+// constants.
+mlir::AffineExpr MLIRGen::getAffineExpr(ExprAST &e, AffineOperands &ops) {
+  if (auto *num = dyn_cast<NumberExprAST>(&e)) {
+    if (!num->isIntegerLiteral())
+      return mlir::AffineExpr();
+    return builder.getAffineConstantExpr((int64_t)num->getValue());
+  }
+
+  if (auto *var = dyn_cast<VariableExprAST>(&e)) {
+    auto BI = scope.find(var->getName());
+    if (BI == scope.end() || BI->second.inMemory || BI->second.type != ToyType::Int)
+      return mlir::AffineExpr();
+
+    mlir::Value v = BI->second.value;
+    bool isDim = mlir::affine::isAffineForInductionVar(v);
+    if (!isDim) {
+      if (!v.getType().isIndex())
+        v = toIndex(v);
+      if (!mlir::affine::isValidSymbol(v))
+        return mlir::AffineExpr();
+    }
+
+    auto &list = isDim ? ops.dims : ops.symbols;
+    unsigned pos = find(list, v) - list.begin();
+    if (pos == list.size())
+      list.push_back(v);
+    return isDim ? builder.getAffineDimExpr(pos) : builder.getAffineSymbolExpr(pos);
+  }
+
+  if (auto *bin = dyn_cast<BinaryExprAST>(&e)) {
+    char op = bin->getOp();
+    if (op != '+' && op != '-' && op != '*')
+      return mlir::AffineExpr();
+    mlir::AffineExpr lhs = getAffineExpr(bin->getLHS(), ops);
+    mlir::AffineExpr rhs = lhs ? getAffineExpr(bin->getRHS(), ops) : mlir::AffineExpr();
+    if (!lhs || !rhs)
+      return mlir::AffineExpr();
+    if (op == '+')
+      return lhs + rhs;
+    if (op == '-')
+      return lhs - rhs;
+    if (lhs.getKind() != mlir::AffineExprKind::Constant &&
+        rhs.getKind() != mlir::AffineExprKind::Constant)
+      return mlir::AffineExpr();
+    return lhs * rhs;
+  }
+
+  return mlir::AffineExpr();
+}
+
+mlir::Value MLIRGen::gen(ExprAST &e) {
+  mlir::Location l = loc(e.getLocation());
+  switch (e.getKind()) {
+  case ExprAST::Number: {
+    auto &num = cast<NumberExprAST>(e);
+    return constant(l, getType(num.getType()), num.getValue());
+  }
+  case ExprAST::Variable: {
+    auto BI = scope.find(cast<VariableExprAST>(e).getName());
+    if (BI == scope.end())
+      return nullptr;
+    return read(BI->second, l);
+  }
+  case ExprAST::Index:
+    return genIndex(cast<IndexExprAST>(e), nullptr);
+  case ExprAST::Binary:
+    return genBinary(cast<BinaryExprAST>(e));
+  case ExprAST::Call: {
+    auto &call = cast<CallExprAST>(e);
+    SmallVector<mlir::Value, 4> args;
+    for (auto &arg : call.getArgs()) {
+      args.push_back(gen(*arg));
+      if (!args.back())
+        return nullptr;
+    }
+    return genCall(call.getCallee(), std::move(args), l);
+  }
+  case ExprAST::Unary: {
+    auto &unary = cast<UnaryExprAST>(e);
+    mlir::Value operand = gen(unary.getOperand());
+    if (!operand)
+      return nullptr;
+    return genCall(std::string("unary") + unary.getOpcode(), {operand}, l);
+  }
+  case ExprAST::If:
+    return genIf(cast<IfExprAST>(e));
+  case ExprAST::For:
+    return genFor(cast<ForExprAST>(e));
+  case ExprAST::Var:
+    return genVar(cast<VarExprAST>(e));
+  }
+  return nullptr;
+}
+
+// Reports an index outside memref at run time, as AST codegen does (see
+// toy_index_out_of_bounds).
+void MLIRGen::genBoundsCheck(mlir::Location l, mlir::Value memref, mlir::Value index) {
+  mlir::Value length = builder.create<mlir::memref::DimOp>(l, memref, 0);
+  // A negative index is a huge unsigned one.
+  mlir::Value outside = builder.create<mlir::arith::CmpIOp>(
+      l, mlir::arith::CmpIPredicate::uge, index, length);
+  auto ifOp = builder.create<mlir::scf::IfOp>(l, outside, /*withElseRegion=*/false);
+
+  mlir::OpBuilder::InsertionGuard guard(builder);
+  auto fail = module.lookupSymbol<mlir::func::FuncOp>("toy_index_out_of_bounds");
+  if (!fail) {
+    builder.setInsertionPointToStart(module.getBody());
+    fail = builder.create<mlir::func::FuncOp>(
+        l, "toy_index_out_of_bounds",
+        builder.getFunctionType({builder.getF64Type(), builder.getI64Type()}, {}));
+    fail.setPrivate();
+  }
+  builder.setInsertionPointToStart(ifOp.thenBlock());
+  mlir::Value i64Index =
+      builder.create<mlir::arith::IndexCastOp>(l, builder.getI64Type(), index);
+  mlir::Value args[] = {
+      builder.create<mlir::arith::SIToFPOp>(l, builder.getF64Type(), i64Index),
+      builder.create<mlir::arith::IndexCastOp>(l, builder.getI64Type(), length)};
+  builder.create<mlir::func::CallOp>(l, fail, args);
+}
+
+// Loads an element of an array argument, or stores store into it, after a
+// bounds check. Affine subscripts give affine.load and affine.store.
+mlir::Value MLIRGen::genIndex(IndexExprAST &e, mlir::Value store) {
+  mlir::Location l = loc(e.getLocation());
+  auto *arrayVar = dyn_cast<VariableExprAST>(&e.getArray());
+  if (!arrayVar)
+    return nullptr;
+  auto BI = scope.find(arrayVar->getName());
+  if (BI == scope.end() || BI->second.type != ToyType::Array)
+    return nullptr;
+  mlir::Value memref = BI->second.value;
+
+  AffineOperands ops;
+  if (mlir::AffineExpr subscript = getAffineExpr(e.getIndex(), ops)) {
+    genBoundsCheck(l, memref,
+                   builder.create<mlir::affine::AffineApplyOp>(l, ops.map(subscript),
+                                                               ops.all()));
+    if (store) {
+      builder.create<mlir::affine::AffineStoreOp>(l, store, memref, ops.map(subscript),
+                                                  ops.all());
+      return store;
+    }
+    return builder.create<mlir::affine::AffineLoadOp>(l, memref, ops.map(subscript), ops.all());
+  }
+
+  // Double subscripts take the AST path, which checks them as doubles.
+  mlir::Value index = gen(e.getIndex());
+  if (!index || index.getType().isF64() ||
+      !(index = convert(index, builder.getI64Type())))
+    return nullptr;
+  index = builder.create<mlir::arith::IndexCastOp>(l, builder.getIndexType(), index);
+  genBoundsCheck(l, memref, index);
+  if (store) {
+    builder.create<mlir::memref::StoreOp>(l, store, memref, index);
+    return store;
+  }
+  return builder.create<mlir::memref::LoadOp>(l, memref, index);
+}
+
+mlir::Value MLIRGen::genAssign(ExprAST &dest, mlir::Value val) {
+  if (auto *index = dyn_cast<IndexExprAST>(&dest)) {
+    mlir::Value elt = convert(val, builder.getF64Type());
+    return elt && genIndex(*index, elt) ? val : nullptr;
+  }
+
+  auto *var = dyn_cast<VariableExprAST>(&dest);
+  if (!var)
+    return nullptr;
+  auto BI = scope.find(var->getName());
+  if (BI == scope.end() || !BI->second.inMemory)
+    return nullptr;
+
+  mlir::Value stored = convert(val, getType(BI->second.type));
+  if (!stored)
+    return nullptr;
+  builder.create<mlir::affine::AffineStoreOp>(loc(dest.getLocation()), stored,
+                                              BI->second.value, mlir::ValueRange());
+  return val;
+}
+
+mlir::Value MLIRGen::genBinary(BinaryExprAST &e) {
+  mlir::Location l = loc(e.getLocation());
+  if (e.getOp() == '=') {
+    mlir::Value val = gen(e.getRHS());
+    return val ? genAssign(e.getLHS(), val) : nullptr;
+  }
+
+  mlir::Value lhs = gen(e.getLHS());
+  mlir::Value rhs = lhs ? gen(e.getRHS()) : nullptr;
+  if (!lhs || !rhs || isa<mlir::MemRefType>(lhs.getType()) ||
+      isa<mlir::MemRefType>(rhs.getType()))
+    return nullptr;
+
+  if (!StringRef("+-*<").contains(e.getOp()))
+    return genCall(std::string("binary") + e.getOp(), {lhs, rhs}, l);
+
+  bool fp = lhs.getType().isF64() || rhs.getType().isF64();
+  mlir::Type common = fp ? builder.getF64Type() : builder.getI64Type();
+  lhs = convert(lhs, common);
+  rhs = convert(rhs, common);
+
+  switch (e.getOp()) {
+  case '+':
+    if (fp)
+      return builder.create<mlir::arith::AddFOp>(l, lhs, rhs);
+    return builder.create<mlir::arith::AddIOp>(l, lhs, rhs);
+  case '-':
+    if (fp)
+      return builder.create<mlir::arith::SubFOp>(l, lhs, rhs);
+    return builder.create<mlir::arith::SubIOp>(l, lhs, rhs);
+  case '*':
+    if (fp)
+      return builder.create<mlir::arith::MulFOp>(l, lhs, rhs);
+    return builder.create<mlir::arith::MulIOp>(l, lhs, rhs);
+  default:
+    if (fp)
+      return builder.create<mlir::arith::CmpFOp>(l, mlir::arith::CmpFPredicate::ULT, lhs, rhs);
+    return builder.create<mlir::arith::CmpIOp>(l, mlir::arith::CmpIPredicate::slt, lhs, rhs);
+  }
+}
+
+// Calls a toy function (or operator) through its public name, like AST
+// codegen does. Builtins and functions taking or returning arrays are not
+// covered.
+mlir::Value MLIRGen::genCall(const std::string &callee, SmallVector<mlir::Value, 4> args,
+                             mlir::Location l) {
+  auto PI = S.FunctionProtos.find(callee);
+  if (PI == S.FunctionProtos.end())
+    return nullptr;
+  const PrototypeAST &proto = *PI->second;
+  if (proto.getArgs().size() != args.size() || proto.getReturnType() == ToyType::Array)
+    return nullptr;
+
+  for (unsigned i = 0, e = args.size(); i != e; ++i) {
+    if (proto.getArgTypes()[i] == ToyType::Array)
+      return nullptr;
+    args[i] = convert(args[i], getType(proto.getArgTypes()[i]));
+    if (!args[i])
+      return nullptr;
+  }
+  return builder.create<mlir::func::CallOp>(l, declare(proto), args).getResult(0);
+}
+
+mlir::Value MLIRGen::genIf(IfExprAST &e) {
+  mlir::Location l = loc(e.getLocation());
+  auto type = e.inferType(S, typeEnv());
+  if (!type || *type == ToyType::Array)
+    return nullptr;
+  mlir::Type resultType = getType(*type);
+
+  mlir::Value cond = gen(e.getCond());
+  if (!cond || !(cond = toCondition(cond)))
+    return nullptr;
+
+  auto ifOp = builder.create<mlir::scf::IfOp>(l, resultType, cond, /*withElseRegion=*/true);
+  // Each branch is widened to the type of the whole, bool < int < double.
+  auto rank = [](ToyType t) { return t == ToyType::Double ? 2 : t == ToyType::Int ? 1 : 0; };
+  auto genBranch = [&](mlir::Region &region, ExprAST &branch) {
+    builder.setInsertionPointToStart(&region.front());
+    mlir::Value v = gen(branch);
+    auto branchType = v ? getToyType(v.getType()) : std::nullopt;
+    if (!branchType || *branchType == ToyType::Array || rank(*branchType) > rank(*type))
+      return false;
+    builder.create<mlir::scf::YieldOp>(l, convert(v, resultType));
+    return true;
+  };
+  bool ok = genBranch(ifOp.getThenRegion(), e.getThen()) &&
+            genBranch(ifOp.getElseRegion(), e.getElse());
+  builder.setInsertionPointAfter(ifOp);
+  return ok ? ifOp.getResult(0) : nullptr;
+}
+
+mlir::Value MLIRGen::genFor(ForExprAST &e) {
+  mlir::Value start = gen(e.getStart());
+  if (!start || isa<mlir::MemRefType>(start.getType()))
+    return nullptr;
+
+  // The same typing as AST codegen, so both backends compute the same values.
+  bool isInt = isIntCounter(*getToyType(start.getType()), e.getStep(), e.getBody(),
+                            e.getVarName());
+
+  AffineBounds bounds;
+  bool ok = isInt && getAffineBounds(e, bounds) ? genAffineFor(e, bounds)
+                                                : genWhile(e, start, isInt);
+  if (!ok)
+    return nullptr;
+  return constant(loc(e.getLocation()), builder.getF64Type(), 0.0);
+}
+
+// Whether e can be an affine.for: its variable is never assigned, the step is
+// a positive integer literal and the condition is `var < bound`, with start
+// and bound affine.
+bool MLIRGen::getAffineBounds(ForExprAST &e, AffineBounds &b) {
+  const std::string &name = e.getVarName();
+  if (assigned.count(name))
+    return false;
+
+  b.step = 1;
+  if (ExprAST *step = e.getStep()) {
+    auto *num = dyn_cast<NumberExprAST>(step);
+    if (!num || !num->isIntegerLiteral() || num->getValue() < 1)
+      return false;
+    b.step = (int64_t)num->getValue();
+  }
+
+  auto *cond = dyn_cast<BinaryExprAST>(&e.getEnd());
+  auto *var = cond && cond->getOp() == '<' ? dyn_cast<VariableExprAST>(&cond->getLHS())
+                                           : nullptr;
+  if (!var || var->getName() != name || mentions(cond->getRHS(), name))
+    return false;
+
+  b.lower = getAffineExpr(e.getStart(), b.operands);
+  b.bound = b.lower ? getAffineExpr(cond->getRHS(), b.operands) : mlir::AffineExpr();
+  return b.lower && b.bound;
+}
+
+bool MLIRGen::genAffineFor(ForExprAST &e, const AffineBounds &b) {
+  mlir::Location l = loc(e.getLocation());
+  SmallVector<mlir::Value, 8> operands = b.operands.all();
+  mlir::AffineMap lowerMap = b.operands.map(b.lower);
+  mlir::AffineMap upperMap = b.operands.map(b.bound + b.step);
+
+  auto emitLoop = [&] {
+    bool ok = true;
+    builder.create<mlir::affine::AffineForOp>(
+        l, operands, lowerMap, operands, upperMap, b.step, mlir::ValueRange(),
+        [&](mlir::OpBuilder &, mlir::Location, mlir::Value iv, mlir::ValueRange) {
+          ok = genLoopBody(e, iv);
+          builder.create<mlir::affine::AffineYieldOp>(l);
+        });
+    return ok;
+  };
+  auto emitOnce = [&] {
+    mlir::Value start = builder.create<mlir::affine::AffineApplyOp>(l, lowerMap, operands);
+    return genLoopBody(e, start);
+  };
+
+  // A toy loop tests its condition after the body: it runs for every value
+  // up to the first one >= bound, and at least once. affine.for tests first,
+  // so when start >= bound + step, the one iteration is run on its own.
+  mlir::AffineExpr slack = b.bound + (b.step - 1) - b.lower;
+  mlir::AffineMap slackMap = b.operands.map(slack);
+  if (slackMap.isSingleConstant())
+    return slackMap.getSingleConstantResult() >= 0 ? emitLoop() : emitOnce();
+
+  auto ifOp = builder.create<mlir::affine::AffineIfOp>(
+      l,
+      mlir::IntegerSet::get(b.operands.dims.size(), b.operands.symbols.size(), {slack},
+                            {false}),
+      operands, /*withElseRegion=*/true);
+  mlir::OpBuilder::InsertionGuard guard(builder);
+  builder.setInsertionPointToStart(ifOp.getThenBlock());
+  bool ok = emitLoop();
+  builder.setInsertionPointToStart(ifOp.getElseBlock());
+  return emitOnce() && ok;
+}
+
+// Any other loop is an scf.while whose condition region runs the body, step
+// and condition in the order AST codegen does.
+bool MLIRGen::genWhile(ForExprAST &e, mlir::Value start, bool isInt) {
+  mlir::Location l = loc(e.getLocation());
+  mlir::Type varType = isInt ? builder.getI64Type() : builder.getF64Type();
+  mlir::Value var = createEntryAlloca(varType);
+  builder.create<mlir::affine::AffineStoreOp>(l, convert(start, varType), var,
+                                              mlir::ValueRange());
+  auto old = bind(e.getVarName(), {var, isInt ? ToyType::Int : ToyType::Double, true});
+
+  bool ok = false;
+  builder.create<mlir::scf::WhileOp>(
+      l, mlir::TypeRange(), mlir::ValueRange(),
+      [&](mlir::OpBuilder &, mlir::Location, mlir::ValueRange) {
+        mlir::Value cond;
+        if (gen(e.getBody())) {
+          mlir::Value step = e.getStep() ? gen(*e.getStep()) : constant(l, varType, 1.0);
+          mlir::Value end = step ? gen(e.getEnd()) : nullptr;
+          if (end && (step = convert(step, varType)) && (cond = toCondition(end))) {
+            mlir::Value cur = builder.create<mlir::affine::AffineLoadOp>(l, var, mlir::ValueRange());
+            mlir::Value next;
+            if (isInt)
+              next = builder.create<mlir::arith::AddIOp>(l, cur, step);
+            else
+              next = builder.create<mlir::arith::AddFOp>(l, cur, step);
+            builder.create<mlir::affine::AffineStoreOp>(l, next, var, mlir::ValueRange());
+            ok = true;
+          }
+        }
+        // The module is thrown away on failure, but keep the region valid.
+        if (!ok)
+          cond = constant(l, builder.getI1Type(), 0.0);
+        builder.create<mlir::scf::ConditionOp>(l, cond, mlir::ValueRange());
+      },
+      [&](mlir::OpBuilder &, mlir::Location, mlir::ValueRange) {
+        builder.create<mlir::scf::YieldOp>(l);
+      });
+
+  unbind(e.getVarName(), old);
+  return ok;
+}
+
+bool MLIRGen::genLoopBody(ForExprAST &e, mlir::Value var) {
+  auto old = bind(e.getVarName(), {var, ToyType::Int, false});
+  bool ok = bool(gen(e.getBody()));
+  unbind(e.getVarName(), old);
+  return ok;
+}
+
+mlir::Value MLIRGen::genVar(VarExprAST &e) {
+  std::vector<std::pair<std::string, std::optional<Binding>>> oldBindings;
+  bool ok = true;
+
+  for (unsigned i = 0, n = e.getVarNames().size(); ok && i != n; ++i) {
+    const std::string &name = e.getVarNames()[i].first;
+    ExprAST *init = e.getVarNames()[i].second.get();
+    mlir::Location l = loc(e.getLocation());
+    mlir::Value val = init ? gen(*init) : constant(l, builder.getF64Type(), 0.0);
+    if (!val || !getToyType(val.getType())) {
+      ok = false;
+      break;
+    }
+
+    // Typed as in AST codegen.
+    ToyType type = *getToyType(val.getType());
+    if (auto annotated = e.getVarTypes()[i]) {
+      type = *annotated;
+    } else if (type == ToyType::Int) {
+      type = ToyType::Double;
+    } else if (type == ToyType::Bool) {
+      TypeEnv env = typeEnv();
+      env[name] = type;
+      if (!assignmentsFit(S, e.getBody(), name, type, env))
+        type = ToyType::Double;
+    }
+
+    Binding b{convert(val, getType(type)), type, false};
+    if (!b.value || (type == ToyType::Array && assigned.count(name))) {
+      ok = false;
+      break;
+    }
+    if (assigned.count(name)) {
+      mlir::Value memory = createEntryAlloca(getType(type));
+      builder.create<mlir::affine::AffineStoreOp>(l, b.value, memory, mlir::ValueRange());
+      b = {memory, type, true};
+    }
+    oldBindings.emplace_back(name, bind(name, b));
+  }
+
+  mlir::Value result = ok ? gen(e.getBody()) : nullptr;
+  for (auto it = oldBindings.rbegin(); it != oldBindings.rend(); ++it)
+    unbind(it->first, it->second);
+  return result;
+}
+
+mlir::OwningOpRef<mlir::ModuleOp> MLIRGen::lower(const FunctionAST &fn) {
+  const PrototypeAST &proto = fn.getProto();
+  if (proto.getReturnType() == ToyType::Array)
+    return nullptr;
+  collectAssigned(fn.getBody(), assigned);
+
+  mlir::Location l = loc(proto.getLocation());
+  mlir::OwningOpRef<mlir::ModuleOp> owner = mlir::ModuleOp::create(l);
+  module = *owner;
+  builder.setInsertionPointToEnd(module.getBody());
+
+  bool takesArrays = is_contained(proto.getArgTypes(), ToyType::Array);
+  auto function = builder.create<mlir::func::FuncOp>(
+      l, takesArrays ? proto.getName() + ".mlir" : proto.getName(), getFunctionType(proto));
+  entry = function.addEntryBlock();
+  builder.setInsertionPointToStart(entry);
+
+  for (unsigned i = 0, e = proto.getArgs().size(); i != e; ++i) {
+    const std::string &name = proto.getArgs()[i];
+    ToyType type = proto.getArgTypes()[i];
+    Binding b{entry->getArgument(i), type, false};
+    if (assigned.count(name)) {
+      if (type == ToyType::Array)
+        return nullptr;
+      b.value = createEntryAlloca(getType(type));
+      b.inMemory = true;
+      builder.create<mlir::affine::AffineStoreOp>(l, entry->getArgument(i), b.value,
+                                                  mlir::ValueRange());
+    }
+    scope[name] = b;
+  }
+
+  mlir::Value ret = gen(fn.getBody());
+  if (!ret || !(ret = convert(ret, getType(proto.getReturnType()))))
+    return nullptr;
+  builder.create<mlir::func::ReturnOp>(l, ret);
+
+  if (mlir::failed(mlir::verify(*owner)))
+    return nullptr;
+  return owner;
+}
+
+// Defines name with the toy signature around name.mlir, which takes every
+// array as the fields of a 1-D memref descriptor: allocated and aligned
+// pointer, offset, size and stride.
+static void emitArrayWrapper(Module &M, const PrototypeAST &proto) {
+  LLVMContext &ctx = M.getContext();
+  Function *impl = M.getFunction(proto.getName() + ".mlir");
+  Type *ptrTy = PointerType::getUnqual(ctx);
+  Type *i64 = Type::getInt64Ty(ctx);
+  StructType *arrayTy = StructType::get(ctx, {ptrTy, i64});
+
+  std::vector<Type *> params;
+  unsigned implArg = 0;
+  for (ToyType type : proto.getArgTypes()) {
+    bool isArray = type == ToyType::Array;
+    params.push_back(isArray ? ptrTy : impl->getArg(implArg)->getType());
+    implArg += isArray ? 5 : 1;
+  }
+
+  Function *f = Function::Create(FunctionType::get(impl->getReturnType(), params, false),
+                                 Function::ExternalLinkage, proto.getName(), M);
+  IRBuilder<> B(BasicBlock::Create(ctx, "entry", f));
+  std::vector<Value *> args;
+  for (unsigned i = 0, e = params.size(); i != e; ++i) {
+    Value *arg = f->getArg(i);
+    if (proto.getArgTypes()[i] != ToyType::Array) {
+      args.push_back(arg);
+      continue;
+    }
+    Value *data = B.CreateLoad(ptrTy, arg, "data");
+    B.CreateAlignmentAssumption(M.getDataLayout(), data, ToyArrayAlign);
+    Value *len = B.CreateLoad(i64, B.CreateStructGEP(arrayTy, arg, 1), "len");
+    args.insert(args.end(), {data, data, B.getInt64(0), len, B.getInt64(1)});
+  }
+  B.CreateRet(B.CreateCall(impl, args));
+
+  impl->setLinkage(GlobalValue::InternalLinkage);
+  impl->addFnAttr(Attribute::AlwaysInline);
+}
+
+struct MLIRLowering::Impl {
+  // Sessions already run on threads of their own.
+  mlir::MLIRContext context{mlir::MLIRContext::Threading::DISABLED};
+  mlir::PassManager PM{&context, mlir::ModuleOp::getOperationName()};
+};
+
+MLIRLowering::MLIRLowering(CompilerSession &S, StringRef pipeline, TargetMachine *TM)
+    : S(S), pipeline(pipeline.str()), TM(TM), impl(std::make_unique<Impl>()) {
+  impl->context.loadDialect<mlir::affine::AffineDialect, mlir::arith::ArithDialect,
+                            mlir::cf::ControlFlowDialect, mlir::func::FuncDialect,
+                            mlir::LLVM::LLVMDialect, mlir::memref::MemRefDialect,
+                            mlir::scf::SCFDialect>();
+  mlir::registerBuiltinDialectTranslation(impl->context);
+  mlir::registerLLVMDialectTranslation(impl->context);
+}
+
+Expected<std::unique_ptr<MLIRLowering>>
+MLIRLowering::Create(CompilerSession &S, StringRef pipeline, TargetMachine *TM) {
+  // Pipelines are parsed by pass name, so the passes must be registered.
+  static std::once_flag registerPasses;
+  std::call_once(registerPasses, [] {
+    mlir::registerTransformsPasses();
+    mlir::affine::registerAffinePasses();
+    mlir::toy::registerAffinePasses();
+    mlir::registerConversionPasses();
+  });
+
+  std::unique_ptr<MLIRLowering> lowering(
+      new MLIRLowering(S, pipeline.empty() ? StringRef(DefaultPipeline) : pipeline, TM));
+  std::string message;
+  raw_string_ostream OS(message);
+  if (mlir::failed(mlir::parsePassPipeline(lowering->pipeline, lowering->impl->PM, OS)))
+    return createStringError(inconvertibleErrorCode(), "invalid MLIR pass pipeline: %s",
+                             OS.str().c_str());
+  return std::move(lowering);
+}
+
+std::optional<ThreadSafeModule> MLIRLowering::lower(const FunctionAST &fn) {
+  // Whatever this backend cannot do goes to AST codegen, which reports the
+  // errors that matter to the user.
+  mlir::ScopedDiagnosticHandler quiet(&impl->context,
+                                      [](mlir::Diagnostic &) { return mlir::success(); });
+  // inferType falls back to these; they belong to the last AST codegen.
+  S.namedValues.clear();
+
+  mlir::OwningOpRef<mlir::ModuleOp> module = MLIRGen(S, impl->context).lower(fn);
+  if (!module || mlir::failed(impl->PM.run(*module)))
+    return std::nullopt;
+
+  auto context = std::make_unique<LLVMContext>();
+  std::unique_ptr<Module> M = mlir::translateModuleToLLVMIR(*module, *context, fn.getName());
+  if (!M)
+    return std::nullopt;
+  M->setDataLayout(S.module->getDataLayout());
+  if (TM)
+    M->setTargetTriple(TM->getTargetTriple().str());
+  if (is_contained(fn.getProto().getArgTypes(), ToyType::Array))
+    emitArrayWrapper(*M, fn.getProto());
+
+  // The affine passes restructure loops; LLVM still does the inlining,
+  // vectorization and instruction selection for the host.
+  {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3).run(*M, MAM);
+  }
+
+  return ThreadSafeModule(std::move(M), std::move(context));
+}
+
+#else
+
+struct MLIRLowering::Impl {};
+
+MLIRLowering::MLIRLowering(CompilerSession &S, StringRef pipeline, TargetMachine *TM)
+    : S(S), pipeline(pipeline.str()), TM(TM) {}
+
+Expected<std::unique_ptr<MLIRLowering>>
+MLIRLowering::Create(CompilerSession &S, StringRef pipeline, TargetMachine *TM) {
+  return createStringError(inconvertibleErrorCode(),
+                           "toy was built without MLIR (configure with -DTOY_ENABLE_MLIR=ON)");
+}
+
+std::optional<ThreadSafeModule> MLIRLowering::lower(const FunctionAST &fn) {
+  return std::nullopt;
+}
+
+#endif
+
+MLIRLowering::~MLIRLowering() = default;
@@ -0,0 +1,51 @@
+#ifndef MLIR_GEN_H
+#define MLIR_GEN_H
+
+#include "AST.h"
+
+// Second backend for function definitions: the body is lowered to MLIR (func,
+// affine, scf, arith and memref ops), optimized by a pipeline of MLIR passes
+// and translated to an LLVM IR module with the same signature AST codegen
+// would give the function.
+//
+// Loops whose start and bound are affine in the enclosing induction variables
+// and unassigned integer variables, with a constant positive step, become
+// affine.for; array arguments become memrefs, indexed through affine maps
+// where the subscript is affine too. That is the form the affine passes
+// (fusion, scalar replacement, tiling, unrolling) work on. Other loops and
+// conditionals become scf ops.
+//
+// Only part of the language is covered: numbers, variables, if, for, var,
+// operators and calls with numeric arguments, and indexing and storing into
+// arrays passed as arguments. A definition using anything else (the array
+// builtins, array results, passing arrays on) is left to AST codegen.
+class MLIRLowering {
+public:
+    // Loop optimizations and the lowering to the LLVM dialect, as a textual
+    // pass pipeline nested in builtin.module.
+    static const char DefaultPipeline[];
+
+    // Creates a lowering for the definitions of S that runs pipeline (the
+    // default if empty) and optimizes the result for TM, if given. Fails if
+    // pipeline does not parse or toy was built without MLIR.
+    static Expected<std::unique_ptr<MLIRLowering>>
+    Create(CompilerSession &S, StringRef pipeline, TargetMachine *TM);
+    ~MLIRLowering();
+
+    // A module defining fn, or std::nullopt if fn uses something this backend
+    // does not cover or the pipeline fails on it.
+    std::optional<ThreadSafeModule> lower(const FunctionAST &fn);
+
+    const std::string &getPipeline() const { return pipeline; }
+
+private:
+    struct Impl;
+    MLIRLowering(CompilerSession &S, StringRef pipeline, TargetMachine *TM);
+
+    CompilerSession &S;
+    std::string pipeline;
+    TargetMachine *TM;
+    std::unique_ptr<Impl> impl;
+};
+
+#endif
@@ -1,62 +1,41 @@
 #include "Parser.h"
 #include "ErrorHandler.h"
-#include "Lexer.h"
-#include "KaleidoscopeJIT/KaleidoscopeJIT.h"
-
-#include <iostream>
-
-std::unique_ptr<LLVMContext> context;
-std::unique_ptr<IRBuilder<>> builder;
-std::unique_ptr<Module> module;
-std::map<std::string, AllocaInst*> namedValues;
-std::unique_ptr<KaleidoscopeJIT> JIT;
-std::unique_ptr<FunctionPassManager> FPM;
-std::unique_ptr<LoopAnalysisManager> LAM;
-std::unique_ptr<FunctionAnalysisManager> FAM;
-std::unique_ptr<CGSCCAnalysisManager> CGAM;
-std::unique_ptr<ModuleAnalysisManager> MAM;
-std::unique_ptr<PassInstrumentationCallbacks> PIC;
-std::unique_ptr<StandardInstrumentations> SI;
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-ExitOnError ExitOnErr;
-std::map<char, int> BinopPrecedence;
-
-
-
-static int getTokPrecedence() {
-  if (!isascii(CurTok))
+
+int Parser::getTokPrecedence() {
+  if (!isascii(lex.CurTok))
     return -1;
 
-  int TokPrec = BinopPrecedence[CurTok];
+  int TokPrec = binopPrecedence[lex.CurTok];
 
   return (TokPrec <= 0) ? -1 : TokPrec;
 }
 
-static std::unique_ptr<ExprAST> parseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(NumVal);
-  getNextToken();
+std::unique_ptr<ExprAST> Parser::parseNumberExpr() {
+  auto result = std::make_unique<NumberExprAST>(
+      lex.NumVal, lex.NumIsInteger ? ToyType::Int : ToyType::Double);
+  lex.getNextToken();
 
   return std::move(result);
 }
 
-static std::unique_ptr<ExprAST> parseIfExpr(){
-  getNextToken();
+std::unique_ptr<ExprAST> Parser::parseIfExpr(){
+  lex.getNextToken();
   auto cond = parseExpression();
   if(!cond)
     return nullptr;
   
-  if(CurTok != THEN)
+  if(lex.CurTok != THEN)
     return LogError("expected then");
   
-  getNextToken();
+  lex.getNextToken();
   auto then = parseExpression();
   if(!then)
     return nullptr;
   
-  if(CurTok != ELSE)
+  if(lex.CurTok != ELSE)
     return LogError("expected else");
   
-  getNextToken();
+  lex.getNextToken();
 
   auto Else = parseExpression();
   if(!Else)
@@ -65,24 +44,24 @@ static std::unique_ptr<ExprAST> parseIfExpr(){
   return std::make_unique<IfExprAST>(std::move(cond), std::move(then), std::move(Else));
 }
 
-static std::unique_ptr<ExprAST> parseForExpr(){
-  getNextToken();
-  if(CurTok != IDENTIFIER)
+std::unique_ptr<ExprAST> Parser::parseForExpr(){
+  lex.getNextToken();
+  if(lex.CurTok != IDENTIFIER)
     return LogError("expected identifier after for");
   
-  std::string idName = IdentifierStr;
-  getNextToken();
+  std::string idName = lex.IdentifierStr;
+  lex.getNextToken();
 
-  if(CurTok != '=')
+  if(lex.CurTok != '=')
     return LogError("expected '=' after for");
   
-  getNextToken();
+  lex.getNextToken();
   auto start = parseExpression();
   if(!start)
     return nullptr;
-  if(CurTok != ',')
+  if(lex.CurTok != ',')
     return LogError("expected ',' after for start value");
-  getNextToken();
+  lex.getNextToken();
 
 
   auto end = parseExpression();
@@ -91,17 +70,17 @@ static std::unique_ptr<ExprAST> parseForExpr(){
 
   std::unique_ptr<ExprAST> step;
 
-  if(CurTok == ','){
-    getNextToken();
+  if(lex.CurTok == ','){
+    lex.getNextToken();
     step = parseExpression();
     if(!step)
       return nullptr;
   }
 
-  if(CurTok != IN)
+  if(lex.CurTok != IN)
     return LogError("expected in after for");
   
-  getNextToken();
+  lex.getNextToken();
 
   auto body = parseExpression();
   if(!body)
@@ -111,23 +90,28 @@ static std::unique_ptr<ExprAST> parseForExpr(){
     std::move(step), std::move(body));
 }
 
-static std::unique_ptr<ExprAST> parseVarExpr(){
-  getNextToken(); // eat the var.
+std::unique_ptr<ExprAST> Parser::parseVarExpr(){
+  lex.getNextToken(); // eat the var.
 
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  std::vector<std::optional<ToyType>> VarTypes;
 
   // At least one variable name is required.
-  if (CurTok != IDENTIFIER)
+  if (lex.CurTok != IDENTIFIER)
     return LogError("expected identifier after var");
 
   while (true) {
-    std::string Name = IdentifierStr;
-    getNextToken(); // eat identifier.
+    std::string Name = lex.IdentifierStr;
+    lex.getNextToken(); // eat identifier.
+
+    std::optional<ToyType> Type;
+    if (!parseTypeAnnotation(Type))
+      return nullptr;
 
     // Read the optional initializer.
     std::unique_ptr<ExprAST> Init = nullptr;
-    if (CurTok == '=') {
-      getNextToken(); // eat the '='.
+    if (lex.CurTok == '=') {
+      lex.getNextToken(); // eat the '='.
 
       Init = parseExpression();
       if (!Init)
@@ -135,60 +119,78 @@ static std::unique_ptr<ExprAST> parseVarExpr(){
     }
 
     VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    VarTypes.push_back(Type);
 
     // End of var list, exit loop.
-    if (CurTok != ',')
+    if (lex.CurTok != ',')
       break;
-    getNextToken(); // eat the ','.
+    lex.getNextToken(); // eat the ','.
 
-    if (CurTok != IDENTIFIER)
+    if (lex.CurTok != IDENTIFIER)
       return LogError("expected identifier list after var");
   }
 
   // At this point, we have to have 'in'.
-  if (CurTok != IN)
+  if (lex.CurTok != IN)
     return LogError("expected 'in' keyword after 'var'");
-  getNextToken(); // eat 'in'.
+  lex.getNextToken(); // eat 'in'.
 
   auto Body = parseExpression();
   if (!Body)
     return nullptr;
 
-  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body),
+                                      std::move(VarTypes));
 }
 
-static std::unique_ptr<ExprAST> parsePrimary() {
-  switch (CurTok) {
+std::unique_ptr<ExprAST> Parser::parsePrimary() {
+  SourceLocation loc = lex.TokLoc;
+  std::unique_ptr<ExprAST> result;
+  switch (lex.CurTok) {
   case IDENTIFIER:
-    return parseIdentifierExpr();
+    result = parseIdentifierExpr();
+    break;
   case NUMBER:
-    return parseNumberExpr();
+    result = parseNumberExpr();
+    break;
   case '(':
+    // Keeps the location of the inner expression.
     return parseParenExpr();
   case IF:
-    return parseIfExpr();
+    result = parseIfExpr();
+    break;
   case FOR:
-    return parseForExpr();
+    result = parseForExpr();
+    break;
   case VAR:
-    return parseVarExpr();
+    result = parseVarExpr();
+    break;
   default:
     return LogError("unknown token when expecting an expression");
   }
+
+  if (result)
+    result->setLocation(loc);
+  return result;
 }
 
-static std::unique_ptr<ExprAST> parseUnary(){
-  if(!isascii(CurTok) || CurTok == '(' || CurTok == ',')
+std::unique_ptr<ExprAST> Parser::parseUnary(){
+  if(!isascii(lex.CurTok) || lex.CurTok == '(' || lex.CurTok == ',')
     return parsePrimary();
   
-  int opc = CurTok;
-  getNextToken();
-  if(auto operand = parseUnary())
-    return std::make_unique<UnaryExprAST>(opc, std::move(operand));
+  int opc = lex.CurTok;
+  SourceLocation loc = lex.TokLoc;
+  lex.getNextToken();
+  if(auto operand = parseUnary()) {
+    auto result = std::make_unique<UnaryExprAST>(opc, std::move(operand));
+    result->setLocation(loc);
+    return result;
+  }
   
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> parseExpression() {
+std::unique_ptr<ExprAST> Parser::parseExpression() {
   auto LHS = parsePrimary();
   if (!LHS)
     return nullptr;
@@ -196,63 +198,80 @@ static std::unique_ptr<ExprAST> parseExpression() {
   return parseBinOpRHS(0, std::move(LHS));
 }
 
-static std::unique_ptr<ExprAST> parseParenExpr() {
-  getNextToken();
+std::unique_ptr<ExprAST> Parser::parseParenExpr() {
+  lex.getNextToken();
   auto v = parseExpression();
 
   if (!v) {
     return nullptr;
   }
 
-  if (CurTok != ')')
+  if (lex.CurTok != ')')
     return LogError("expected ')'");
 
-  getNextToken();
+  lex.getNextToken();
   return v;
 }
 
-static std::unique_ptr<ExprAST> parseIdentifierExpr() {
-  std::string idName = IdentifierStr;
+std::unique_ptr<ExprAST> Parser::parseIdentifierExpr() {
+  std::string idName = lex.IdentifierStr;
+  SourceLocation loc = lex.TokLoc;
 
-  getNextToken();
+  lex.getNextToken();
 
-  if (CurTok != '(') // means it is an identifier
+  if (lex.CurTok == '[') { // array element
+    lex.getNextToken();
+    auto index = parseExpression();
+    if (!index)
+      return nullptr;
+
+    if (lex.CurTok != ']')
+      return LogError("expected ']'");
+    lex.getNextToken();
+
+    auto array = std::make_unique<VariableExprAST>(idName);
+    array->setLocation(loc);
+    return std::make_unique<IndexExprAST>(std::move(array), std::move(index));
+  }
+
+  if (lex.CurTok != '(') // means it is an identifier
     return std::make_unique<VariableExprAST>(idName);
 
-  getNextToken();
+  lex.getNextToken();
   std::vector<std::unique_ptr<ExprAST>> args;
 
-  if (CurTok != ')') {
+  if (lex.CurTok != ')') {
     while (true) {
       if (auto arg = parseExpression())
         args.push_back(std::move(arg));
       else
         return nullptr;
 
-      if (CurTok == ')')
+      if (lex.CurTok == ')')
         break;
 
-      if (CurTok != ',')
+      if (lex.CurTok != ',')
         return LogError("Expected ')' or ',' in argument list");
-      getNextToken();
+      lex.getNextToken();
     }
   }
-  getNextToken();
+  lex.getNextToken();
 
   return std::make_unique<CallExprAST>(idName, std::move(args));
 }
 
 // a + b * c| *( d + e)
-static std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+std::unique_ptr<ExprAST> Parser::parseBinOpRHS(int exprPrec,
+                                               std::unique_ptr<ExprAST> LHS) {
   while (true) {
     int tkPrec = getTokPrecedence();
 
     if (tkPrec < exprPrec)
       return LHS;
 
-    int binOp = CurTok;
-    getNextToken();
+    int binOp = lex.CurTok;
+    SourceLocation loc = lex.TokLoc;
+    lex.getNextToken();
 
     auto RHS = parseUnary();
 
@@ -267,246 +286,143 @@ static std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec,
 
     LHS =
         std::make_unique<BinaryExprAST>(binOp, std::move(LHS), std::move(RHS));
+    LHS->setLocation(loc);
   }
 }
 
-static std::unique_ptr<PrototypeAST> parsePrototype() {
+std::unique_ptr<PrototypeAST> Parser::parsePrototype() {
   unsigned kind = 0;
   unsigned binaryPrecedence = 30;
   std::string fnName;
 
-  switch (CurTok){
+  switch (lex.CurTok){
     default:
       return LogErrorP("Expected function name in prototype");
     case IDENTIFIER:
-    fnName = IdentifierStr;
+    fnName = lex.IdentifierStr;
     kind = 0;
-    getNextToken();
+    lex.getNextToken();
     break;
 
     case UNARY:
-      getNextToken();
-      if(!isascii((CurTok)))
+      lex.getNextToken();
+      if(!isascii((lex.CurTok)))
         return LogErrorP("Expected unary operator");
       fnName = "unary";
-      fnName += (char) CurTok;
+      fnName += (char) lex.CurTok;
       kind = 1;
-      getNextToken();
+      lex.getNextToken();
       break;
 
     case BINARY:
-      getNextToken();
-      if(!isascii(CurTok))
+      lex.getNextToken();
+      if(!isascii(lex.CurTok))
         return LogErrorP("Expected binary operator");
       fnName = "binary";
-      fnName +=(char)CurTok;
+      fnName +=(char)lex.CurTok;
       kind = 2;
-      getNextToken();
-      if(CurTok == NUMBER){
-        if(NumVal <1 || NumVal > 100)
+      lex.getNextToken();
+      if(lex.CurTok == NUMBER){
+        if(lex.NumVal <1 || lex.NumVal > 100)
           return LogErrorP("Invalid precedence: must be 1..100");
-          binaryPrecedence = (unsigned) NumVal;
-          getNextToken();
+          binaryPrecedence = (unsigned) lex.NumVal;
+          lex.getNextToken();
       }
       break;
   }
 
-  if(CurTok != '(')
+  if(lex.CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
   
   std::vector<std::string> argNames;
+  std::vector<ToyType> argTypes;
+
+  lex.getNextToken();
+  while(lex.CurTok == IDENTIFIER){
+    argNames.push_back(lex.IdentifierStr);
+    lex.getNextToken();
 
-  while(getNextToken() == IDENTIFIER)
-    argNames.push_back(IdentifierStr);
+    std::optional<ToyType> type;
+    if(!parseTypeAnnotation(type))
+      return nullptr;
+    argTypes.push_back(type.value_or(ToyType::Double));
+  }
   
-  if(CurTok != ')')
+  if(lex.CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
   
-  getNextToken();
+  unsigned closeLine = lex.TokLoc.line;
+  lex.getNextToken();
   if(kind && argNames.size() != kind)
     return LogErrorP("Invalid number of operands for operator");
 
-  return std::make_unique<PrototypeAST>(fnName, std::move(argNames), kind!= 0, binaryPrecedence);
+  // The return type must follow on the same line: a ':' starting a later
+  // line is a REPL command, e.g. after `extern sin(x)` without a ';'.
+  std::optional<ToyType> returnType;
+  if(lex.TokLoc.line == closeLine && !parseTypeAnnotation(returnType))
+    return nullptr;
+
+  return std::make_unique<PrototypeAST>(fnName, std::move(argNames), kind!= 0, binaryPrecedence,
+                                        std::move(argTypes), returnType.value_or(ToyType::Double));
 }
 
-static std::unique_ptr<FunctionAST> parseDefinition() {
-  getNextToken();
+/// typeannotation ::= (':' ('double' | 'int' | 'bool' | 'array'))?
+/// Leaves type empty when there is no annotation; returns false on error.
+bool Parser::parseTypeAnnotation(std::optional<ToyType> &type) {
+  if(lex.CurTok != ':')
+    return true;
+
+  lex.getNextToken();
+  static const std::map<std::string, ToyType> names = {
+      {"double", ToyType::Double},
+      {"int", ToyType::Int},
+      {"bool", ToyType::Bool},
+      {"array", ToyType::Array}};
+  auto it = lex.CurTok == IDENTIFIER ? names.find(lex.IdentifierStr) : names.end();
+  if(it == names.end()){
+    LogError("Expected 'double', 'int', 'bool' or 'array' after ':'");
+    return false;
+  }
+
+  lex.getNextToken();
+  type = it->second;
+  return true;
+}
+
+/// definition ::= 'memo'? 'def' prototype expression
+std::unique_ptr<FunctionAST> Parser::parseDefinition() {
+  SourceLocation loc = lex.TokLoc;
+  // The lexer returns MEMO only right before a DEF.
+  bool memoized = lex.CurTok == MEMO;
+  if (memoized)
+    lex.getNextToken();
+  lex.getNextToken();
 
   auto proto = parsePrototype();
   if (!proto)
     return nullptr;
-  if (auto E = parseExpression())
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
+  proto->setLocation(loc);
+  if (auto E = parseExpression()) {
+    auto fn = std::make_unique<FunctionAST>(std::move(proto), std::move(E));
+    fn->setMemoized(memoized);
+    return fn;
+  }
 
   return nullptr;
 }
 
-static std::unique_ptr<PrototypeAST> parseExtern() {
-  getNextToken();
+std::unique_ptr<PrototypeAST> Parser::parseExtern() {
+  lex.getNextToken();
   return parsePrototype();
 }
 
-static std::unique_ptr<FunctionAST> parseTopLevelExpr() {
+std::unique_ptr<FunctionAST> Parser::parseTopLevelExpr() {
+  SourceLocation loc = lex.TokLoc;
   if (auto E = parseExpression()) {
     auto proto = std::make_unique<PrototypeAST>("__anon_expr",
                                                 std::vector<std::string>());
+    proto->setLocation(loc);
     return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
   }
   return nullptr;
 }
-
-static void InitializeModule() {
-  context = std::make_unique<LLVMContext>();
-  module = std::make_unique<Module>("KaleidoscopeJIT", *context);
-  module->setDataLayout(JIT->getDataLayout());
-
-  // create a new builder for the module
-  builder = std::make_unique<IRBuilder<>>(*context);
-
-  FPM = std::make_unique<FunctionPassManager>();
-
-  LAM = std::make_unique<LoopAnalysisManager>();
-
-  FAM = std::make_unique<FunctionAnalysisManager>();
-
-  CGAM = std::make_unique<CGSCCAnalysisManager>();
-
-  MAM = std::make_unique<ModuleAnalysisManager>();
-
-  PIC = std::make_unique<PassInstrumentationCallbacks>();
-
-  SI = std::make_unique<StandardInstrumentations>(*context, true);
-
-  SI->registerCallbacks(*PIC, MAM.get());
-  FPM->addPass(PromotePass());
-  FPM->addPass(InstCombinePass());
-  FPM->addPass(ReassociatePass());
-  FPM->addPass(GVNPass());
-  FPM->addPass(SimplifyCFGPass());
-
-  PassBuilder PB;
-  PB.registerModuleAnalyses(*MAM);
-  PB.registerFunctionAnalyses(*FAM);
-  PB.crossRegisterProxies(*LAM, *FAM, *CGAM, *MAM);
-}
-
-static void handleDefinition() {
-  if (auto fnAST = parseDefinition()) {
-    if (auto *fnIR = fnAST->codegen()) {
-      auto TSM = ThreadSafeModule(std::move(module), std::move(context));
-      ExitOnErr(JIT->addModule(std::move(TSM)));
-      InitializeModule();
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
-
-static void handleExtern() {
-  if (auto protoAST = parseExtern()) {
-    if (auto *fnIR = protoAST->codegen()) {
-      fnIR->print(errs());
-      FunctionProtos[protoAST->getName()] = std::move(protoAST);
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
-
-static void handleTopLevelExpression() {
-
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto fnAST = parseTopLevelExpr()) {
-    
-    if (fnAST->codegen()) {
-      auto RT = JIT->getMainJITDylib().createResourceTracker();
-
-      auto TSM = ThreadSafeModule(std::move(module), std::move(context));
-
-      ExitOnErr(JIT->addModule(std::move(TSM), RT));
-      InitializeModule();
-    
-      auto ExprSymbol = ExitOnErr(JIT->lookup("__anon_expr"));
-
-      double (*FP)() = ExprSymbol.getAddress().toPtr<double(*)()>();
-      fprintf(stderr, "Evaluated to %f\n", FP());
-
-      ExitOnErr(RT->remove());
-    }
-  } else {
-    getNextToken();
-  }
-}
-
-/// top ::= definition | external | expression | ';'
-static void mainLoop() {
-  while (true) {
-    switch (CurTok) {
-    case TK_EOF:
-      return;
-    case ';': // ignore top-level semicolons.
-      getNextToken();
-
-      break;
-    case DEF:
-
-      handleDefinition();
-      break;
-    case EXTERN:
-
-      handleExtern();
-      break;
-    default:
-
-      handleTopLevelExpression();
-      break;
-    }
-    fprintf(stderr, "ready> ");
-  }
-}
-
-//===----------------------------------------------------------------------===//
-// "Library" functions that can be "extern'd" from user code.
-//===----------------------------------------------------------------------===//
-
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
-
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
-}
-
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
-}
-
-
-
-int main() {
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmPrinter();
-  InitializeNativeTargetAsmParser();
-  BinopPrecedence['='] = 2;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
-
-  fprintf(stderr, "ready> ");
-  getNextToken();
-
-  JIT = ExitOnErr(KaleidoscopeJIT::Create());
-
-  InitializeModule();
-  mainLoop();
-  module->print(errs(), nullptr);
-}
\ No newline at end of file
@@ -2,13 +2,34 @@
 #define PARSER_H
 
 #include<map>
+#include<optional>
 #include "AST.h"
+#include "Lexer.h"
 
+class Parser {
+    Lexer &lex;
+    std::map<char, int> &binopPrecedence;
 
-static std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> LHS);
-static std::unique_ptr<ExprAST> parseIdentifierExpr();
-static std::unique_ptr<ExprAST> parseExpression();
-static std::unique_ptr<FunctionAST> parseDefinition();
-static std::unique_ptr<ExprAST> parseIdentifierExpr();
-static std::unique_ptr<ExprAST> parseParenExpr();
-#endif
\ No newline at end of file
+    int getTokPrecedence();
+    std::unique_ptr<ExprAST> parseNumberExpr();
+    std::unique_ptr<ExprAST> parseIfExpr();
+    std::unique_ptr<ExprAST> parseForExpr();
+    std::unique_ptr<ExprAST> parseVarExpr();
+    std::unique_ptr<ExprAST> parsePrimary();
+    std::unique_ptr<ExprAST> parseUnary();
+    std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> LHS);
+    std::unique_ptr<ExprAST> parseIdentifierExpr();
+    std::unique_ptr<ExprAST> parseParenExpr();
+    std::unique_ptr<ExprAST> parseExpression();
+    bool parseTypeAnnotation(std::optional<ToyType> &type);
+
+public:
+    Parser(Lexer &lex, std::map<char, int> &binopPrecedence)
+    : lex(lex), binopPrecedence(binopPrecedence) {}
+
+    std::unique_ptr<PrototypeAST> parsePrototype();
+    std::unique_ptr<FunctionAST> parseDefinition();
+    std::unique_ptr<PrototypeAST> parseExtern();
+    std::unique_ptr<FunctionAST> parseTopLevelExpr();
+};
+#endif
@@ -0,0 +1,73 @@
+#include "PerfMap.h"
+
+#include "llvm/Object/SymbolSize.h"
+
+#include <unistd.h>
+
+using namespace llvm;
+
+PerfMap &PerfMap::get() {
+  static PerfMap map;
+  return map;
+}
+
+PerfMap::~PerfMap() {
+  if (file)
+    fclose(file);
+}
+
+void PerfMap::add(uint64_t addr, uint64_t size, StringRef name) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (!file) {
+    std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    file = fopen(path.c_str(), "w");
+    if (!file)
+      return;
+  }
+  fprintf(file, "%llx %llx %.*s\n", (unsigned long long)addr,
+          (unsigned long long)size, (int)name.size(), name.data());
+  // perf may read the map while we are still running.
+  fflush(file);
+}
+
+PerfMapListener &PerfMapListener::get() {
+  static PerfMapListener listener;
+  return listener;
+}
+
+void PerfMapListener::notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                                         const RuntimeDyld::LoadedObjectInfo &L) {
+  // The debug object has its sections at their load addresses.
+  object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+  if (!DebugObj.getBinary())
+    return;
+
+  for (const auto &P : object::computeSymbolSizes(*DebugObj.getBinary())) {
+    const object::SymbolRef &Sym = P.first;
+    auto Type = Sym.getType();
+    if (!Type || *Type != object::SymbolRef::ST_Function) {
+      consumeError(Type.takeError());
+      continue;
+    }
+    auto Name = Sym.getName();
+    auto Addr = Sym.getAddress();
+    if (!Name || !Addr) {
+      consumeError(Name.takeError());
+      consumeError(Addr.takeError());
+      continue;
+    }
+    PerfMap::get().add(*Addr, P.second, *Name);
+  }
+}
+
+void PerfMapPlugin::modifyPassConfig(orc::MaterializationResponsibility &MR,
+                                     jitlink::LinkGraph &G,
+                                     jitlink::PassConfiguration &Config) {
+  Config.PostFixupPasses.push_back([](jitlink::LinkGraph &G) {
+    for (auto *Sym : G.defined_symbols())
+      if (Sym->hasName() && Sym->isCallable())
+        PerfMap::get().add(Sym->getAddress().getValue(), Sym->getSize(),
+                           Sym->getName());
+    return Error::success();
+  });
+}
@@ -0,0 +1,49 @@
+#ifndef PERF_MAP_H
+#define PERF_MAP_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+
+#include <cstdio>
+#include <mutex>
+
+// /tmp/perf-<pid>.map, which perf reads to name samples in anonymous
+// executable memory. One file per process, shared by all sessions.
+class PerfMap {
+    std::mutex lock;
+    FILE *file = nullptr;
+
+public:
+    static PerfMap &get();
+    ~PerfMap();
+    // Records the function name at [addr, addr + size).
+    void add(uint64_t addr, uint64_t size, llvm::StringRef name);
+};
+
+// Reports the functions of every object RuntimeDyld loads to the perf map.
+class PerfMapListener : public llvm::JITEventListener {
+public:
+    static PerfMapListener &get();
+    void notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                            const llvm::RuntimeDyld::LoadedObjectInfo &L) override;
+};
+
+// Reports the functions of every graph JITLink links to the perf map.
+class PerfMapPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+public:
+    void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR,
+                          llvm::jitlink::LinkGraph &G,
+                          llvm::jitlink::PassConfiguration &Config) override;
+    llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility &MR) override {
+        return llvm::Error::success();
+    }
+    llvm::Error notifyRemovingResources(llvm::orc::JITDylib &JD,
+                                        llvm::orc::ResourceKey K) override {
+        return llvm::Error::success();
+    }
+    void notifyTransferringResources(llvm::orc::JITDylib &JD,
+                                     llvm::orc::ResourceKey DstKey,
+                                     llvm::orc::ResourceKey SrcKey) override {}
+};
+
+#endif
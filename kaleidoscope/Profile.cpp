@@ -0,0 +1,58 @@
+#include "Profile.h"
+
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+ProfileCounter *Profile::getCounter(const std::string &name, Kind kind) {
+  std::lock_guard<std::mutex> guard(lock);
+  return &counters[{kind, name}];
+}
+
+void Profile::print(raw_ostream &out) {
+  std::lock_guard<std::mutex> guard(lock);
+
+  for (Kind kind : {Function, Loop}) {
+    // Code may still be running; take a snapshot of each counter.
+    struct Row {
+      const std::string *name;
+      uint64_t count, cycles;
+      bool active;
+    };
+    std::vector<Row> rows;
+    bool anyActive = false;
+    for (auto &entry : counters)
+      if (entry.first.first == kind && entry.second.count.load()) {
+        rows.push_back({&entry.first.second, entry.second.count.load(),
+                        entry.second.cycles.load(), entry.second.depth.load() != 0});
+        anyActive |= rows.back().active;
+      }
+    std::sort(rows.begin(), rows.end(),
+              [](const Row &a, const Row &b) { return a.cycles > b.cycles; });
+
+    const char *countName = kind == Function ? "calls" : "iterations";
+    out << (kind == Function ? "Functions" : "Loops") << " by cycles:\n";
+    out << format("  %-32s %14s %16s %12s\n", (const char *)"name", countName,
+                  (const char *)"cycles", (const char *)"per count");
+    for (auto &row : rows)
+      out << format("  %-32s %14llu %16llu %12llu%s\n", row.name->c_str(),
+                    (unsigned long long)row.count,
+                    (unsigned long long)row.cycles,
+                    (unsigned long long)(row.cycles / row.count),
+                    row.active ? " *" : "");
+    if (anyActive)
+      out << "  * still running, or left by cancelled code: cycles so far are missing\n";
+  }
+  out << "Cycles are inclusive and counted for outermost calls only: recursive\n"
+         "calls add none, and of calls overlapping on several threads only the\n"
+         "last to end adds its own.\n";
+}
+
+void Profile::resetDepths() {
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto &entry : counters)
+    entry.second.depth.store(0);
+}
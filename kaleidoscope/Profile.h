@@ -0,0 +1,46 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Counters of one instrumented function or loop, bumped directly by JIT'd
+// code with atomic adds: clients of a session run its functions on threads of
+// their own. Codegen relies on this exact layout.
+struct ProfileCounter {
+    std::atomic<uint64_t> count{0};  // calls of a function, iterations of a loop
+    std::atomic<uint64_t> cycles{0}; // cycle counter ticks spent inside, inclusive
+    // Calls or loop runs under way, on all threads together. Only one that
+    // ends with no other under way adds its cycles, so recursion is not
+    // counted twice, but calls overlapping on other threads are undercounted.
+    std::atomic<uint64_t> depth{0};
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "JIT'd code updates ProfileCounter fields as plain i64s");
+
+// Profile collected with --profile: one counter per function and per loop.
+class Profile {
+public:
+    enum Kind { Function, Loop };
+
+    // Counter for name, created on first use. Its address never changes, so
+    // it can be baked into generated code. Safe to call from any thread.
+    ProfileCounter *getCounter(const std::string &name, Kind kind);
+    // Prints functions and loops, hottest first.
+    void print(llvm::raw_ostream &out);
+    // Forgets the calls and loop runs under way. For when code was left
+    // with longjmp (see runCancellable), which skips their ends; nothing
+    // else may run code using this profile meanwhile.
+    void resetDepths();
+
+private:
+    std::mutex lock;
+    std::map<std::pair<Kind, std::string>, ProfileCounter> counters;
+};
+
+#endif
@@ -0,0 +1,368 @@
+#include "Runtime.h"
+#include "RuntimeLib.h"
+
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+
+void *ToyArena::allocate(size_t size, llvm::Align alignment) {
+  std::lock_guard<std::mutex> guard(lock);
+  return allocator.Allocate(size, alignment);
+}
+
+size_t ToyArena::getBytesAllocated() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return allocator.getBytesAllocated();
+}
+
+extern "C" ToyArray *toy_array_alloc(ToyArena *arena, double length) {
+  int64_t n = length > 0 ? (int64_t)length : 0;
+
+  auto *array = static_cast<ToyArray *>(
+      arena->allocate(sizeof(ToyArray), llvm::Align::Of<ToyArray>()));
+  array->data = static_cast<double *>(
+      arena->allocate(n * sizeof(double), llvm::Align(ToyArrayAlign)));
+  array->length = n;
+  std::fill_n(array->data, n, 0.0);
+
+  return array;
+}
+
+// Slots a key may be in, starting at its hash.
+static constexpr unsigned MemoProbeLimit = 8;
+
+namespace {
+// A function and its arguments, padded with zeros to MaxMemoArgs.
+struct MemoKey {
+  uint64_t args[MaxMemoArgs] = {};
+
+  MemoKey(unsigned numArgs, const uint64_t *args) {
+    std::copy_n(args, std::min(numArgs, MaxMemoArgs), this->args);
+  }
+};
+} // namespace
+
+static size_t hashMemoKey(const void *fn, const uint64_t *args) {
+  return llvm::hash_combine(fn, llvm::hash_combine_range(args, args + MaxMemoArgs));
+}
+
+static bool sameMemoKey(const void *fn, const uint64_t *args, const void *otherFn,
+                        const uint64_t *otherArgs) {
+  return fn == otherFn && std::equal(args, args + MaxMemoArgs, otherArgs);
+}
+
+bool ToyMemoTable::lookup(const void *fn, unsigned numArgs, const uint64_t *args,
+                          uint64_t &result) {
+  MemoKey key(numArgs, args);
+  std::lock_guard<std::mutex> guard(lock);
+  if (slots.empty())
+    return false;
+
+  size_t mask = slots.size() - 1;
+  size_t h = hashMemoKey(fn, key.args);
+  for (unsigned i = 0; i < MemoProbeLimit; ++i) {
+    Slot &slot = slots[(h + i) & mask];
+    if (!slot.fn)
+      return false;
+    if (sameMemoKey(fn, key.args, slot.fn, slot.args)) {
+      result = slot.result;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ToyMemoTable::insert(const void *fn, unsigned numArgs, const uint64_t *args,
+                          uint64_t result) {
+  MemoKey key(numArgs, args);
+  std::lock_guard<std::mutex> guard(lock);
+  if (slots.empty()) {
+    slots.resize(InitialSlots);
+  } else if (2 * (numEntries + 1) > slots.size() && slots.size() < MaxSlots) {
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    numEntries = 0;
+    for (Slot &slot : old)
+      if (slot.fn)
+        place(slot.fn, slot.args, slot.result);
+  }
+  place(fn, key.args, result);
+}
+
+// Puts the result into the slot of the same key in the key's window, or the
+// first free one, or else over the next victim in the window.
+void ToyMemoTable::place(const void *fn, const uint64_t *args, uint64_t result) {
+  size_t mask = slots.size() - 1;
+  size_t h = hashMemoKey(fn, args);
+  Slot *target = nullptr;
+  for (unsigned i = 0; i < MemoProbeLimit && !target; ++i) {
+    Slot &slot = slots[(h + i) & mask];
+    if (!slot.fn)
+      ++numEntries;
+    if (!slot.fn || sameMemoKey(fn, args, slot.fn, slot.args))
+      target = &slot;
+  }
+  if (!target) {
+    target = &slots[(h + nextVictim++ % MemoProbeLimit) & mask];
+    ++evictions;
+  }
+
+  target->fn = fn;
+  std::copy_n(args, MaxMemoArgs, target->args);
+  target->result = result;
+}
+
+void ToyMemoTable::clear() {
+  std::lock_guard<std::mutex> guard(lock);
+  slots.clear();
+  slots.shrink_to_fit();
+  numEntries = 0;
+}
+
+size_t ToyMemoTable::size() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return numEntries;
+}
+
+uint64_t ToyMemoTable::getEvictions() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return evictions;
+}
+
+extern "C" int toy_memo_lookup(ToyMemoTable *table, const void *fn,
+                               uint32_t numArgs, const uint64_t *args,
+                               uint64_t *result) {
+  return table->lookup(fn, numArgs, args, *result);
+}
+
+extern "C" void toy_memo_insert(ToyMemoTable *table, const void *fn,
+                                uint32_t numArgs, const uint64_t *args,
+                                uint64_t result) {
+  table->insert(fn, numArgs, args, result);
+}
+
+ToySafepoint &getThreadSafepoint() {
+  static thread_local ToySafepoint safepoint;
+  return safepoint;
+}
+
+bool runCancellable(llvm::function_ref<void()> fn) {
+  ToySafepoint &sp = getThreadSafepoint();
+  jmp_buf *outer = sp.cancelTarget.load();
+  jmp_buf target;
+  // A cancel that came in while nothing ran is for an evaluation before this.
+  sp.cancelled.store(false);
+  sp.error.clear();
+  if (setjmp(target)) {
+    sp.cancelTarget = outer;
+    return false;
+  }
+  sp.cancelTarget = &target;
+  fn();
+  sp.cancelTarget = outer;
+  return true;
+}
+
+// Leaves the innermost runCancellable with message as its error; outside of
+// one, ends the process.
+[[noreturn]] static void runtimeError(const char *message) {
+  ToySafepoint &sp = getThreadSafepoint();
+  jmp_buf *target = sp.cancelTarget.load();
+  if (!target) {
+    fprintf(stderr, "Error: %s\n", message);
+    exit(1);
+  }
+  sp.error = message;
+  longjmp(*target, 1);
+}
+
+extern "C" void toy_index_out_of_bounds(double index, int64_t length) {
+  char message[128];
+  snprintf(message, sizeof(message),
+           "Index %g is out of bounds for an array of length %lld", index,
+           (long long)length);
+  runtimeError(message);
+}
+
+// The JIT has already reported why (through ExecutionSession::reportError).
+extern "C" void toy_lazy_call_failed() {
+  runtimeError("A called function could not be compiled or linked");
+}
+
+extern "C" ToySafepoint *toy_safepoint() { return &getThreadSafepoint(); }
+
+extern "C" void toy_safepoint_slow(ToySafepoint *sp) {
+  sp->pending.store(0);
+  if (sp->onPoll && !sp->cancelled.load())
+    sp->onPoll();
+  jmp_buf *target = sp->cancelTarget.load();
+  if (sp->cancelled.exchange(false) && target)
+    longjmp(*target, 1);
+}
+
+const std::vector<std::pair<const char *, const void *>> &getRuntimeSymbols() {
+  using Unary = double (*)(double);
+  using Binary = double (*)(double, double);
+  static const std::vector<std::pair<const char *, const void *>> symbols = {
+      {"toy_array_alloc", (const void *)&toy_array_alloc},
+      {"toy_memo_lookup", (const void *)&toy_memo_lookup},
+      {"toy_memo_insert", (const void *)&toy_memo_insert},
+      {"toy_index_out_of_bounds", (const void *)&toy_index_out_of_bounds},
+      {"toy_safepoint", (const void *)&toy_safepoint},
+      {"toy_safepoint_slow", (const void *)&toy_safepoint_slow},
+      {"putchard", (const void *)&putchard},
+      {"printd", (const void *)&printd},
+      // What the runtime bitcode calls once it is inlined, and what LLVM
+      // turns loops and stdio calls into.
+      {"stderr", (const void *)&stderr},
+      {"fputc", (const void *)&fputc},
+      {"fputs", (const void *)&fputs},
+      {"fwrite", (const void *)&fwrite},
+      {"fprintf", (const void *)&fprintf},
+      {"putchar", (const void *)&putchar},
+      {"memcpy", (const void *)&memcpy},
+      {"memmove", (const void *)&memmove},
+      {"memset", (const void *)&memset},
+      // libm, for `extern sin(x)` and the like.
+      {"sin", (const void *)(Unary)&sin},
+      {"cos", (const void *)(Unary)&cos},
+      {"tan", (const void *)(Unary)&tan},
+      {"asin", (const void *)(Unary)&asin},
+      {"acos", (const void *)(Unary)&acos},
+      {"atan", (const void *)(Unary)&atan},
+      {"sinh", (const void *)(Unary)&sinh},
+      {"cosh", (const void *)(Unary)&cosh},
+      {"tanh", (const void *)(Unary)&tanh},
+      {"exp", (const void *)(Unary)&exp},
+      {"exp2", (const void *)(Unary)&exp2},
+      {"log", (const void *)(Unary)&log},
+      {"log2", (const void *)(Unary)&log2},
+      {"log10", (const void *)(Unary)&log10},
+      {"sqrt", (const void *)(Unary)&sqrt},
+      {"cbrt", (const void *)(Unary)&cbrt},
+      {"fabs", (const void *)(Unary)&fabs},
+      {"floor", (const void *)(Unary)&floor},
+      {"ceil", (const void *)(Unary)&ceil},
+      {"round", (const void *)(Unary)&round},
+      {"trunc", (const void *)(Unary)&trunc},
+      {"pow", (const void *)(Binary)&pow},
+      {"atan2", (const void *)(Binary)&atan2},
+      {"fmod", (const void *)(Binary)&fmod},
+      {"hypot", (const void *)(Binary)&hypot},
+      {"fmin", (const void *)(Binary)&fmin},
+      {"fmax", (const void *)(Binary)&fmax},
+  };
+  return symbols;
+}
+
+#ifdef TOY_HAVE_RUNTIME_BITCODE
+// RuntimeLib.cpp compiled to bitcode at build time (see CMakeLists.txt).
+alignas(4) static const unsigned char RuntimeBitcode[] = {
+#include "RuntimeBitcode.inc"
+};
+
+static llvm::MemoryBufferRef getRuntimeBitcode() {
+  return llvm::MemoryBufferRef(
+      llvm::toStringRef(llvm::ArrayRef<uint8_t>(RuntimeBitcode)), "toy-runtime");
+}
+
+// Functions the bitcode defines, read from it once.
+static llvm::Expected<const std::set<std::string> *> getRuntimeBitcodeFunctions() {
+  static std::string error;
+  static const std::set<std::string> names = [] {
+    llvm::LLVMContext context;
+    std::set<std::string> names;
+    auto M = llvm::getLazyBitcodeModule(getRuntimeBitcode(), context);
+    if (!M) {
+      error = llvm::toString(M.takeError());
+      return names;
+    }
+    for (llvm::Function &F : **M)
+      if (!F.isDeclaration())
+        names.insert(F.getName().str());
+    return names;
+  }();
+  if (!error.empty())
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "cannot read the runtime bitcode: " + error);
+  return &names;
+}
+#endif
+
+llvm::Expected<std::vector<llvm::Function *>>
+linkRuntimeBitcode(llvm::Module &M, const std::set<std::string> &defined) {
+#ifndef TOY_HAVE_RUNTIME_BITCODE
+  return std::vector<llvm::Function *>();
+#else
+  using namespace llvm;
+
+  // Only modules that call into the runtime pay for reading it.
+  auto available = getRuntimeBitcodeFunctions();
+  if (!available)
+    return available.takeError();
+  if (none_of(M, [&](Function &F) {
+        return F.isDeclaration() && (*available)->count(F.getName().str()) &&
+               !defined.count(F.getName().str());
+      }))
+    return std::vector<Function *>();
+
+  auto runtime = parseBitcodeFile(getRuntimeBitcode(), M.getContext());
+  if (!runtime)
+    return runtime.takeError();
+  (*runtime)->setTargetTriple(M.getTargetTriple());
+  (*runtime)->setDataLayout(M.getDataLayout());
+  // Calls to a function toy code defines go to that, not to the runtime's.
+  for (const std::string &name : defined)
+    if (Function *F = (*runtime)->getFunction(name))
+      F->deleteBody();
+
+  // Linked definitions become internal: every module gets its own copy, and
+  // the JIT's symbols keep pointing at the native ones.
+  StringSet<> linked;
+  if (Linker::linkModules(M, std::move(*runtime), Linker::Flags::LinkOnlyNeeded,
+                          [&](Module &M, const StringSet<> &names) {
+                            linked = names;
+                            internalizeModule(M, [&](const GlobalValue &GV) {
+                              return !names.count(GV.getName());
+                            });
+                          }))
+    return createStringError(inconvertibleErrorCode(),
+                             "cannot link the runtime bitcode into " +
+                                 M.getModuleIdentifier());
+
+  std::vector<CallBase *> calls;
+  for (auto &entry : linked)
+    if (Function *F = M.getFunction(entry.getKey()))
+      for (User *U : F->users())
+        if (auto *call = dyn_cast<CallBase>(U))
+          if (call->getCalledFunction() == F &&
+              !linked.count(call->getFunction()->getName()))
+            calls.push_back(call);
+
+  std::set<Function *> callers;
+  for (CallBase *call : calls) {
+    Function *caller = call->getFunction();
+    InlineFunctionInfo IFI;
+    if (InlineFunction(*call, IFI).isSuccess())
+      callers.insert(caller);
+  }
+
+  for (auto &entry : linked)
+    if (Function *F = M.getFunction(entry.getKey()))
+      if (F->use_empty())
+        F->eraseFromParent();
+  return std::vector<Function *>(callers.begin(), callers.end());
+#endif
+}
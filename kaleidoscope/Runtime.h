@@ -0,0 +1,157 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Allocator.h"
+
+#include <atomic>
+#include <csetjmp>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Array data is aligned for the widest vector loads.
+constexpr unsigned ToyArrayAlign = 64;
+
+// Descriptor of a toy array. Codegen relies on this exact layout.
+struct ToyArray {
+    double *data;
+    int64_t length;
+};
+
+// Backing memory of a session's toy arrays. Clients of a session run its
+// functions, which allocate from its arena, on threads of their own, so
+// allocation takes a lock.
+class ToyArena {
+public:
+    void *allocate(size_t size, llvm::Align alignment);
+    size_t getBytesAllocated() const;
+
+private:
+    mutable std::mutex lock;
+    llvm::BumpPtrAllocator allocator;
+};
+
+// Allocates a zeroed array of length elements from the session's arena.
+// Arrays live as long as the session.
+extern "C" ToyArray *toy_array_alloc(ToyArena *arena, double length);
+
+// Most arguments a `memo def` function can have.
+constexpr unsigned MaxMemoArgs = 4;
+
+// Results of a session's `memo def` functions, keyed on the function and the
+// bit patterns of its arguments. Open addressing with a short probe window:
+// the table doubles while it is at most half full, up to MaxSlots; from then
+// on a new result replaces one in its window. Safe to use from any thread.
+class ToyMemoTable {
+public:
+    static constexpr size_t InitialSlots = 1024;
+    static constexpr size_t MaxSlots = 1 << 16;
+
+    bool lookup(const void *fn, unsigned numArgs, const uint64_t *args,
+                uint64_t &result);
+    void insert(const void *fn, unsigned numArgs, const uint64_t *args,
+                uint64_t result);
+    // Forgets every result, e.g. when a function they may depend on changes.
+    void clear();
+
+    size_t size() const;
+    uint64_t getEvictions() const;
+
+private:
+    struct Slot {
+        const void *fn = nullptr; // null for an empty slot
+        uint64_t args[MaxMemoArgs]; // padded with zeros
+        uint64_t result;
+    };
+
+    mutable std::mutex lock;
+    std::vector<Slot> slots;
+    size_t numEntries = 0;
+    uint64_t evictions = 0;
+    unsigned nextVictim = 0;
+
+    void place(const void *fn, const uint64_t *args, uint64_t result);
+};
+
+// Called by the code of a `memo def` function f, with fn the address of f's
+// body. Each argument and the result are passed as their bits in a uint64_t.
+extern "C" int toy_memo_lookup(ToyMemoTable *table, const void *fn,
+                               uint32_t numArgs, const uint64_t *args,
+                               uint64_t *result);
+extern "C" void toy_memo_insert(ToyMemoTable *table, const void *fn,
+                                uint32_t numArgs, const uint64_t *args,
+                                uint64_t result);
+
+// Cooperative preemption. Code compiled with CompilerSession::safepoints
+// polls the ToySafepoint of the thread running it at every function entry and
+// loop back-edge: a load of pending, and a call into the runtime only when it
+// is set.
+struct ToySafepoint {
+    // Loaded by JIT'd code; keep it first.
+    std::atomic<uint32_t> pending{0};
+    std::atomic<bool> cancelled{false};
+    // Run at the next safepoint after request(), on the polling thread, e.g.
+    // to yield or wait for the next time slice. Set it before code runs.
+    std::function<void()> onPoll;
+    // Innermost runCancellable on this thread, null while no JIT'd code runs.
+    // Atomic so that signal handlers and other threads can test it.
+    std::atomic<jmp_buf *> cancelTarget{nullptr};
+    // Why the code run by the last runCancellable stopped, if it stopped with
+    // a runtime error rather than for cancel().
+    std::string error;
+
+    // Makes the thread run onPoll at its next safepoint, then carry on. Safe
+    // from any thread and from signal handlers.
+    void request() { pending.store(1); }
+    // Makes the thread leave the runCancellable it is in at its next
+    // safepoint. Ignored if there is none. Safe like request().
+    void cancel() {
+        cancelled.store(true);
+        pending.store(1);
+    }
+};
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "JIT'd code loads ToySafepoint::pending as a plain i32");
+
+// The calling thread's safepoint.
+ToySafepoint &getThreadSafepoint();
+
+// Calls fn, which runs JIT'd code, on this thread. Returns false if it was
+// cancelled at a safepoint or stopped with a runtime error (then in
+// ToySafepoint::error): fn's frames are then left with longjmp, so fn must
+// not have objects with destructors on the stack around the JIT'd call.
+bool runCancellable(llvm::function_ref<void()> fn);
+
+// Called by JIT'd code for an array index outside [0, length). Leaves the
+// innermost runCancellable with the error; outside of one, ends the process.
+extern "C" [[noreturn]] void toy_index_out_of_bounds(double index, int64_t length);
+// Entered in place of a function whose body the JIT failed to compile or link
+// on its first call (see JITOptions::LazyCallFailed). Leaves the innermost
+// runCancellable with an error like toy_index_out_of_bounds.
+extern "C" [[noreturn]] void toy_lazy_call_failed();
+
+extern "C" ToySafepoint *toy_safepoint();
+// Slow path of a poll that found pending set.
+extern "C" void toy_safepoint_slow(ToySafepoint *sp);
+
+// Addresses of the runtime functions (including RuntimeLib.h) and of the C
+// library functions that toy code or the runtime bitcode commonly call. Every
+// JIT resolves them without searching the process, unless toy code defines
+// a function of the same name.
+const std::vector<std::pair<const char *, const void *>> &getRuntimeSymbols();
+
+// If M calls functions of RuntimeLib.h and toy was built with its bitcode,
+// links their definitions into M as internal functions and inlines them into
+// their callers. Calls to the functions toy code defines (defined) are left
+// alone, even where the runtime has a function of the same name. Returns the
+// functions of M that code was inlined into.
+llvm::Expected<std::vector<llvm::Function *>>
+linkRuntimeBitcode(llvm::Module &M, const std::set<std::string> &defined);
+
+#endif
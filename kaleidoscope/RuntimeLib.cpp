@@ -0,0 +1,17 @@
+// Built twice: into libtoy, and to bitcode that is embedded in it. Keep it
+// free of LLVM and of C++ that needs the C++ runtime (exceptions, statics
+// with constructors), so that the bitcode links into any module.
+
+#include "RuntimeLib.h"
+
+#include <cstdio>
+
+extern "C" double putchard(double X) {
+  fputc((char)X, stderr);
+  return 0;
+}
+
+extern "C" double printd(double X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef RUNTIME_LIB_H
+#define RUNTIME_LIB_H
+
+// "Library" functions that can be "extern'd" from user code. RuntimeLib.cpp
+// is also built to bitcode, which is linked into modules calling these so
+// that they can be inlined (see linkRuntimeBitcode in Runtime.h).
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" double putchard(double X);
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" double printd(double X);
+
+#endif
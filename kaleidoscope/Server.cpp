@@ -0,0 +1,223 @@
+#include "Server.h"
+
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+// How often a request past its deadline is cancelled again: a cancel only
+// lasts until the next top-level expression of the request starts.
+static constexpr std::chrono::milliseconds CancelRetry(10);
+
+namespace {
+// One connection. The event loop appends requests; a worker runs them.
+struct Client {
+  int fd;
+  // Created by the first worker to run a request.
+  std::unique_ptr<CompilerSession> session;
+  // Bytes read after the last complete line.
+  std::string partialLine;
+
+  std::mutex mutex; // guards the fields below
+  std::deque<std::string> requests;
+  bool busy = false; // a worker is running the requests
+  bool hungUp = false;
+  // While a request runs: the safepoint of its worker thread, and when it
+  // runs out of time.
+  ToySafepoint *running = nullptr;
+  Clock::time_point deadline;
+
+  explicit Client(int fd) : fd(fd) {}
+  // Closing only here keeps workers from writing to a reused descriptor.
+  ~Client() { close(fd); }
+};
+} // namespace
+
+static Error socketError(const char *what) {
+  std::error_code EC(errno, std::generic_category());
+  return createStringError(EC, "%s: %s", what, EC.message().c_str());
+}
+
+// Blocks until all of text is sent; gives up once the client is gone.
+static void reply(Client &client, StringRef text) {
+  while (!text.empty()) {
+    ssize_t n = ::send(client.fd, text.data(), text.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    text = text.drop_front(n);
+  }
+}
+
+static void replyError(Client &client, Error Err) {
+  std::string message = toString(std::move(Err));
+  SmallVector<StringRef, 4> lines;
+  StringRef(message).split(lines, '\n');
+  for (StringRef line : lines)
+    reply(client, ("! " + line + "\n").str());
+}
+
+// Runs the client's requests until there are none left.
+static void serveRequests(CompilerSession &stdlib, Client &client,
+                          std::chrono::milliseconds evalTimeout) {
+  while (true) {
+    std::string request;
+    {
+      std::lock_guard<std::mutex> lock(client.mutex);
+      if (client.requests.empty() || client.hungUp) {
+        client.busy = false;
+        return;
+      }
+      request = std::move(client.requests.front());
+      client.requests.pop_front();
+      client.running = &getThreadSafepoint();
+      client.deadline = evalTimeout.count() ? Clock::now() + evalTimeout
+                                            : Clock::time_point::max();
+    }
+    auto finished = make_scope_exit([&] {
+      std::lock_guard<std::mutex> lock(client.mutex);
+      client.running = nullptr;
+    });
+
+    if (!client.session) {
+      auto session = stdlib.createClientSession();
+      if (!session) {
+        replyError(client, session.takeError());
+        reply(client, ".\n");
+        continue;
+      }
+      client.session = std::move(*session);
+    }
+
+    // Commands would let a client load and save files as the server.
+    Error Err = client.session->compile(
+        request,
+        [&](double value) {
+          char line[32];
+          snprintf(line, sizeof(line), "= %.17g\n", value);
+          reply(client, line);
+        },
+        /*allowCommands=*/false);
+    if (Err)
+      replyError(client, std::move(Err));
+    reply(client, ".\n");
+  }
+}
+
+// Cancels the requests that ran out of time; returns the poll timeout (in
+// milliseconds) until the next deadline, or -1 if there is none.
+static int cancelOverdue(std::map<int, std::shared_ptr<Client>> &clients) {
+  Clock::time_point now = Clock::now(), next = Clock::time_point::max();
+  for (auto &entry : clients) {
+    Client &client = *entry.second;
+    std::lock_guard<std::mutex> lock(client.mutex);
+    if (!client.running)
+      continue;
+    if (client.deadline <= now) {
+      client.running->cancel();
+      next = std::min(next, now + CancelRetry);
+    } else {
+      next = std::min(next, client.deadline);
+    }
+  }
+  if (next == Clock::time_point::max())
+    return -1;
+  // Rounded up, so that poll does not wake just before the deadline.
+  auto wait = std::chrono::ceil<std::chrono::milliseconds>(next - now);
+  return (int)std::min<int64_t>(wait.count(), INT_MAX);
+}
+
+Error serveUnixSocket(CompilerSession &stdlib, StringRef socketPath,
+                      unsigned numWorkers, std::chrono::milliseconds evalTimeout) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path))
+    return createStringError(inconvertibleErrorCode(),
+                             "socket path too long: %s", socketPath.str().c_str());
+  memcpy(addr.sun_path, socketPath.data(), socketPath.size());
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0)
+    return socketError("socket");
+  auto closeListener = make_scope_exit([&] { close(listenFd); });
+
+  // A socket file left behind by an earlier server would make bind fail.
+  unlink(addr.sun_path);
+  if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    return socketError("bind");
+  if (listen(listenFd, SOMAXCONN) < 0)
+    return socketError("listen");
+
+  ThreadPool workers(hardware_concurrency(numWorkers));
+  std::map<int, std::shared_ptr<Client>> clients;
+  std::vector<pollfd> fds;
+
+  while (true) {
+    fds.clear();
+    fds.push_back({listenFd, POLLIN, 0});
+    for (auto &entry : clients)
+      fds.push_back({entry.first, POLLIN, 0});
+
+    int timeout = evalTimeout.count() ? cancelOverdue(clients) : -1;
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      return socketError("poll");
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listenFd, nullptr, nullptr);
+      if (fd >= 0)
+        clients[fd] = std::make_shared<Client>(fd);
+    }
+
+    for (size_t i = 1; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+      std::shared_ptr<Client> client = clients[fds[i].fd];
+
+      char buf[4096];
+      ssize_t n = read(client->fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        // Its worker, if any, stops what it runs, drops the session and
+        // closes the socket.
+        std::lock_guard<std::mutex> lock(client->mutex);
+        client->hungUp = true;
+        if (client->running)
+          client->running->cancel();
+        clients.erase(client->fd);
+        continue;
+      }
+
+      client->partialLine.append(buf, n);
+      size_t end;
+      std::lock_guard<std::mutex> lock(client->mutex);
+      while ((end = client->partialLine.find('\n')) != std::string::npos) {
+        StringRef line = StringRef(client->partialLine).take_front(end).rtrim("\r");
+        if (!line.trim().empty())
+          client->requests.push_back(line.str());
+        client->partialLine.erase(0, end + 1);
+      }
+      if (!client->busy && !client->requests.empty()) {
+        client->busy = true;
+        workers.async([&stdlib, client, evalTimeout] {
+          serveRequests(stdlib, *client, evalTimeout);
+        });
+      }
+    }
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "CompilerSession.h"
+
+#include <chrono>
+
+// Serves evaluation requests on the Unix domain socket socketPath until an
+// error occurs. Every connection gets a client session of stdlib (see
+// CompilerSession::createClientSession), so the library is compiled once for
+// all of them.
+//
+// A request is one line of toy source. Each top-level expression in it is
+// answered by a line "= <value>" as soon as it has run, errors by lines
+// "! <message>", and the reply ends with a line ".". REPL commands such as
+// ":load" are answered with an error. Requests of one connection run in
+// order; different connections run in parallel on numWorkers threads (0 for
+// one per core).
+//
+// With stdlib.safepoints set, a request still running after evalTimeout (if
+// not zero) is cancelled and answered with an error, as is the request of a
+// connection that hangs up, so runaway code does not keep a worker.
+Error serveUnixSocket(CompilerSession &stdlib, StringRef socketPath,
+                      unsigned numWorkers = 0,
+                      std::chrono::milliseconds evalTimeout = {});
+
+#endif
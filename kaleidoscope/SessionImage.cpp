@@ -0,0 +1,286 @@
+//===----------------------------------------------------------------------===//
+// Session images: a session's functions compiled to object files, together
+// with what is needed to call them from new code, in one file that is mapped
+// and linked as is.
+//
+// Layout (integers little endian, strings as a u32 length and the bytes):
+//   "TOYIMG01"
+//   triple, CPU, CPU features, data layout   must match the loading host
+//   u64 image id                              unique body names per image
+//   u32 n, n x (u8 operator, i32 precedence)
+//   u32 n, n x prototype: name, u8 isOperator, u32 precedence,
+//                         u8 return type, u32 n, n x (argument, u8 type)
+//   u32 n, n x function: name, body symbol, u64 offset, u64 size
+//   objects, each 16-byte aligned; offsets count from the first one
+//===----------------------------------------------------------------------===//
+
+#include "CompilerSession.h"
+#include "ErrorHandler.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <random>
+
+static constexpr char ImageMagic[] = "TOYIMG01";
+static constexpr size_t ObjectAlign = 16;
+
+static void writeU8(std::string &out, uint8_t v) { out += (char)v; }
+
+static void writeU32(std::string &out, uint32_t v) {
+  for (int i = 0; i < 4; ++i)
+    out += (char)(v >> (8 * i));
+}
+
+static void writeU64(std::string &out, uint64_t v) {
+  for (int i = 0; i < 8; ++i)
+    out += (char)(v >> (8 * i));
+}
+
+static void writeString(std::string &out, StringRef s) {
+  writeU32(out, s.size());
+  out += s;
+}
+
+static StringRef readString(DataExtractor &DE, DataExtractor::Cursor &C) {
+  uint32_t size = DE.getU32(C);
+  return DE.getBytes(C, size);
+}
+
+Error CompilerSession::saveImage(StringRef path) {
+  if (!TM)
+    return createStringError(inconvertibleErrorCode(),
+                             "no target machine to compile the image with");
+
+  // Functions are compiled again by a session of their own, so that no
+  // specialization or profile counter of this process ends up in the image.
+  CompilerSession saver(DL);
+  saver.BinopPrecedence = BinopPrecedence;
+  saver.DefinedFunctions = DefinedFunctions;
+  for (auto &entry : FunctionProtos)
+    saver.FunctionProtos[entry.first] =
+        std::make_unique<PrototypeAST>(*entry.second);
+
+  std::random_device seed;
+  uint64_t imageId = ((uint64_t)seed() << 32) | seed();
+
+  struct SavedFunction {
+    std::string name, symbol, object;
+  };
+  std::vector<SavedFunction> functions;
+  SimpleCompiler compile(*TM);
+  for (auto &entry : FunctionDefs) {
+    ErrorCapture errors;
+    Function *f = entry.second->codegen(saver);
+    if (!f)
+      return joinErrors(createStringError(inconvertibleErrorCode(),
+                                          "could not compile '%s'",
+                                          entry.first.c_str()),
+                        errors.takeError());
+
+    std::string symbol = entry.first + ".img" + utohexstr(imageId);
+    f->setName(symbol);
+    auto TSM = saver.takeModule();
+    auto obj = TSM.withModuleDo([&](Module &M) { return compile(M); });
+    if (!obj)
+      return obj.takeError();
+    functions.push_back({entry.first, symbol, (*obj)->getBuffer().str()});
+  }
+  for (auto &entry : ImageBodies)
+    functions.push_back(
+        {entry.first, entry.second.symbol, entry.second.object.str()});
+
+  std::string header(ImageMagic, sizeof(ImageMagic) - 1);
+  writeString(header, TM->getTargetTriple().str());
+  writeString(header, TM->getTargetCPU());
+  writeString(header, TM->getTargetFeatureString());
+  writeString(header, DL.getStringRepresentation());
+  writeU64(header, imageId);
+
+  writeU32(header, BinopPrecedence.size());
+  for (auto &entry : BinopPrecedence) {
+    writeU8(header, entry.first);
+    writeU32(header, (uint32_t)entry.second);
+  }
+
+  // Prototypes of specializations and top-level expressions are internal.
+  std::set<std::string> internal;
+  for (auto &entry : Specializations)
+    for (auto &spec : entry.second)
+      internal.insert(spec.name);
+  std::vector<const PrototypeAST *> protos;
+  for (auto &entry : FunctionProtos)
+    if (!internal.count(entry.first) &&
+        !StringRef(entry.first).starts_with("__anon_expr"))
+      protos.push_back(entry.second.get());
+
+  writeU32(header, protos.size());
+  for (const PrototypeAST *p : protos) {
+    const PrototypeAST &proto = *p;
+    writeString(header, proto.getName());
+    writeU8(header, proto.isUnaryOp() || proto.isBinaryOp());
+    writeU32(header, proto.getBinaryPrecedence());
+    writeU8(header, (uint8_t)proto.getReturnType());
+    writeU32(header, proto.getArgs().size());
+    for (size_t i = 0; i < proto.getArgs().size(); ++i) {
+      writeString(header, proto.getArgs()[i]);
+      writeU8(header, (uint8_t)proto.getArgTypes()[i]);
+    }
+  }
+
+  writeU32(header, functions.size());
+  uint64_t offset = 0;
+  for (auto &fn : functions) {
+    writeString(header, fn.name);
+    writeString(header, fn.symbol);
+    writeU64(header, offset);
+    writeU64(header, fn.object.size());
+    offset = alignTo(offset + fn.object.size(), ObjectAlign);
+  }
+  header.resize(alignTo(header.size(), ObjectAlign));
+
+  std::error_code EC;
+  raw_fd_ostream out(path, EC);
+  if (EC)
+    return createFileError(path, EC);
+  out << header;
+  for (auto &fn : functions) {
+    out << fn.object;
+    out.write_zeros(offsetToAlignment(fn.object.size(), Align(ObjectAlign)));
+  }
+  out.close();
+  if (out.has_error())
+    return createFileError(path, out.error());
+  return Error::success();
+}
+
+Error CompilerSession::loadImage(StringRef path) {
+  if (!JIT)
+    return createStringError(inconvertibleErrorCode(),
+                             "session has no JIT to load an image into");
+
+  auto buffer = MemoryBuffer::getFile(path, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!buffer)
+    return createFileError(path, buffer.getError());
+  StringRef image = (*buffer)->getBuffer();
+
+  auto invalid = [&](const char *why) {
+    return createStringError(inconvertibleErrorCode(), "%s: %s",
+                             path.str().c_str(), why);
+  };
+  if (!image.starts_with(StringRef(ImageMagic, sizeof(ImageMagic) - 1)))
+    return invalid("not a toy session image");
+
+  DataExtractor DE(image, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+  DataExtractor::Cursor C(sizeof(ImageMagic) - 1);
+  StringRef triple = readString(DE, C);
+  StringRef CPU = readString(DE, C);
+  StringRef features = readString(DE, C);
+  StringRef layout = readString(DE, C);
+  uint64_t imageId = DE.getU64(C);
+  if (!C)
+    return joinErrors(invalid("truncated header"), C.takeError());
+  if (!TM || triple != TM->getTargetTriple().str() ||
+      CPU != TM->getTargetCPU() || features != TM->getTargetFeatureString() ||
+      layout != DL.getStringRepresentation())
+    return invalid("compiled for another target or CPU");
+  if (ImageIds.count(imageId))
+    return invalid("already loaded");
+
+  std::vector<std::pair<char, int>> operators;
+  for (uint32_t n = DE.getU32(C); C && n; --n) {
+    char op = DE.getU8(C);
+    operators.emplace_back(op, (int)DE.getU32(C));
+  }
+
+  std::vector<PrototypeAST> protos;
+  for (uint32_t n = DE.getU32(C); C && n; --n) {
+    std::string name = readString(DE, C).str();
+    bool isOperator = DE.getU8(C);
+    unsigned precedence = DE.getU32(C);
+    auto returnType = (ToyType)DE.getU8(C);
+    std::vector<std::string> args;
+    std::vector<ToyType> argTypes;
+    for (uint32_t i = DE.getU32(C); C && i; --i) {
+      args.push_back(readString(DE, C).str());
+      argTypes.push_back((ToyType)DE.getU8(C));
+    }
+    protos.emplace_back(name, std::move(args), isOperator, precedence,
+                        std::move(argTypes), returnType);
+  }
+
+  struct LoadedFunction {
+    std::string name, symbol;
+    uint64_t offset, size;
+  };
+  std::vector<LoadedFunction> functions;
+  for (uint32_t n = DE.getU32(C); C && n; --n) {
+    LoadedFunction fn;
+    fn.name = readString(DE, C).str();
+    fn.symbol = readString(DE, C).str();
+    fn.offset = DE.getU64(C);
+    fn.size = DE.getU64(C);
+    functions.push_back(std::move(fn));
+  }
+  if (!C)
+    return joinErrors(invalid("truncated header"), C.takeError());
+
+  StringRef objects = image.drop_front(alignTo(C.tell(), ObjectAlign));
+  for (auto &fn : functions)
+    if (fn.offset > objects.size() || fn.size > objects.size() - fn.offset)
+      return invalid("object out of bounds");
+
+  // Functions of the session the image cannot replace. Like a redefinition,
+  // it cannot change a signature. Neither can it replace a function calls to
+  // which were specialized from its AST, which the image does not have.
+  std::set<std::string> rejected;
+  for (auto &proto : protos) {
+    const std::string &name = proto.getName();
+    auto known = FunctionProtos.find(name);
+    if (BodyTrackers.count(name) && known != FunctionProtos.end() &&
+        !known->second->hasSameSignature(proto)) {
+      LogError(("Image cannot replace '" + name + "': it changes its signature").c_str());
+      rejected.insert(name);
+    }
+  }
+  for (auto &fn : functions) {
+    auto SI = Specializations.find(fn.name);
+    if (SI != Specializations.end() && !SI->second.empty() &&
+        rejected.insert(fn.name).second)
+      LogError(("Image cannot replace '" + fn.name +
+                "': calls to it have been specialized").c_str());
+  }
+
+  for (auto &op : operators)
+    if (!rejected.count(std::string("binary") + op.first))
+      BinopPrecedence[op.first] = op.second;
+  for (auto &proto : protos)
+    if (!rejected.count(proto.getName()))
+      FunctionProtos[proto.getName()] = std::make_unique<PrototypeAST>(proto);
+
+  for (auto &fn : functions) {
+    if (rejected.count(fn.name))
+      continue;
+
+    StringRef object = objects.substr(fn.offset, fn.size);
+    auto RT = JD->createResourceTracker();
+    if (auto Err = JIT->addObjectFile(
+            MemoryBuffer::getMemBuffer(object, fn.symbol,
+                                       /*RequiresNullTerminator=*/false),
+            RT))
+      return Err;
+    if (auto Err = redirectBody(fn.name, fn.symbol, std::move(RT)))
+      return Err;
+
+    FunctionDefs.erase(fn.name);
+    ImageBodies[fn.name] = {fn.symbol, object};
+    if (auto Err = invalidateFunction(fn.name))
+      return Err;
+  }
+
+  ImageIds.insert(imageId);
+  Images.push_back(std::move(*buffer));
+  return Error::success();
+}
@@ -0,0 +1,159 @@
+#include "Simplify.h"
+
+#include "llvm/Support/MathExtras.h"
+
+#include <cmath>
+#include <cstdint>
+#include <set>
+
+// Literals the lexer marks as integers are exact up to this magnitude.
+static constexpr double MaxExactInt = 9007199254740992.0; // 2^53
+
+static bool isIntLiteral(const ExprAST &e, int64_t value) {
+  auto *num = dyn_cast<NumberExprAST>(&e);
+  return num && num->isIntegerLiteral() && num->getValue() == value;
+}
+
+// The type codegen will give e, if it follows from literals and the types in
+// env alone.
+static std::optional<ToyType> knownType(const ExprAST &e, const TypeEnv &env) {
+  if (auto *num = dyn_cast<NumberExprAST>(&e))
+    return num->getType();
+
+  if (auto *var = dyn_cast<VariableExprAST>(&e)) {
+    auto EI = env.find(var->getName());
+    if (EI == env.end())
+      return std::nullopt;
+    return EI->second;
+  }
+
+  if (auto *bin = dyn_cast<BinaryExprAST>(&e)) {
+    char op = bin->getOp();
+    if (op != '+' && op != '-' && op != '*' && op != '<')
+      return std::nullopt;
+    auto l = knownType(bin->getLHS(), env), r = knownType(bin->getRHS(), env);
+    if (!l || !r || *l == ToyType::Array || *r == ToyType::Array)
+      return std::nullopt;
+    if (op == '<')
+      return ToyType::Bool;
+    return *l == ToyType::Double || *r == ToyType::Double ? ToyType::Double : ToyType::Int;
+  }
+  return std::nullopt;
+}
+
+static bool isNumeric(std::optional<ToyType> type) {
+  return type == ToyType::Int || type == ToyType::Double;
+}
+
+// Folds op over two literals, or returns nullptr for an operator it does not
+// know.
+static std::unique_ptr<ExprAST> foldBinary(char op, const NumberExprAST &l,
+                                           const NumberExprAST &r) {
+  if (l.getType() != ToyType::Double && r.getType() != ToyType::Double) {
+    // Bools widen to i64. A result an integer literal could not spell, one
+    // that overflows i64 or is past 2^53, is a double instead, as the lexer
+    // makes such a literal one.
+    int64_t a = (int64_t)l.getValue(), b = (int64_t)r.getValue();
+    int64_t result;
+    bool overflow;
+    switch (op) {
+    case '+': overflow = AddOverflow(a, b, result); break;
+    case '-': overflow = SubOverflow(a, b, result); break;
+    case '*': overflow = MulOverflow(a, b, result); break;
+    case '<': return std::make_unique<NumberExprAST>(a < b, ToyType::Bool);
+    default: return nullptr;
+    }
+    if (!overflow && std::fabs((double)result) <= MaxExactInt)
+      return std::make_unique<NumberExprAST>((double)result, ToyType::Int);
+  }
+
+  double a = l.getValue(), b = r.getValue();
+  switch (op) {
+  case '+': return std::make_unique<NumberExprAST>(a + b);
+  case '-': return std::make_unique<NumberExprAST>(a - b);
+  case '*': return std::make_unique<NumberExprAST>(a * b);
+  // Codegen compares unordered: NaN operands make '<' true.
+  case '<': return std::make_unique<NumberExprAST>(!(a >= b), ToyType::Bool);
+  default: return nullptr;
+  }
+}
+
+void simplifyExpr(std::unique_ptr<ExprAST> &e, const TypeEnv &env) {
+  e->forEachChild([&](std::unique_ptr<ExprAST> &child) { simplifyExpr(child, env); });
+
+  if (auto *bin = dyn_cast<BinaryExprAST>(e.get())) {
+    char op = bin->getOp();
+    if (op != '+' && op != '-' && op != '*' && op != '<')
+      return;
+
+    auto *l = dyn_cast<NumberExprAST>(&bin->getLHS());
+    auto *r = dyn_cast<NumberExprAST>(&bin->getRHS());
+    if (l && r) {
+      if (auto folded = foldBinary(op, *l, *r)) {
+        folded->setLocation(bin->getLocation());
+        e = std::move(folded);
+      }
+      return;
+    }
+
+    // Only integer identities: a double 0 or 1 would widen an int operand.
+    // The other operand must be a number of a known type, since codegen
+    // rejects arrays and widens bools; x + 0 also needs x to be an int, as
+    // -0.0 + 0 is +0.0.
+    auto lType = knownType(bin->getLHS(), env), rType = knownType(bin->getRHS(), env);
+    if (op == '-' && isIntLiteral(bin->getRHS(), 0) && isNumeric(lType))
+      e = bin->takeLHS();
+    else if (op == '+' && isIntLiteral(bin->getRHS(), 0) && lType == ToyType::Int)
+      e = bin->takeLHS();
+    else if (op == '+' && isIntLiteral(bin->getLHS(), 0) && rType == ToyType::Int)
+      e = bin->takeRHS();
+    else if (op == '*' && isIntLiteral(bin->getRHS(), 1) && isNumeric(lType))
+      e = bin->takeLHS();
+    else if (op == '*' && isIntLiteral(bin->getLHS(), 1) && isNumeric(rType))
+      e = bin->takeRHS();
+    return;
+  }
+
+  if (auto *ifExpr = dyn_cast<IfExprAST>(e.get())) {
+    // Only ifs whose branches are both literals: otherwise codegen still has
+    // to check the dropped branch and widen the taken one to the common
+    // type, and leaves the dead branch for LLVM to remove.
+    auto *cond = dyn_cast<NumberExprAST>(&ifExpr->getCond());
+    auto *thenNum = dyn_cast<NumberExprAST>(&ifExpr->getThen());
+    auto *elseNum = dyn_cast<NumberExprAST>(&ifExpr->getElse());
+    if (!cond || !thenNum || !elseNum)
+      return;
+
+    // Same widening as codegen: double over int over bool.
+    auto rank = [](ToyType t) { return t == ToyType::Double ? 2 : t == ToyType::Int ? 1 : 0; };
+    ToyType type = rank(thenNum->getType()) < rank(elseNum->getType()) ? elseNum->getType()
+                                                                       : thenNum->getType();
+    // Same test as codegen: ordered and not equal to zero.
+    double c = cond->getValue();
+    double value = c != 0.0 && !std::isnan(c) ? thenNum->getValue() : elseNum->getValue();
+    auto folded = std::make_unique<NumberExprAST>(value, type);
+    folded->setLocation(ifExpr->getLocation());
+    e = std::move(folded);
+  }
+}
+
+static void collectBoundNames(ExprAST &e, std::set<std::string> &names) {
+  if (auto *var = dyn_cast<VarExprAST>(&e)) {
+    for (auto &binding : var->getVarNames())
+      names.insert(binding.first);
+  } else if (auto *loop = dyn_cast<ForExprAST>(&e)) {
+    names.insert(loop->getVarName());
+  }
+  e.forEachChild([&](std::unique_ptr<ExprAST> &child) { collectBoundNames(*child, names); });
+}
+
+TypeEnv getArgumentTypes(const PrototypeAST &proto, ExprAST &body) {
+  std::set<std::string> bound;
+  collectBoundNames(body, bound);
+
+  TypeEnv env;
+  for (unsigned i = 0, e = proto.getArgs().size(); i != e; ++i)
+    if (!bound.count(proto.getArgs()[i]))
+      env[proto.getArgs()[i]] = proto.getArgTypes()[i];
+  return env;
+}
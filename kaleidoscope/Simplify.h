@@ -0,0 +1,18 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "AST.h"
+
+// Folds constant subexpressions of e in place: arithmetic and comparisons on
+// literals, ifs with a literal condition and literal branches, and +0, -0 and
+// *1 with an integer literal when env proves the other operand a number.
+// Folding follows codegen's semantics exactly, so it never changes the value
+// or the type of an expression, with one exception codegen never sees: int
+// arithmetic on literals that overflows or passes 2^53 yields a double, as a
+// literal that large would.
+void simplifyExpr(std::unique_ptr<ExprAST> &e, const TypeEnv &env);
+
+// The declared types of proto's arguments that no var or for in body rebinds.
+TypeEnv getArgumentTypes(const PrototypeAST &proto, ExprAST &body);
+
+#endif
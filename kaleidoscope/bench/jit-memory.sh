@@ -0,0 +1,65 @@
+#!/bin/sh
+# Compares the two JIT backends, RuntimeDyld (the default) and JITLink with
+# slab-allocated memory (--jitlink), on many small functions: peak resident
+# memory, JIT code and data bytes, the time to load the functions, and the
+# time of a loop calling functions spread over all of them.
+#
+#   bench/jit-memory.sh <toy> [functions] [calls]
+#
+# functions defaults to 5000 and calls (loop iterations, 64 calls each) to
+# 200000.
+set -e
+
+toy=${1:?usage: jit-memory.sh <toy> [functions] [calls]}
+functions=${2:-5000}
+calls=${3:-200000}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Distinct bodies, so that none is shared with another.
+awk -v n="$functions" 'BEGIN {
+  for (i = 0; i < n; i++)
+    printf "def f%d(x) x * %d + 1;\n", i, i + 2
+}' > "$tmp/load.toy"
+
+# 64 callees spread evenly over the definitions.
+awk -v n="$functions" -v calls="$calls" 'BEGIN {
+  printf "def bench(n: int) var s = 0 in (for r = 0, r < n - 1 in s = s"
+  for (i = 0; i < 64; i++)
+    printf " + f%d(r)", int(i * n / 64)
+  printf ") + s;\n"
+  printf "bench(%d);\n", calls
+}' > "$tmp/calls.toy"
+
+cat "$tmp/load.toy" > "$tmp/load-only.toy"
+echo ":stats" >> "$tmp/load-only.toy"
+cat "$tmp/load.toy" "$tmp/calls.toy" > "$tmp/load-calls.toy"
+
+now() { date +%s.%N; }
+
+# Seconds toy takes to run script $1 with the flags after it.
+run() {
+  script=$1
+  shift
+  start=$(now)
+  "$toy" --no-pipeline "$@" < "$script" > "$tmp/out" 2>&1
+  end=$(now)
+  echo "$end - $start" | bc
+}
+
+stat() { awk -F: -v key="$1" '$1 == key { gsub(/ /, "", $2); print $2 }' "$tmp/out"; }
+
+printf '%-10s %10s %12s %12s %10s %10s\n' \
+  backend functions "code+data" "peak RSS MiB" "load s" "calls s"
+for backend in rtdyld jitlink; do
+  flags=
+  [ $backend = jitlink ] && flags=--jitlink
+  both=$(run "$tmp/load-calls.toy" $flags)
+  load=$(run "$tmp/load-only.toy" $flags)
+  code=$(stat "JIT code bytes")
+  data=$(stat "JIT data bytes")
+  rss=$(stat "process peak RSS")
+  printf '%-10s %10d %12d %12.1f %10.2f %10.2f\n' $backend "$functions" \
+    $((code + data)) "$(echo "$rss / 1048576" | bc -l)" "$load" \
+    "$(echo "$both - $load" | bc)"
+done
@@ -0,0 +1,8 @@
+# cmake -DINPUT=<file> -DOUTPUT=<file.inc> -P EmbedFile.cmake
+#
+# Writes the bytes of INPUT as a comma-separated list of hex literals, to be
+# #included into the initializer of a char array.
+file(READ "${INPUT}" bytes HEX)
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${bytes}")
+string(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n" bytes "${bytes}")
+file(WRITE "${OUTPUT}" "${bytes}\n")
@@ -0,0 +1,139 @@
+#include "BulkEval.h"
+#include "CompilerSession.h"
+#include "Runtime.h"
+#include "Server.h"
+
+#include "llvm/Support/Process.h"
+
+#include <csignal>
+#include <fstream>
+#include <sstream>
+
+// With --safepoints, Ctrl-C cancels the evaluation running on the main thread.
+// With none running, it ends toy as it would without --safepoints.
+static ToySafepoint *InterruptTarget = nullptr;
+
+static void interrupt(int sig) {
+  if (InterruptTarget->cancelTarget.load()) {
+    InterruptTarget->cancel();
+    return;
+  }
+  std::signal(sig, SIG_DFL);
+  std::raise(sig);
+}
+
+/// toy [--jitlink] [--perf] [--gdb] [--profile] [--memory-budget <MiB>]
+///     [--remarks=<file.yaml>] [--load <image>] [--bulk <function> <input>]
+///     [--serve <socket> [--eval-timeout <ms>]] [--mlir]
+///     [--mlir-pipeline=<passes>] [--no-pipeline] [--safepoints] [file]
+///
+/// With --serve, file is compiled once as the library every client of the
+/// socket can call; --eval-timeout (which implies --safepoints) cancels a
+/// request still running after ms milliseconds. --mlir compiles definitions through MLIR's affine
+/// dialect where possible; --mlir-pipeline (which implies it) replaces the
+/// default MLIR pass pipeline. A script piped to stdin is parsed ahead of
+/// execution on another thread unless --no-pipeline is given. --safepoints
+/// compiles polls into functions and loops, so that Ctrl-C cancels the running
+/// evaluation instead of ending toy.
+int main(int argc, char **argv) {
+  ExitOnError ExitOnErr;
+  std::string file, bulkFn, bulkInput, remarksFile, socketPath, imageFile;
+  JITOptions jitOpts;
+  bool profile = false;
+  bool useMLIR = false;
+  bool pipeline = true;
+  bool safepoints = false;
+  std::string mlirPipeline;
+  uint64_t memoryBudgetMiB = 0;
+  unsigned evalTimeoutMs = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    StringRef arg = argv[i];
+    if (arg == "--bulk" && i + 2 < argc) {
+      bulkFn = argv[++i];
+      bulkInput = argv[++i];
+    } else if (arg == "--serve" && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (arg == "--load" && i + 1 < argc) {
+      imageFile = argv[++i];
+    } else if (arg == "--jitlink") {
+      jitOpts.UseJITLink = true;
+    } else if (arg == "--perf") {
+      jitOpts.PerfMap = true;
+    } else if (arg == "--gdb") {
+      jitOpts.GDBRegistration = true;
+    } else if (arg == "--profile") {
+      profile = true;
+    } else if (arg == "--safepoints") {
+      safepoints = true;
+    } else if (arg == "--no-pipeline") {
+      pipeline = false;
+    } else if (arg == "--mlir") {
+      useMLIR = true;
+    } else if (arg.starts_with("--mlir-pipeline=")) {
+      useMLIR = true;
+      mlirPipeline = arg.drop_front(strlen("--mlir-pipeline=")).str();
+    } else if (arg.starts_with("--remarks=")) {
+      remarksFile = arg.drop_front(strlen("--remarks=")).str();
+    } else if (arg == "--eval-timeout" && i + 1 < argc) {
+      if (StringRef(argv[++i]).getAsInteger(10, evalTimeoutMs)) {
+        fprintf(stderr, "Error: invalid evaluation timeout %s\n", argv[i]);
+        return 1;
+      }
+      safepoints = true;
+    } else if (arg == "--memory-budget" && i + 1 < argc) {
+      if (StringRef(argv[++i]).getAsInteger(10, memoryBudgetMiB)) {
+        fprintf(stderr, "Error: invalid memory budget %s\n", argv[i]);
+        return 1;
+      }
+    } else {
+      file = argv[i];
+    }
+  }
+
+  auto S = ExitOnErr(CompilerSession::Create(jitOpts));
+  if (profile)
+    S->enableProfiling();
+  S->memoryBudget = memoryBudgetMiB * 1024 * 1024;
+  if (safepoints) {
+    S->safepoints = true;
+    InterruptTarget = &getThreadSafepoint();
+    std::signal(SIGINT, interrupt);
+  }
+  if (!file.empty())
+    S->sourceName = file;
+  if (!remarksFile.empty())
+    ExitOnErr(S->enableRemarks(remarksFile));
+  if (useMLIR)
+    ExitOnErr(S->enableMLIR(mlirPipeline));
+  if (!imageFile.empty())
+    ExitOnErr(S->loadImage(imageFile));
+
+  if (!file.empty()) {
+    std::ifstream in(file);
+    if (!in) {
+      fprintf(stderr, "Error: could not open %s\n", file.c_str());
+      return 1;
+    }
+    std::stringstream src;
+    src << in.rdbuf();
+    ExitOnErr(S->loadFile(src.str()));
+  } else if (bulkFn.empty() && socketPath.empty()) {
+    if (pipeline && !sys::Process::StandardInIsUserInput())
+      ExitOnErr(S->runPipelined());
+    else
+      S->mainLoop();
+  }
+
+  if (!socketPath.empty())
+    ExitOnErr(serveUnixSocket(*S, socketPath, 0,
+                              std::chrono::milliseconds(evalTimeoutMs)));
+
+  if (!bulkFn.empty())
+    ExitOnErr(runBulkEvaluation(*S, bulkFn, bulkInput, outs()));
+  if (S->profile)
+    S->profile->print(errs());
+  if (!bulkFn.empty())
+    return 0;
+  S->module->print(errs(), nullptr);
+}
@@ -0,0 +1,120 @@
+// Runs toy sessions on several threads at once and checks what they compute.
+// Exits with 1 if a check fails; built with -fsanitize=thread, it also
+// reports the data races between them.
+
+#include "CompilerSession.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static ExitOnError ExitOnErr("Error: ");
+static bool Failed = false;
+
+static void check(bool ok, const std::string &what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what.c_str());
+    Failed = true;
+  }
+}
+
+// Toy loops test their condition after the body, so i < len(a) - 1 is the
+// last index.
+static const char *ArrayLibrary = R"(
+def store(a: array x) for i = 0, i < len(a) - 1 in a[i] = x;
+def fill(n x) var a = array(n) in store(a, x) + sum(a);
+)";
+
+// Clients of one library session call a library function at the same time.
+// Its arrays all come from the library's arena, and the calls all bump the
+// library's profile counters.
+static void testClientsCallingLibrary() {
+  constexpr unsigned NumClients = 3;
+  constexpr unsigned Calls = 20000;
+  constexpr double Length = 32;
+
+  auto library = ExitOnErr(CompilerSession::Create());
+  library->enableProfiling();
+  ExitOnErr(library->compile(ArrayLibrary));
+
+  std::vector<std::unique_ptr<CompilerSession>> clients;
+  for (unsigned c = 0; c < NumClients; ++c)
+    clients.push_back(ExitOnErr(library->createClientSession()));
+
+  std::vector<unsigned> wrong(NumClients);
+  std::vector<std::thread> threads;
+  for (unsigned c = 0; c < NumClients; ++c)
+    threads.emplace_back([&, c] {
+      auto *fill = ExitOnErr(clients[c]->lookup<double(double, double)>("fill"));
+      double x = c + 1;
+      for (unsigned i = 0; i < Calls; ++i)
+        if (fill(Length, x) != Length * x)
+          ++wrong[c];
+    });
+  for (auto &thread : threads)
+    thread.join();
+
+  for (unsigned c = 0; c < NumClients; ++c)
+    check(wrong[c] == 0, "client " + std::to_string(c) + " got " +
+                             std::to_string(wrong[c]) + " wrong sums");
+  uint64_t calls =
+      library->profile->getCounter("fill", Profile::Function)->count.load();
+  check(calls == NumClients * Calls,
+        "fill counted " + std::to_string(calls) + " calls");
+}
+
+// Compiles rounds redefinitions of f in a session of its own and runs each;
+// returns how many gave the wrong value.
+static unsigned compileRounds(unsigned session, unsigned rounds) {
+  auto S = ExitOnErr(CompilerSession::Create());
+  unsigned wrong = 0;
+  for (unsigned r = 0; r < rounds; ++r) {
+    std::string source = "def f(x) x * " + std::to_string(session + 1) + " + " +
+                         std::to_string(r) + "; f(2);";
+    double result = -1;
+    ExitOnErr(S->compile(source, [&](double value) { result = value; }));
+    if (result != 2.0 * (session + 1) + r)
+      ++wrong;
+  }
+  return wrong;
+}
+
+// Independent sessions compile and run the same function names on several
+// threads at once, and each sees only its own definitions. Also reports how
+// compile throughput scales from one thread to all of them.
+static void testIndependentSessions() {
+  constexpr unsigned Rounds = 200;
+  unsigned numThreads = std::clamp(std::thread::hardware_concurrency(), 2u, 8u);
+
+  using Clock = std::chrono::steady_clock;
+  auto start = Clock::now();
+  check(compileRounds(0, Rounds) == 0, "single session got wrong values");
+  double single = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<unsigned> wrong(numThreads);
+  std::vector<std::thread> threads;
+  start = Clock::now();
+  for (unsigned t = 0; t < numThreads; ++t)
+    threads.emplace_back([&, t] { wrong[t] = compileRounds(t, Rounds); });
+  for (auto &thread : threads)
+    thread.join();
+  double parallel = std::chrono::duration<double>(Clock::now() - start).count();
+
+  for (unsigned t = 0; t < numThreads; ++t)
+    check(wrong[t] == 0, "session " + std::to_string(t) + " got " +
+                             std::to_string(wrong[t]) + " wrong values");
+  fprintf(stderr, "%u sessions compiled %.0f definitions/s, one session %.0f (%.2fx)\n",
+          numThreads, numThreads * Rounds / parallel, Rounds / single,
+          numThreads * single / parallel);
+}
+
+int main() {
+  testIndependentSessions();
+  testClientsCallingLibrary();
+  if (Failed)
+    return 1;
+  fprintf(stderr, "PASS\n");
+  return 0;
+}
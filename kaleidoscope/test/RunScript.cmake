@@ -0,0 +1,36 @@
+# Runs TOY with SCRIPT on stdin and checks its output against the script's
+# "# CHECK: " lines (see CMakeLists.txt).
+file(STRINGS ${SCRIPT} lines)
+set(args)
+set(checks)
+foreach(line IN LISTS lines)
+  if(line MATCHES "^# ARGS: (.*)$")
+    separate_arguments(extra UNIX_COMMAND "${CMAKE_MATCH_1}")
+    list(APPEND args ${extra})
+  elseif(line MATCHES "^# CHECK: (.*)$")
+    list(APPEND checks "${CMAKE_MATCH_1}")
+  endif()
+endforeach()
+
+# Paths in scripts, e.g. of :load, are relative to the script.
+get_filename_component(dir ${SCRIPT} DIRECTORY)
+execute_process(COMMAND ${TOY} ${args}
+  INPUT_FILE ${SCRIPT}
+  WORKING_DIRECTORY ${dir}
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE output
+  RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "toy exited with ${result}:\n${output}")
+endif()
+
+set(rest "${output}")
+foreach(check IN LISTS checks)
+  string(FIND "${rest}" "${check}" pos)
+  if(pos EQUAL -1)
+    message(FATAL_ERROR "expected \"${check}\" in the rest of:\n${rest}")
+  endif()
+  string(LENGTH "${check}" length)
+  math(EXPR pos "${pos} + ${length}")
+  string(SUBSTRING "${rest}" ${pos} -1 rest)
+endforeach()
@@ -0,0 +1,99 @@
+// Talks to serveUnixSocket as a client would and checks its replies. Exits
+// with 1 if a check fails.
+
+#include "Server.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+static ExitOnError ExitOnErr("Error: ");
+static bool Failed = false;
+
+static void check(bool ok, const std::string &what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what.c_str());
+    Failed = true;
+  }
+}
+
+// Connects to the server at path, retrying while it starts up.
+static int connectTo(const std::string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0)
+      return fd;
+    if (fd >= 0)
+      close(fd);
+    usleep(10000);
+  }
+  return -1;
+}
+
+// Sends one request line and returns its reply, up to and including ".".
+static std::string request(int fd, const std::string &line) {
+  std::string text = line + "\n";
+  if (write(fd, text.data(), text.size()) != (ssize_t)text.size())
+    return "";
+  std::string reply;
+  char c;
+  while (read(fd, &c, 1) == 1) {
+    reply += c;
+    if (reply == ".\n" || StringRef(reply).ends_with("\n.\n"))
+      break;
+  }
+  return reply;
+}
+
+// REPL commands would run with the server's files and stats, so a request
+// only gets an error for them, and the connection keeps working afterwards.
+static void testCommandsRejected(const std::string &path) {
+  int fd = connectTo(path);
+  check(fd >= 0, "could not connect to " + path);
+  if (fd < 0)
+    return;
+
+  std::string reply = request(fd, "1 + 2;");
+  check(reply == "= 3\n.\n", "1 + 2 replied '" + reply + "'");
+
+  for (const char *command : {":stats", ":profile", ":load /dev/null", ":save x.img"}) {
+    reply = request(fd, command);
+    check(StringRef(reply).starts_with("! ") &&
+              reply.find("is not available") != std::string::npos &&
+              StringRef(reply).ends_with("\n.\n"),
+          std::string(command) + " replied '" + reply + "'");
+  }
+
+  reply = request(fd, "def twice(x) 2 * x; twice(4);");
+  check(reply == "= 8\n.\n", "twice(4) replied '" + reply + "'");
+  close(fd);
+}
+
+int main() {
+  char dir[] = "/tmp/toy-server-test-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string path = std::string(dir) + "/toy.sock";
+
+  // serveUnixSocket only returns on an error, so the server thread and its
+  // library session are left running when main returns.
+  CompilerSession *stdlib = ExitOnErr(CompilerSession::Create()).release();
+  std::thread([=] { ExitOnErr(serveUnixSocket(*stdlib, path, 1)); }).detach();
+
+  testCommandsRejected(path);
+
+  unlink(path.c_str());
+  rmdir(dir);
+  if (Failed)
+    return 1;
+  fprintf(stderr, "PASS\n");
+  return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Times the matrix kernels in this directory through toy --mlir, with the
+# MLIR pipeline minus the toy affine passes, with each of them, and with
+# toy's default pipeline, which has tiling and unrolling.
+#
+#   mlir/bench/run.sh <toy built with -DTOY_ENABLE_MLIR=ON> [runs]
+#
+# Prints the best wall time of runs (default 5) per kernel and pipeline.
+set -e
+
+toy=${1:?usage: run.sh <toy> [runs]}
+runs=${2:-5}
+dir=$(dirname "$0")
+
+prefix="affine-loop-normalize,affine-loop-invariant-code-motion,affine-scalrep,affine-loop-fusion"
+suffix="canonicalize,cse),lower-affine,convert-scf-to-cf,convert-arith-to-llvm,convert-cf-to-llvm,finalize-memref-to-llvm,convert-func-to-llvm,reconcile-unrealized-casts"
+
+pipeline() {
+  echo "func.func($prefix,$1$suffix"
+}
+
+best() {
+  best=
+  i=0
+  while [ $i -lt "$runs" ]; do
+    start=$(date +%s.%N)
+    "$toy" "$@" >/dev/null 2>&1
+    end=$(date +%s.%N)
+    t=$(echo "$end - $start" | bc)
+    if [ -z "$best" ] || [ "$(echo "$t < $best" | bc)" = 1 ]; then
+      best=$t
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+printf '%-14s %-10s %s\n' kernel pipeline seconds
+for kernel in matmul smallmat; do
+  for variant in baseline tile unroll parallel default; do
+    case $variant in
+    baseline) opt="--mlir-pipeline=$(pipeline)" ;;
+    tile) opt="--mlir-pipeline=$(pipeline affine-tile-bands,)" ;;
+    unroll) opt="--mlir-pipeline=$(pipeline affine-full-unroll{max-trip-count=4},)" ;;
+    parallel) opt="--mlir-pipeline=$(pipeline affine-parallelize-loops,)" ;;
+    default) opt=--mlir ;;
+    esac
+    printf '%-14s %-10s %s\n' "$kernel" "$variant" \
+      "$(best "$opt" "$dir/$kernel.toy")"
+  done
+done
@@ -0,0 +1,32 @@
+#include "lib/Transform/Affine/AffineFullUnroll.h"
+#include "lib/Transform/Affine/Passes.h"
+
+#include "mlir/Dialect/Affine/Analysis/LoopAnalysis.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/LoopUtils.h"
+
+namespace mlir {
+namespace toy {
+
+void AffineFullUnrollPass::runOnOperation() {
+    // The walk is post-order: inner loops come before the loops around them.
+    SmallVector<affine::AffineForOp> loops;
+    getOperation()->walk([&](affine::AffineForOp op) { loops.push_back(op); });
+
+    for (affine::AffineForOp op : loops) {
+        std::optional<uint64_t> tripCount = affine::getConstantTripCount(op);
+        if (!tripCount || *tripCount > maxTripCount)
+            continue;
+        if (failed(affine::loopUnrollFull(op))) {
+            op.emitError("unrolling failed");
+            return signalPassFailure();
+        }
+    }
+}
+
+std::unique_ptr<Pass> createAffineFullUnrollPass(unsigned maxTripCount) {
+    return std::make_unique<AffineFullUnrollPass>(maxTripCount);
+}
+
+} // namespace toy
+} // namespace mlir
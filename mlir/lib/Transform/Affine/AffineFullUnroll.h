@@ -1,14 +1,42 @@
 #ifndef AFFINE_FULL_UNROLL_H
 #define AFFINE_FULL_UNROLL_H
 
+#include "mlir/Dialect/Func/IR/FuncOps.h"
 #include "mlir/Pass/Pass.h"
 #include "llvm/ADT/StringRef.h"
 
-class AffineFullUnrollPass : public PassWrapper<AffineFullUnrollPass, OperationPass<mlir::func::FuncOp>>{
+namespace mlir {
+namespace toy {
+
+// Fully unrolls every affine.for whose trip count is a constant of at most
+// max-trip-count. Inner loops go first, so a nest of small loops unrolls
+// completely.
+class AffineFullUnrollPass
+    : public PassWrapper<AffineFullUnrollPass, OperationPass<func::FuncOp>> {
+public:
+    MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(AffineFullUnrollPass)
+
+    AffineFullUnrollPass() = default;
+    AffineFullUnrollPass(const AffineFullUnrollPass &pass) : PassWrapper(pass) {}
+    explicit AffineFullUnrollPass(unsigned maxTripCount) {
+        this->maxTripCount = maxTripCount;
+    }
+
+    StringRef getArgument() const final { return "affine-full-unroll"; }
+    StringRef getDescription() const final {
+        return "Fully unroll affine loops with a small constant trip count";
+    }
+
 private:
     void runOnOperation() override;
 
-    StringRef getArgument
+    Option<unsigned> maxTripCount{
+        *this, "max-trip-count",
+        llvm::cl::desc("Largest trip count of a loop that is unrolled"),
+        llvm::cl::init(16)};
 };
 
-#endif
\ No newline at end of file
+} // namespace toy
+} // namespace mlir
+
+#endif
@@ -0,0 +1,38 @@
+#include "lib/Transform/Affine/AffineParallelize.h"
+#include "lib/Transform/Affine/Passes.h"
+
+#include "mlir/Dialect/Affine/Analysis/AffineAnalysis.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/Utils.h"
+
+namespace mlir {
+namespace toy {
+
+void AffineParallelizePass::runOnOperation() {
+    struct Candidate {
+        affine::AffineForOp loop;
+        SmallVector<affine::LoopReduction> reductions;
+    };
+    // Collected first: converting replaces the loop op.
+    std::vector<Candidate> candidates;
+    getOperation()->walk<WalkOrder::PreOrder>([&](affine::AffineForOp op) {
+        SmallVector<affine::LoopReduction> reductions;
+        if (!affine::isLoopParallel(op, parallelReductions ? &reductions : nullptr))
+            return WalkResult::advance();
+        candidates.push_back({op, std::move(reductions)});
+        return outermostOnly ? WalkResult::skip() : WalkResult::advance();
+    });
+
+    for (Candidate &candidate : candidates)
+        if (failed(affine::affineParallelize(candidate.loop, candidate.reductions))) {
+            candidate.loop.emitError("conversion to affine.parallel failed");
+            return signalPassFailure();
+        }
+}
+
+std::unique_ptr<Pass> createAffineParallelizePass() {
+    return std::make_unique<AffineParallelizePass>();
+}
+
+} // namespace toy
+} // namespace mlir
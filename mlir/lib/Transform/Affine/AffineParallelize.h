@@ -0,0 +1,43 @@
+#ifndef AFFINE_PARALLELIZE_H
+#define AFFINE_PARALLELIZE_H
+
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Pass/Pass.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace mlir {
+namespace toy {
+
+// Turns affine.for loops without loop-carried dependences into
+// affine.parallel. By default only the outermost parallel loop of a nest is
+// converted, which is the one worth running on several threads.
+class AffineParallelizePass
+    : public PassWrapper<AffineParallelizePass, OperationPass<func::FuncOp>> {
+public:
+    MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(AffineParallelizePass)
+
+    AffineParallelizePass() = default;
+    AffineParallelizePass(const AffineParallelizePass &pass) : PassWrapper(pass) {}
+
+    StringRef getArgument() const final { return "affine-parallelize-loops"; }
+    StringRef getDescription() const final {
+        return "Convert dependence-free affine.for loops to affine.parallel";
+    }
+
+private:
+    void runOnOperation() override;
+
+    Option<bool> outermostOnly{
+        *this, "outermost-only",
+        llvm::cl::desc("Leave loops inside a parallel loop sequential"),
+        llvm::cl::init(true)};
+    Option<bool> parallelReductions{
+        *this, "parallel-reductions",
+        llvm::cl::desc("Also convert loops whose only carried values are reductions"),
+        llvm::cl::init(false)};
+};
+
+} // namespace toy
+} // namespace mlir
+
+#endif
@@ -0,0 +1,54 @@
+#include "lib/Transform/Affine/AffineTile.h"
+#include "lib/Transform/Affine/Passes.h"
+
+#include "mlir/Dialect/Affine/Analysis/AffineAnalysis.h"
+#include "mlir/Dialect/Affine/Analysis/LoopAnalysis.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/LoopUtils.h"
+
+namespace mlir {
+namespace toy {
+
+// Tiling runs the iterations of a band in another order. That is only safe
+// if no dependence is carried backwards by any of its loops.
+static bool isFullyPermutable(ArrayRef<affine::AffineForOp> band) {
+    std::vector<SmallVector<affine::DependenceComponent, 2>> dependences;
+    affine::getDependenceComponents(band.front(), band.size(), &dependences);
+    for (auto &components : dependences)
+        for (auto &component : components)
+            if (!component.lb || *component.lb < 0)
+                return false;
+    return true;
+}
+
+void AffineTilePass::runOnOperation() {
+    std::vector<SmallVector<affine::AffineForOp, 6>> bands;
+    affine::getTileableBands(getOperation(), &bands);
+
+    for (auto &band : bands) {
+        // A single loop would only be strip-mined.
+        if (band.size() < 2 || !isFullyPermutable(band))
+            continue;
+
+        // Loops shorter than a tile gain nothing from it.
+        bool allShort = llvm::all_of(band, [&](affine::AffineForOp op) {
+            std::optional<uint64_t> tripCount = affine::getConstantTripCount(op);
+            return tripCount && *tripCount <= tileSize;
+        });
+        if (allShort)
+            continue;
+
+        SmallVector<unsigned, 6> tileSizes(band.size(), tileSize);
+        if (failed(affine::tilePerfectlyNested(band, tileSizes))) {
+            band.front().emitError("tiling failed");
+            return signalPassFailure();
+        }
+    }
+}
+
+std::unique_ptr<Pass> createAffineTilePass(unsigned tileSize) {
+    return std::make_unique<AffineTilePass>(tileSize);
+}
+
+} // namespace toy
+} // namespace mlir
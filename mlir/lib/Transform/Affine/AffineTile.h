@@ -0,0 +1,39 @@
+#ifndef AFFINE_TILE_H
+#define AFFINE_TILE_H
+
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Pass/Pass.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace mlir {
+namespace toy {
+
+// Tiles every band of at least two perfectly nested affine loops by
+// tile-size in each dimension, if the dependences in the band allow any
+// order of its iterations.
+class AffineTilePass
+    : public PassWrapper<AffineTilePass, OperationPass<func::FuncOp>> {
+public:
+    MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(AffineTilePass)
+
+    AffineTilePass() = default;
+    AffineTilePass(const AffineTilePass &pass) : PassWrapper(pass) {}
+    explicit AffineTilePass(unsigned tileSize) { this->tileSize = tileSize; }
+
+    StringRef getArgument() const final { return "affine-tile-bands"; }
+    StringRef getDescription() const final {
+        return "Tile perfectly nested affine loop bands";
+    }
+
+private:
+    void runOnOperation() override;
+
+    Option<unsigned> tileSize{*this, "tile-size",
+                              llvm::cl::desc("Iterations per tile in each loop"),
+                              llvm::cl::init(32)};
+};
+
+} // namespace toy
+} // namespace mlir
+
+#endif
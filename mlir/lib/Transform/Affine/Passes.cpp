@@ -0,0 +1,16 @@
+#include "lib/Transform/Affine/Passes.h"
+#include "lib/Transform/Affine/AffineFullUnroll.h"
+#include "lib/Transform/Affine/AffineParallelize.h"
+#include "lib/Transform/Affine/AffineTile.h"
+
+namespace mlir {
+namespace toy {
+
+void registerAffinePasses() {
+    PassRegistration<AffineFullUnrollPass>();
+    PassRegistration<AffineTilePass>();
+    PassRegistration<AffineParallelizePass>();
+}
+
+} // namespace toy
+} // namespace mlir
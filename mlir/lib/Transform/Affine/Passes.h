@@ -0,0 +1,22 @@
+#ifndef AFFINE_PASSES_H
+#define AFFINE_PASSES_H
+
+#include "mlir/Pass/Pass.h"
+
+#include <memory>
+
+namespace mlir {
+namespace toy {
+
+std::unique_ptr<Pass> createAffineFullUnrollPass(unsigned maxTripCount = 16);
+std::unique_ptr<Pass> createAffineTilePass(unsigned tileSize = 32);
+std::unique_ptr<Pass> createAffineParallelizePass();
+
+// Makes the passes above known to pass pipelines and mlir-opt style drivers
+// by their arguments.
+void registerAffinePasses();
+
+} // namespace toy
+} // namespace mlir
+
+#endif
@@ -0,0 +1,61 @@
+// RUN: toy-opt %s --affine-parallelize-loops | FileCheck %s
+// RUN: toy-opt %s --affine-parallelize-loops=parallel-reductions=true \
+// RUN:   | FileCheck %s --check-prefix=REDUCE
+
+// CHECK-LABEL: func.func @scale
+// CHECK: affine.parallel (%{{.*}}) = (0) to (64) {
+// CHECK-NOT: affine.for
+// CHECK: return
+func.func @scale(%a: memref<64xf64>, %b: memref<64xf64>, %f: f64) {
+  affine.for %i = 0 to 64 {
+    %x = affine.load %a[%i] : memref<64xf64>
+    %y = arith.mulf %x, %f : f64
+    affine.store %y, %b[%i] : memref<64xf64>
+  }
+  return
+}
+
+// Only the outermost loop of a nest is converted.
+// CHECK-LABEL: func.func @copy2d
+// CHECK: affine.parallel (%{{.*}}) = (0) to (32) {
+// CHECK: affine.for %{{.*}} = 0 to 32 {
+func.func @copy2d(%a: memref<32x32xf64>, %b: memref<32x32xf64>) {
+  affine.for %i = 0 to 32 {
+    affine.for %j = 0 to 32 {
+      %x = affine.load %a[%i, %j] : memref<32x32xf64>
+      affine.store %x, %b[%i, %j] : memref<32x32xf64>
+    }
+  }
+  return
+}
+
+// Each iteration reads the previous one's result: not parallel.
+// CHECK-LABEL: func.func @prefix_sum
+// CHECK-NOT: affine.parallel
+// CHECK: affine.for %{{.*}} = 1 to 64 {
+func.func @prefix_sum(%a: memref<64xf64>) {
+  affine.for %i = 1 to 64 {
+    %x = affine.load %a[%i - 1] : memref<64xf64>
+    %y = affine.load %a[%i] : memref<64xf64>
+    %s = arith.addf %x, %y : f64
+    affine.store %s, %a[%i] : memref<64xf64>
+  }
+  return
+}
+
+// A reduction is carried from one iteration to the next, so it stays
+// sequential unless parallel-reductions is set.
+// CHECK-LABEL: func.func @sum
+// CHECK-NOT: affine.parallel
+// CHECK: affine.for %{{.*}} = 0 to 64 iter_args
+// REDUCE-LABEL: func.func @sum
+// REDUCE: affine.parallel (%{{.*}}) = (0) to (64) reduce ("addf") -> (f64) {
+func.func @sum(%a: memref<64xf64>) -> f64 {
+  %zero = arith.constant 0.0 : f64
+  %r = affine.for %i = 0 to 64 iter_args(%acc = %zero) -> (f64) {
+    %x = affine.load %a[%i] : memref<64xf64>
+    %s = arith.addf %acc, %x : f64
+    affine.yield %s : f64
+  }
+  return %r : f64
+}
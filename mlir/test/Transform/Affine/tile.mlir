@@ -0,0 +1,49 @@
+// RUN: toy-opt %s --affine-tile-bands=tile-size=16 | FileCheck %s
+
+// CHECK-LABEL: func.func @matmul
+// CHECK-COUNT-3: affine.for %{{.*}} = 0 to 64 step 16 {
+// CHECK-COUNT-3: affine.for %{{.*}} = #map{{[0-9]*}}(%{{.*}}) to #map{{[0-9]*}}(%{{.*}}) {
+// CHECK: arith.mulf
+func.func @matmul(%a: memref<64x64xf64>, %b: memref<64x64xf64>, %c: memref<64x64xf64>) {
+  affine.for %i = 0 to 64 {
+    affine.for %j = 0 to 64 {
+      affine.for %k = 0 to 64 {
+        %x = affine.load %a[%i, %k] : memref<64x64xf64>
+        %y = affine.load %b[%k, %j] : memref<64x64xf64>
+        %z = affine.load %c[%i, %j] : memref<64x64xf64>
+        %p = arith.mulf %x, %y : f64
+        %s = arith.addf %z, %p : f64
+        affine.store %s, %c[%i, %j] : memref<64x64xf64>
+      }
+    }
+  }
+  return
+}
+
+// Loops no longer than a tile are left alone.
+// CHECK-LABEL: func.func @short
+// CHECK-NOT: step
+// CHECK: return
+func.func @short(%m: memref<8x8xf64>, %v: f64) {
+  affine.for %i = 0 to 8 {
+    affine.for %j = 0 to 8 {
+      affine.store %v, %m[%i, %j] : memref<8x8xf64>
+    }
+  }
+  return
+}
+
+// a[i][j] depends on a[i-1][j+1]: the dependence goes backwards in j, so the
+// band may not be reordered.
+// CHECK-LABEL: func.func @skewed
+// CHECK-NOT: step
+// CHECK: return
+func.func @skewed(%a: memref<64x64xf64>) {
+  affine.for %i = 1 to 64 {
+    affine.for %j = 0 to 63 {
+      %v = affine.load %a[%i - 1, %j + 1] : memref<64x64xf64>
+      affine.store %v, %a[%i, %j] : memref<64x64xf64>
+    }
+  }
+  return
+}
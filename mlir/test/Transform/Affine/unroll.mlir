@@ -0,0 +1,51 @@
+// RUN: toy-opt %s --affine-full-unroll=max-trip-count=4 | FileCheck %s
+
+// CHECK-LABEL: func.func @small
+// CHECK-NOT: affine.for
+// CHECK-COUNT-4: affine.store
+// CHECK-NOT: affine.store
+// CHECK: return
+func.func @small(%m: memref<4xf64>, %v: f64) {
+  affine.for %i = 0 to 4 {
+    affine.store %v, %m[%i] : memref<4xf64>
+  }
+  return
+}
+
+// Inner loops unroll first, so the whole nest goes.
+// CHECK-LABEL: func.func @nest
+// CHECK-NOT: affine.for
+// CHECK-COUNT-6: affine.store
+// CHECK-NOT: affine.store
+// CHECK: return
+func.func @nest(%m: memref<3x2xf64>, %v: f64) {
+  affine.for %i = 0 to 3 {
+    affine.for %j = 0 to 2 {
+      affine.store %v, %m[%i, %j] : memref<3x2xf64>
+    }
+  }
+  return
+}
+
+// A trip count above the threshold keeps the loop.
+// CHECK-LABEL: func.func @too_large
+// CHECK: affine.for %{{.*}} = 0 to 5 {
+// CHECK-NEXT: affine.store
+// CHECK-NOT: affine.store
+// CHECK: return
+func.func @too_large(%m: memref<5xf64>, %v: f64) {
+  affine.for %i = 0 to 5 {
+    affine.store %v, %m[%i] : memref<5xf64>
+  }
+  return
+}
+
+// So does one that is not a constant.
+// CHECK-LABEL: func.func @dynamic
+// CHECK: affine.for %{{.*}} = 0 to %{{.*}} {
+func.func @dynamic(%m: memref<?xf64>, %n: index, %v: f64) {
+  affine.for %i = 0 to %n {
+    affine.store %v, %m[%i] : memref<?xf64>
+  }
+  return
+}
@@ -0,0 +1,19 @@
+# lit configuration for the toy-opt tests.
+
+import os
+
+import lit.formats
+from lit.llvm import llvm_config
+
+config.name = "TOY_OPT"
+config.test_format = lit.formats.ShTest(not llvm_config.use_lit_shell)
+config.suffixes = [".mlir"]
+
+config.test_source_root = os.path.dirname(__file__)
+config.test_exec_root = os.path.join(config.toy_opt_obj_root, "test")
+
+llvm_config.use_default_substitutions()
+llvm_config.with_environment("PATH", config.llvm_tools_dir, append_path=True)
+llvm_config.add_tool_substitutions(
+    ["toy-opt"], [config.toy_opt_tools_dir, config.llvm_tools_dir]
+)
@@ -0,0 +1,20 @@
+#include "lib/Transform/Affine/Passes.h"
+
+#include "mlir/IR/DialectRegistry.h"
+#include "mlir/InitAllDialects.h"
+#include "mlir/InitAllExtensions.h"
+#include "mlir/InitAllPasses.h"
+#include "mlir/Tools/mlir-opt/MlirOptMain.h"
+
+// mlir-opt with the toy affine passes, e.g.
+//   toy-opt --affine-full-unroll=max-trip-count=8 kernel.mlir
+int main(int argc, char **argv) {
+    mlir::DialectRegistry registry;
+    mlir::registerAllDialects(registry);
+    mlir::registerAllExtensions(registry);
+    mlir::registerAllPasses();
+    mlir::toy::registerAffinePasses();
+
+    return mlir::asMainReturnCode(
+        mlir::MlirOptMain(argc, argv, "Toy affine pass driver\n", registry));
+}